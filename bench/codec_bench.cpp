@@ -0,0 +1,133 @@
+#include "wavecodec.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <spdlog/fmt/fmt.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Compares wavecodec against zlib levels 1, 3 and 9 on simulated captures and on any recorded raw
+// code files (raw output, .npy files or plain uint8 dumps) given on the command line.
+//
+//   codec_bench [recorded files...]
+namespace
+{
+    constexpr std::size_t POINTS = 12000000;
+    constexpr int REPEAT = 3;
+
+    double best_seconds(const std::function<void()> &fn)
+    {
+        double best = 1e30;
+        for (int i = 0; i < REPEAT; i++)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            fn();
+            best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    }
+
+    void report(const std::string &data, const char *codec, std::size_t raw, std::size_t encoded, double encode_s,
+                double decode_s, bool ok)
+    {
+        std::cout << fmt::format("{:<24} {:<10} {:>8.3f} {:>12.1f} {:>12.1f} {}\n", data, codec,
+                                 double(raw) / encoded, raw / encode_s / 1e6, raw / decode_s / 1e6,
+                                 ok ? "" : "ROUND TRIP FAILED");
+    }
+
+    bool run(const std::string &name, const std::vector<uint8_t> &data)
+    {
+        bool all_ok = true;
+        std::vector<uint8_t> encoded;
+        std::vector<uint8_t> decoded;
+
+        const double encode_s = best_seconds([&] { wavecodec::encode(data.data(), data.size(), encoded); });
+        const double decode_s = best_seconds([&] { wavecodec::decode(encoded.data(), encoded.size(), decoded); });
+        bool ok = decoded == data;
+        all_ok = all_ok && ok;
+        report(name, "wavecodec", data.size(), encoded.size(), encode_s, decode_s, ok);
+
+        for (int level : {1, 3, 9})
+        {
+            uLongf size = 0;
+            encoded.resize(compressBound(data.size()));
+            const double zlib_encode_s = best_seconds([&] {
+                size = encoded.size();
+                compress2(encoded.data(), &size, data.data(), data.size(), level);
+            });
+
+            decoded.assign(data.size(), 0);
+            const double zlib_decode_s = best_seconds([&] {
+                uLongf decoded_size = decoded.size();
+                uncompress(decoded.data(), &decoded_size, encoded.data(), size);
+            });
+            ok = decoded == data;
+            all_ok = all_ok && ok;
+            report(name, fmt::format("zlib-{}", level).c_str(), data.size(), size, zlib_encode_s, zlib_decode_s, ok);
+        }
+
+        return all_ok;
+    }
+
+    // Same shape as the capture simulator: a sine with a couple of codes of noise
+    std::vector<uint8_t> simulated_sine(unsigned period, int noise)
+    {
+        std::vector<uint8_t> data(POINTS);
+        uint32_t seed = 12345;
+        for (std::size_t i = 0; i < data.size(); i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            const int n = noise ? int(seed >> 16) % (2 * noise + 1) - noise : 0;
+            data[i] = (uint8_t)std::clamp(int(128 + 90 * std::sin(2 * M_PI * i / period)) + n, 0, 255);
+        }
+        return data;
+    }
+
+    std::vector<uint8_t> simulated_pulses()
+    {
+        std::vector<uint8_t> data(POINTS);
+        uint32_t seed = 777;
+        for (std::size_t i = 0; i < data.size(); i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            data[i] = (uint8_t)((i % 10000 < 200 ? 200 : 60) + int(seed >> 16) % 3 - 1);
+        }
+        return data;
+    }
+
+    std::vector<uint8_t> load(const std::string &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (data.size() > 10 && std::memcmp(data.data(), "\x93NUMPY", 6) == 0)
+        {
+            uint16_t header_length;
+            std::memcpy(&header_length, data.data() + 8, 2);
+            data.erase(data.begin(), data.begin() + std::min<std::size_t>(data.size(), 10 + header_length));
+        }
+        return data;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    std::cout << fmt::format("{:<24} {:<10} {:>8} {:>12} {:>12}\n", "data", "codec", "ratio", "enc [MB/s]",
+                             "dec [MB/s]");
+
+    bool ok = true;
+    ok = run("sine, noise +-2", simulated_sine(1250, 2)) && ok;
+    ok = run("sine, noise +-8", simulated_sine(1250, 8)) && ok;
+    ok = run("pulses, noise +-1", simulated_pulses()) && ok;
+    ok = run("sine, no noise", simulated_sine(100000, 0)) && ok;
+
+    for (int i = 1; i < argc; i++)
+        ok = run(argv[i], load(argv[i])) && ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+#include "fake_connection.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <spdlog/fmt/fmt.h>
+#include <stdexcept>
+
+namespace
+{
+    std::size_t parse_point(std::string_view arg)
+    {
+        std::size_t point = 0;
+        const auto result = std::from_chars(arg.data(), arg.data() + arg.size(), point);
+        if (result.ec != std::errc() || result.ptr != arg.data() + arg.size())
+            throw std::logic_error(fmt::format("'{}' is not a point index", arg));
+        return point;
+    }
+} // namespace
+
+fake_connection::fake_connection(std::size_t memory_depth) : m_memory_depth(memory_depth), m_waveform(memory_depth)
+{
+    m_ascii_offsets.reserve(memory_depth + 1);
+    for (std::size_t i = 0; i < memory_depth; i++)
+    {
+        m_waveform[i] = (std::uint8_t)(128 + 90 * std::sin(i * 0.005) + (i * 7919 % 5));
+
+        m_ascii_offsets.push_back(m_ascii.size());
+        m_ascii.append(fmt::format("{:e},", (m_waveform[i] - 127) * 0.04));
+    }
+    m_ascii_offsets.push_back(m_ascii.size());
+}
+
+void fake_connection::reply(std::string_view response)
+{
+    m_output.append(response);
+    m_output.push_back('\n');
+}
+
+void fake_connection::reply_block(const char *data, std::size_t size)
+{
+    char header[16];
+    m_output.append(header, fmt::format_to_n(header, sizeof(header), "#9{:09}", size).size);
+    m_output.append(data, size);
+    m_output.push_back('\n');
+}
+
+void fake_connection::handle(std::string_view command)
+{
+    const auto space = command.find(' ');
+    const std::string_view header = command.substr(0, space);
+    const std::string_view arg = space == std::string_view::npos ? std::string_view{} : command.substr(space + 1);
+
+    if (header == ":TRIG:STAT?")
+        reply("STOP");
+    else if (header == ":ACQ:MDEP?")
+        reply(fmt::format("{}", m_memory_depth));
+    else if (header == ":WAV:PRE?")
+        reply(fmt::format("0,2,{},1,1.000000e-08,-6.000000e-03,0,4.000000e-02,-3,127", m_memory_depth));
+    else if (header == ":WAV:FORM")
+        m_ascii_format = arg == "ASC";
+    else if (header == ":WAV:START")
+        m_start = parse_point(arg);
+    else if (header == ":WAV:STOP")
+        m_stop = parse_point(arg);
+    else if (header == ":WAV:DATA?")
+    {
+        if (m_start < 1 || m_stop < m_start || m_stop > m_memory_depth)
+            throw std::logic_error(fmt::format("Points {}-{} are outside the memory", m_start, m_stop));
+
+        if (m_ascii_format)
+        {
+            // Without the comma after the last value
+            const std::size_t from = m_ascii_offsets[m_start - 1];
+            reply_block(m_ascii.data() + from, m_ascii_offsets[m_stop] - from - 1);
+        }
+        else
+        {
+            reply_block((const char *)m_waveform.data() + m_start - 1, m_stop - m_start + 1);
+        }
+    }
+    else if (header.back() == '?')
+        throw std::logic_error(fmt::format("Fake connection cannot answer '{}'", command));
+}
+
+std::size_t fake_connection::read(std::uint8_t *buffer, std::size_t max_len)
+{
+    if (m_output_position == m_output.size())
+        throw std::logic_error("Read from fake connection without a pending response");
+
+    const std::size_t count = std::min(max_len, m_output.size() - m_output_position);
+    std::memcpy(buffer, m_output.data() + m_output_position, count);
+    m_output_position += count;
+    if (m_output_position == m_output.size())
+    {
+        m_output.clear();
+        m_output_position = 0;
+    }
+    return count;
+}
+
+std::size_t fake_connection::write(const std::uint8_t *buffer, std::size_t max_len)
+{
+    for (std::size_t i = 0; i < max_len; i++)
+    {
+        if (buffer[i] != '\n')
+        {
+            m_command.push_back((char)buffer[i]);
+            continue;
+        }
+
+        // Cleared afterwards so the buffer keeps its capacity
+        handle(m_command);
+        m_command.clear();
+    }
+    return max_len;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "connection.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// In-memory stand-in for a scope, answers the commands librigol sends for a capture with a
+// synthetic waveform. Responses are produced synchronously when a command line is written, so a
+// read without a pending response is a bug in the caller and throws. Trigger polls and waveform
+// blocks are answered without allocating once the buffers have grown.
+class fake_connection : public rigol::connection
+{
+    std::size_t m_memory_depth;
+    std::vector<std::uint8_t> m_waveform;
+    // ASCII waveform as "v,v,...", sample i starts at m_ascii_offsets[i]
+    std::string m_ascii;
+    std::vector<std::size_t> m_ascii_offsets;
+
+    bool m_ascii_format = false;
+    std::size_t m_start = 1;
+    std::size_t m_stop = 1;
+    std::string m_command;
+    std::string m_output;
+    std::size_t m_output_position = 0;
+
+    void handle(std::string_view command);
+    void reply(std::string_view response);
+    void reply_block(const char *data, std::size_t size);
+
+  public:
+    explicit fake_connection(std::size_t memory_depth);
+
+    // Bytes returned by the next reads, ahead of any responses to later commands
+    void queue(std::string_view response) { m_output.append(response); }
+    const std::vector<std::uint8_t> &waveform() const { return m_waveform; }
+
+  protected:
+    std::size_t read(std::uint8_t *buffer, std::size_t max_len) override;
+    std::size_t write(const std::uint8_t *buffer, std::size_t max_len) override;
+};
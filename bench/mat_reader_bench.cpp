@@ -0,0 +1,108 @@
+#include "mat_reader.h"
+#include "mat_writer.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <spdlog/fmt/fmt.h>
+#include <vector>
+
+// Writes a synthetic capture with the MAT writer, reads it back with mat::reader, checks that every
+// value survived the round trip and reports the read throughput of each access path.
+//
+//   mat_reader_bench [points] [file]
+namespace
+{
+    double measure(const char *label, std::size_t bytes, const std::function<void()> &fn)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << fmt::format("{:<28} {:>10.2f} ms {:>10.1f} MB/s\n", label, seconds * 1e3, bytes / seconds / 1e6);
+        return seconds;
+    }
+
+    void write_variable(std::ostream &file, const mat::data_element &element, int compression)
+    {
+        if (compression == 0)
+        {
+            file << element;
+            return;
+        }
+
+        mat::compressed_section cmp{compression};
+        cmp << element;
+        cmp.finish();
+        file << cmp;
+    }
+
+    template <typename T> bool check(const char *label, const T *actual, const std::vector<T> &expected)
+    {
+        for (std::size_t i = 0; i < expected.size(); i++)
+        {
+            if (actual[i] != expected[i])
+            {
+                std::cerr << fmt::format("{}: mismatch at {}\n", label, i);
+                return false;
+            }
+        }
+        return true;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const std::size_t points = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4000000;
+    const std::string path = argc > 2 ? argv[2] : "mat_reader_bench.mat";
+
+    std::vector<uint8_t> codes(points);
+    std::vector<double> waveform(points * 2);
+    for (std::size_t i = 0; i < points; i++)
+    {
+        codes[i] = (uint8_t)(128 + 90 * std::sin(i * 0.005) + (i * 7919 % 5));
+        waveform[2 * i] = i * 1e-8;
+        waveform[2 * i + 1] = (codes[i] - 127.0) * 0.04;
+    }
+
+    const std::size_t waveform_bytes = waveform.size() * sizeof(double);
+    measure("write", waveform_bytes * 2 + points, [&] {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc | std::ios::out);
+        file << mat::header{};
+        write_variable(file, mat::numeric_array<double>{"CHANNEL_1", waveform.data(), {2, (int32_t)points}}, 0);
+        write_variable(file, mat::numeric_array<double>{"CHANNEL_1_z", waveform.data(), {2, (int32_t)points}}, 1);
+        write_variable(file, mat::numeric_array<uint8_t>{"codes", codes.data(), {1, (int32_t)points}}, 0);
+    });
+
+    bool ok = true;
+    std::unique_ptr<mat::reader> reader;
+    measure("open", waveform_bytes * 2 + points, [&] { reader = std::make_unique<mat::reader>(path); });
+
+    double sum = 0;
+    measure("view (touch every value)", waveform_bytes, [&] {
+        const auto view = reader->view<double>(reader->find("CHANNEL_1"));
+        for (double v : view)
+            sum += v;
+        ok = ok && check("view", view.data(), waveform);
+    });
+
+    std::vector<double> copy;
+    measure("read uncompressed", waveform_bytes, [&] { reader->read(reader->find("CHANNEL_1"), copy); });
+    ok = ok && check("read uncompressed", copy.data(), waveform);
+
+    measure("read compressed", waveform_bytes, [&] { reader->read(reader->find("CHANNEL_1_z"), copy); });
+    ok = ok && check("read compressed", copy.data(), waveform);
+
+    std::vector<uint8_t> raw;
+    measure("read uint8", points, [&] { reader->read(reader->find("codes"), raw); });
+    ok = ok && check("read uint8", raw.data(), codes);
+
+    std::vector<double> converted;
+    measure("read uint8 as double", points, [&] { reader->read(reader->find("codes"), converted); });
+    ok = ok && check("read uint8 as double", converted.data(), std::vector<double>(codes.begin(), codes.end()));
+
+    std::cout << fmt::format("round trip {} (checksum {:.3f})\n", ok ? "ok" : "FAILED", sum);
+    return ok ? 0 : 1;
+}
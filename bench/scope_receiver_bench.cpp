@@ -0,0 +1,359 @@
+#include "capture.h"
+#include "fake_connection.h"
+#include "mat_writer.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cxxopts.hpp>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+#include <streambuf>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Times the hot paths of a capture against an in-memory fake scope: SCPI line reads, waveform
+// downloads in BYTE and ASCII format and through the command scheduler, scaling, decimation,
+// digital line packing and edge scans, MAT element writes, zlib compression and whole captures
+// written to tmpfs. Every benchmark runs at least three times (and for at least half a second), the
+// best and median times are reported.
+//
+//   scope_receiver_bench [--points N] [--dir /dev/shm] [--filter capture] [--json out.json]
+//                        [--baseline baseline.json [--threshold 0.1]]
+//
+// With --baseline the median times are compared to a JSON file written earlier with --json, the
+// exit code is 1 when any benchmark got slower by more than the threshold.
+namespace
+{
+    struct benchmark
+    {
+        std::string name;
+        // Payload handled by one run, for the throughput column
+        std::size_t bytes;
+        std::function<void()> run;
+        // Called before every run, not timed
+        std::function<void()> prepare;
+    };
+
+    struct result
+    {
+        std::string name;
+        std::size_t bytes = 0;
+        std::size_t runs = 0;
+        double best_s = 0;
+        double median_s = 0;
+
+        double mb_per_s() const { return bytes / best_s / 1e6; }
+    };
+
+    // Copies into memory that is kept between runs, so writes measure serialisation without the disk
+    class memory_buffer : public std::streambuf
+    {
+        std::vector<char> m_data;
+
+      protected:
+        int_type overflow(int_type ch) override
+        {
+            if (!traits_type::eq_int_type(ch, traits_type::eof()))
+                m_data.push_back(traits_type::to_char_type(ch));
+            return traits_type::not_eof(ch);
+        }
+
+        std::streamsize xsputn(const char *s, std::streamsize count) override
+        {
+            m_data.insert(m_data.end(), s, s + count);
+            return count;
+        }
+
+      public:
+        void clear() { m_data.clear(); }
+    };
+
+    result measure(const benchmark &bench)
+    {
+        std::vector<double> times;
+        double total = 0;
+        while (times.size() < 3 || (total < 0.5 && times.size() < 100))
+        {
+            if (bench.prepare)
+                bench.prepare();
+            const auto start = std::chrono::steady_clock::now();
+            bench.run();
+            times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            total += times.back();
+        }
+
+        std::sort(times.begin(), times.end());
+        return {bench.name, bench.bytes, times.size(), times.front(), times[times.size() / 2]};
+    }
+
+    void write_json(const std::string &path, std::size_t points, const std::vector<result> &results)
+    {
+        std::ofstream file(path, std::ios::trunc);
+        file << fmt::format("{{\n  \"points\": {},\n  \"benchmarks\": [\n", points);
+        for (std::size_t i = 0; i < results.size(); i++)
+        {
+            const result &r = results[i];
+            // One benchmark per line, read_baseline() relies on it
+            file << fmt::format("    {{\"name\": \"{}\", \"bytes\": {}, \"runs\": {}, \"best_s\": {:.9g}, "
+                                "\"median_s\": {:.9g}, \"mb_per_s\": {:.6g}}}{}\n",
+                                r.name, r.bytes, r.runs, r.best_s, r.median_s, r.mb_per_s(),
+                                i + 1 < results.size() ? "," : "");
+        }
+        file << "  ]\n}\n";
+        if (!file)
+            throw std::runtime_error(fmt::format("Cannot write {}", path));
+    }
+
+    std::string_view json_field(std::string_view line, std::string_view key)
+    {
+        const std::string quoted = fmt::format("\"{}\": ", key);
+        const auto pos = line.find(quoted);
+        if (pos == std::string_view::npos)
+            return {};
+        std::string_view value = line.substr(pos + quoted.size());
+        if (!value.empty() && value.front() == '"')
+            return value.substr(1, value.find('"', 1) - 1);
+        return value.substr(0, value.find_first_of(",}"));
+    }
+
+    // Median times by name from a file written by write_json()
+    std::map<std::string, double> read_baseline(const std::string &path)
+    {
+        std::ifstream file(path);
+        if (!file)
+            throw std::runtime_error(fmt::format("Cannot open baseline {}", path));
+
+        std::map<std::string, double> baseline;
+        std::string line;
+        while (std::getline(file, line))
+        {
+            const std::string_view name = json_field(line, "name");
+            const std::string_view median = json_field(line, "median_s");
+            if (!name.empty() && !median.empty())
+                baseline[std::string(name)] = std::stod(std::string(median));
+        }
+        return baseline;
+    }
+
+    // Prints the change of every benchmark against the baseline, true if none regressed
+    bool compare(const std::vector<result> &results, const std::map<std::string, double> &baseline,
+                 double threshold)
+    {
+        bool ok = true;
+        std::cout << fmt::format("\n{:<32} {:>12} {:>12} {:>9}\n", "benchmark", "baseline ms", "median ms", "change");
+        for (const result &r : results)
+        {
+            const auto it = baseline.find(r.name);
+            if (it == baseline.end())
+            {
+                std::cout << fmt::format("{:<32} {:>12} {:>12.3f} {:>9}\n", r.name, "-", r.median_s * 1e3, "new");
+                continue;
+            }
+
+            const double change = r.median_s / it->second - 1;
+            const bool regressed = change > threshold;
+            ok = ok && !regressed;
+            std::cout << fmt::format("{:<32} {:>12.3f} {:>12.3f} {:>+8.1f}%{}\n", r.name, it->second * 1e3,
+                                     r.median_s * 1e3, change * 100, regressed ? "  REGRESSION" : "");
+        }
+        return ok;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    cxxopts::Options options("scope_receiver_bench", "Benchmarks of the capture hot paths against a fake scope");
+    // clang-format off
+    options.add_options()
+        ("points", "Memory depth of the fake scope", cxxopts::value<std::size_t>()->default_value("1000000"))
+        ("dir", "Directory (ideally tmpfs) the capture benchmarks write to", cxxopts::value<std::string>()->default_value("/dev/shm"))
+        ("filter", "Run only benchmarks whose name contains given text", cxxopts::value<std::string>()->default_value(""))
+        ("json", "Write the results as JSON to file", cxxopts::value<std::string>())
+        ("baseline", "Compare the results to JSON written earlier with --json", cxxopts::value<std::string>())
+        ("threshold", "Slowdown of the median time that counts as a regression", cxxopts::value<double>()->default_value("0.1"))
+        ("h,help", "Print usage");
+    // clang-format on
+
+    try
+    {
+        const auto parsed_options = options.parse(argc, argv);
+        if (parsed_options.count("help"))
+        {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+
+        spdlog::set_level(spdlog::level::warn);
+        const std::size_t points = parsed_options["points"].as<std::size_t>();
+        const std::string filter = parsed_options["filter"].as<std::string>();
+        const std::filesystem::path dir =
+            std::filesystem::path(parsed_options["dir"].as<std::string>()) / "scope_receiver_bench";
+        std::filesystem::create_directories(dir);
+
+        auto fake = std::make_unique<fake_connection>(points);
+        fake_connection &connection = *fake;
+        rigol::scope scope{std::move(fake)};
+        rigol::command_scheduler scheduler{std::make_unique<fake_connection>(points)};
+        // ASCII transfers are about 13 bytes per sample
+        const std::size_t ascii_points = std::max<std::size_t>(1, points / 10);
+        rigol::scope ascii_scope{std::make_unique<fake_connection>(ascii_points)};
+
+        const std::string line = "0,2,1000000,1,1.000000e-08,-6.000000e-03,0,4.000000e-02,-3,127\n";
+        constexpr std::size_t LINES = 10000;
+        std::string lines;
+        for (std::size_t i = 0; i < LINES; i++)
+            lines.append(line);
+        std::string read = line;
+
+        std::vector<uint8_t> codes(points);
+        std::vector<float> volts;
+
+        capture_arena arena;
+        channel_data &data = arena.channel(0);
+        read_channel_data(scope, rigol::channel::CHANNEL_1, data);
+        scale_channel_data(data, arena.scaled);
+
+        decimation_settings decimation;
+        decimation.factor = 10;
+        fir_decimator decimator{decimation};
+        std::vector<float> decimated(decimated_points(points, decimation.factor));
+
+        // The analog codes stand in for both pods, the lines scanned count up like a bus with D0 toggling
+        // every 64 samples
+        std::vector<uint16_t> interleaved(points);
+        std::vector<uint16_t> packed(points);
+        for (std::size_t i = 0; i < points; i++)
+            packed[i] = (uint16_t)(i / 64);
+        std::vector<uint8_t> unpacked(points);
+        logic_transitions transitions;
+
+        memory_buffer memory;
+        std::ostream memory_stream{&memory};
+        const mat::numeric_array<double> element{"CHANNEL_1", arena.scaled.data(), {2, (int32_t)points}};
+        // Tag and payload
+        const std::size_t element_bytes = 8 + element.aligned_size();
+
+        std::vector<benchmark> benchmarks{
+            {"connection.read_line", lines.size(),
+             [&] {
+                 for (std::size_t i = 0; i < LINES; i++)
+                 {
+                     read.clear();
+                     connection.read_line(read);
+                 }
+             },
+             [&] { connection.queue(lines); }},
+            {"scope.read_buffer.byte", points, [&] { scope.read_buffer(codes.data(), points); }, {}},
+            {"scope.read_buffer.ascii", ascii_points, [&] { ascii_scope.read_buffer(volts); }, {}},
+            {"scheduler.read_waveform", points, [&] { scheduler.read_waveform(codes.data(), points).get(); }, {}},
+            {"scheduler.query", 0, [&] { scheduler.query(":TRIG:STAT?").get(); }, {}},
+            {"scale_channel_data", points, [&] { scale_channel_data(data, arena.scaled); }, {}},
+            {"fir_decimator.push.10", points,
+             [&] {
+                 decimator.reset();
+                 const std::size_t written = decimator.push(data.raw.data(), points, decimated.data());
+                 decimator.finish(decimated.data() + written);
+             },
+             {}},
+            {"logic.interleave_pods", points,
+             [&] { interleave_pods(data.raw.data(), data.raw.data(), points, interleaved.data()); }, {}},
+            {"logic.unpack_line", points, [&] { unpack_line(packed.data(), points, 3, unpacked.data()); }, {}},
+            {"logic.find_transitions", points,
+             [&] {
+                 for (auto &edges : transitions)
+                     edges.clear();
+                 find_transitions(packed.data(), points, transitions);
+             },
+             {}},
+            {"mat.element.write", element_bytes, [&] { memory_stream << element; }, [&] { memory.clear(); }},
+        };
+
+        for (int level : {1, 3, 6, 9})
+        {
+            auto compress = [&, level] {
+                mat::compressed_section &cmp = arena.compressor(level);
+                cmp << element;
+                cmp.finish();
+                memory_stream << cmp;
+            };
+            benchmarks.push_back(
+                {fmt::format("mat.compressed_section.z{}", level), element_bytes, compress, [&] { memory.clear(); }});
+        }
+
+        // Captures run like the daemon's, with a learned setup and their own buffers
+        capture_arena capture_buffers;
+        const std::vector<rigol::channel> channels{rigol::channel::CHANNEL_1, rigol::channel::CHANNEL_2};
+        scope_setup setup;
+        setup.learn(scope, channels);
+        for (const auto &[name, format, compression] :
+             {std::make_tuple("mat", output_format::MAT, 0), std::make_tuple("mat.z1", output_format::MAT, 1),
+              std::make_tuple("mat73", output_format::MAT73, 0), std::make_tuple("mat73.z1", output_format::MAT73, 1),
+              std::make_tuple("raw", output_format::RAW, 0), std::make_tuple("container", output_format::CONTAINER, 0)})
+        {
+            capture_request request;
+            request.channels = channels;
+            request.trigger = trigger_mode::STOP;
+            request.format = format;
+            request.compression = compression;
+            request.outfile = (dir / fmt::format("capture.{}", name)).string();
+
+            benchmarks.push_back({fmt::format("capture.{}", name), points * channels.size(),
+                                  [&, request] { capture(scope, request, &setup, &capture_buffers); },
+                                  // Containers append, start every run from an empty one
+                                  [request] { std::filesystem::remove(request.outfile); }});
+        }
+
+        capture_request decimated_request;
+        decimated_request.channels = channels;
+        decimated_request.trigger = trigger_mode::STOP;
+        decimated_request.decimation = decimation;
+        decimated_request.outfile = (dir / "capture.mat.decimate10").string();
+        benchmarks.push_back({"capture.mat.decimate10", points * channels.size(),
+                              [&] { capture(scope, decimated_request, &setup, &capture_buffers); }, {}});
+
+        std::vector<result> results;
+        std::cout << fmt::format("{:<32} {:>6} {:>12} {:>12} {:>12}\n", "benchmark", "runs", "best ms", "median ms",
+                                 "MB/s");
+        for (const benchmark &bench : benchmarks)
+        {
+            if (bench.name.find(filter) == std::string::npos)
+                continue;
+
+            results.push_back(measure(bench));
+            const result &r = results.back();
+            std::cout << fmt::format("{:<32} {:>6} {:>12.3f} {:>12.3f} {:>12.1f}\n", r.name, r.runs, r.best_s * 1e3,
+                                     r.median_s * 1e3, r.mb_per_s());
+        }
+
+        std::filesystem::remove_all(dir);
+
+        if (parsed_options.count("json"))
+            write_json(parsed_options["json"].as<std::string>(), points, results);
+
+        if (parsed_options.count("baseline"))
+        {
+            const auto baseline = read_baseline(parsed_options["baseline"].as<std::string>());
+            if (!compare(results, baseline, parsed_options["threshold"].as<double>()))
+                return 1;
+        }
+    }
+    catch (const cxxopts::OptionParseException &ex)
+    {
+        std::cerr << ex.what() << std::endl << std::endl << options.help() << std::endl;
+        return 1;
+    }
+    catch (const std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include "fft.h"
+#include "spectrum.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <spdlog/fmt/fmt.h>
+#include <thread>
+#include <vector>
+
+// Checks the FFT against a direct DFT, then reports how many segments per second the Welch stage
+// processes for a range of segment sizes, on one thread and on all of them.
+//
+//   spectrum_bench [points]
+namespace
+{
+    constexpr double PI = 3.14159265358979323846;
+
+    double best_seconds(const std::function<void()> &fn)
+    {
+        double best = 1e30;
+        for (int i = 0; i < 3; i++)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            fn();
+            best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    }
+
+    // Largest difference to the direct DFT relative to the largest bin
+    double dft_error(std::size_t size)
+    {
+        std::vector<double> input(size);
+        for (std::size_t n = 0; n < size; n++)
+            input[n] = std::sin(n * 0.3) + 0.25 * std::cos(n * 1.7) + (n * 7919 % 13) / 13.0;
+
+        const fft transform{size};
+        fft::workspace work;
+        std::vector<double> re(transform.bins()), im(transform.bins());
+        transform.transform(input.data(), re.data(), im.data(), work);
+
+        double error = 0, peak = 0;
+        for (std::size_t k = 0; k < transform.bins(); k++)
+        {
+            double xr = 0, xi = 0;
+            for (std::size_t n = 0; n < size; n++)
+            {
+                xr += input[n] * std::cos(-2 * PI * k * n / size);
+                xi += input[n] * std::sin(-2 * PI * k * n / size);
+            }
+            error = std::max(error, std::hypot(re[k] - xr, im[k] - xi));
+            peak = std::max(peak, std::hypot(xr, xi));
+        }
+        return error / peak;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const std::size_t points = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 24000000;
+
+    bool ok = true;
+    for (std::size_t size : {4, 8, 64, 512, 2048})
+    {
+        const double error = dft_error(size);
+        ok = ok && error < 1e-12;
+        std::cout << fmt::format("fft {:>6} vs dft: relative error {:.2e}\n", size, error);
+    }
+
+    std::vector<uint8_t> codes(points);
+    for (std::size_t i = 0; i < points; i++)
+        codes[i] = (uint8_t)(128 + 90 * std::sin(i * 0.005) + (i * 7919 % 5));
+
+    rigol::preamble pre;
+    pre.points = points;
+    pre.x_increment = 1e-9;
+    pre.y_increment = 0.04;
+    pre.y_reference = 127;
+
+    std::vector<unsigned> thread_counts{1};
+    if (std::thread::hardware_concurrency() > 1)
+        thread_counts.push_back(std::thread::hardware_concurrency());
+
+    std::cout << fmt::format("\n{:>8} {:>8} {:>10} {:>14} {:>12}\n", "segment", "threads", "segments", "segments/s",
+                             "MS/s");
+    for (std::size_t size : {1024, 4096, 16384, 65536})
+    {
+        for (unsigned threads : thread_counts)
+        {
+            spectrum_settings settings;
+            settings.segment = size;
+            settings.threads = threads;
+
+            std::size_t segments = 0;
+            const double seconds = best_seconds([&] {
+                segments = welch_spectrum(codes.data(), points, 1, pre, settings).segments;
+            });
+            std::cout << fmt::format("{:>8} {:>8} {:>10} {:>14.0f} {:>12.1f}\n", size, threads, segments,
+                                     segments / seconds, segments * size / seconds / 1e6);
+        }
+    }
+
+    std::cout << fmt::format("\nfft check {}\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
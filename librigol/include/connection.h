@@ -3,6 +3,9 @@
 #include <cstddef>
 #include <cstdint>
 #include <string>
+#include <string_view>
+
+#include "statistics.h"
 
 #ifdef __WIN32__
 #include <winsock2.h>
@@ -16,6 +19,10 @@ namespace rigol
         connection(const connection &) = delete;
         connection &operator=(const connection &) = delete;
 
+        connection_statistics m_statistics;
+        std::string m_command_buffer;
+        std::string m_response_buffer;
+
       protected:
         connection(){};
 
@@ -25,10 +32,19 @@ namespace rigol
       public:
         virtual ~connection(){};
 
-        void write(const std::string &s);
+        void write(std::string_view s);
         void read_line(std::string &out);
         void read(std::string &out, size_t count);
+        void read_exact(std::uint8_t *buffer, std::size_t count);
         std::string read_line();
+
+        // Scratch buffers reused by every command sent over this connection so the steady state
+        // does not allocate
+        std::string &command_buffer() { return m_command_buffer; }
+        std::string &response_buffer() { return m_response_buffer; }
+
+        connection_statistics &statistics() { return m_statistics; }
+        const connection_statistics &statistics() const { return m_statistics; }
     };
 
     class tcp_connection : public connection
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "connection.h"
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+namespace rigol
+{
+    // Jobs of a higher class always run first, within a class they run in submission order
+    enum class command_priority
+    {
+        INTERACTIVE,
+        NORMAL,
+        BULK,
+    };
+
+    struct scheduler_statistics
+    {
+        std::uint64_t jobs = 0;
+        // Queries answered by a round trip that another caller had already queued
+        std::uint64_t coalesced = 0;
+        // Jobs that ran while a bulk download was waiting for its next chunk
+        std::uint64_t interleaved = 0;
+    };
+
+    // Owns a connection and runs commands submitted from any thread, one at a time, on its own
+    // worker thread. A job has the connection to itself until it returns, so a :WAV:DATA? block is
+    // always read in one piece and queries only ever slip in between two blocks of a download:
+    //
+    //   rigol::command_scheduler scheduler{std::make_unique<rigol::tcp_connection>(ip, 5555)};
+    //   std::future<void> download = scheduler.read_waveform(buffer.data(), depth);
+    //   while (download.wait_for(10ms) != std::future_status::ready)
+    //       spdlog::info("{}", scheduler.query(":TRIG:STAT?").get());
+    //
+    // Jobs running between download blocks must not change the waveform source or format.
+    class command_scheduler
+    {
+        struct job
+        {
+            std::function<void(connection &)> run;
+            // Key in m_pending_queries, empty for jobs that are not coalesced
+            std::string query;
+        };
+
+        std::unique_ptr<connection> m_connection;
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::array<std::deque<job>, 3> m_queues;
+        // Queries that are queued but not yet sent, callers asking the same share the answer
+        std::map<std::string, std::shared_future<std::string>, std::less<>> m_pending_queries;
+        std::size_t m_downloads = 0;
+        scheduler_statistics m_statistics;
+        bool m_stopping = false;
+        std::thread m_worker;
+
+        void enqueue(command_priority priority, job &&j);
+        void work();
+
+        // Queues the block of a download starting at `position`, it queues the next one when done
+        void read_waveform_block(std::shared_ptr<std::promise<void>> done, std::uint8_t *buffer,
+                                 std::size_t position, std::size_t memory_depth, std::size_t block_size);
+
+      public:
+        explicit command_scheduler(std::unique_ptr<connection> &&connection);
+        command_scheduler(const command_scheduler &) = delete;
+        command_scheduler &operator=(const command_scheduler &) = delete;
+        // Jobs still queued are dropped, their futures report a broken promise
+        ~command_scheduler();
+
+        // Runs `fn(connection &)` on the worker thread, the future holds its result or exception
+        template <typename F>
+        std::future<std::invoke_result_t<F, connection &>> submit(command_priority priority, F &&fn)
+        {
+            using result = std::invoke_result_t<F, connection &>;
+            auto task = std::make_shared<std::packaged_task<result(connection &)>>(std::forward<F>(fn));
+            std::future<result> future = task->get_future();
+            enqueue(priority, {[task](connection &c) { (*task)(c); }, {}});
+            return future;
+        }
+
+        // `command` is a full command line without the newline, e.g. ":WAV:SOUR CHAN1"
+        std::future<void> send(std::string command, command_priority priority = command_priority::NORMAL);
+        // Identical queries waiting to be sent at the same time are answered by a single round trip
+        std::shared_future<std::string> query(const std::string &command,
+                                              command_priority priority = command_priority::INTERACTIVE);
+
+        // Reads `memory_depth` BYTE points of the current :WAV:SOUR into `buffer`, which has to
+        // stay valid until the future is ready. Every :WAV:DATA? block of at most `block_size`
+        // points is its own BULK job.
+        std::future<void> read_waveform(std::uint8_t *buffer, std::size_t memory_depth,
+                                        std::size_t block_size = 250000);
+
+        scheduler_statistics statistics();
+    };
+} // namespace rigol
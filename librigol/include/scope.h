@@ -1,6 +1,8 @@
 #pragma once
 
 #include "connection.h"
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <ostream>
 #include <vector>
@@ -45,9 +47,106 @@ namespace rigol
         return str;
     }
 
+    // The 16 digital lines of MSO models come in two pods of 8. A pod is read like a channel with
+    // one byte per point, bit n of a POD_1 byte is Dn and bit n of a POD_2 byte is D(n + 8).
+    enum class logic_pod
+    {
+        POD_1,
+        POD_2,
+    };
+
+    inline std::ostream &operator<<(std::ostream &str, logic_pod pod)
+    {
+        switch (pod)
+        {
+        case logic_pod::POD_1:
+            str << "D0-D7";
+            return str;
+        case logic_pod::POD_2:
+            str << "D8-D15";
+            return str;
+        }
+        str << "Unknown pod";
+        return str;
+    }
+
+    struct preamble
+    {
+        int format = 0;
+        int type = 0;
+        std::size_t points = 0;
+        std::size_t count = 0;
+        double x_increment = 0;
+        double x_origin = 0;
+        double x_reference = 0;
+        double y_increment = 0;
+        double y_origin = 0;
+        double y_reference = 0;
+    };
+
+    // Piece of a streamed waveform download, `offset` is the index of the first sample in `data`.
+    // The bytes live in memory owned by the scope that is reused for the next chunk, they are only
+    // valid until the stream moves on.
+    struct waveform_chunk
+    {
+        std::size_t offset = 0;
+        const std::uint8_t *data = nullptr;
+        std::size_t size = 0;
+        const rigol::preamble *preamble = nullptr;
+
+        const std::uint8_t *begin() const { return data; }
+        const std::uint8_t *end() const { return data + size; }
+        std::uint8_t operator[](std::size_t i) const { return data[i]; }
+    };
+
+    // Pulls a waveform off the wire chunk by chunk:
+    //
+    //   rigol::waveform_stream stream = scope.stream_buffer(depth);
+    //   rigol::waveform_chunk chunk;
+    //   while (stream.next(chunk))
+    //       process(chunk);
+    //
+    // Nothing else may be sent to the scope while a stream is open, one left unfinished drains the
+    // rest of the current block when destroyed so the connection stays usable.
+    class waveform_stream
+    {
+        connection *m_connection;
+        std::vector<std::uint8_t> *m_buffer;
+        rigol::preamble m_preamble;
+        std::size_t m_memory_depth;
+        std::size_t m_chunk_size;
+        std::size_t m_position = 0;
+        // End of the WAV:DATA block being read
+        std::size_t m_block_end = 0;
+        std::size_t m_block_start = 0;
+        std::chrono::steady_clock::time_point m_block_started;
+
+        void begin_block();
+        void end_block();
+
+      public:
+        static constexpr std::size_t DEFAULT_CHUNK_SIZE = 65536;
+
+        waveform_stream(connection &connection, std::vector<std::uint8_t> &buffer, const rigol::preamble &pre,
+                        std::size_t memory_depth, std::size_t chunk_size);
+        waveform_stream(waveform_stream &&other) noexcept;
+        waveform_stream(const waveform_stream &) = delete;
+        waveform_stream &operator=(const waveform_stream &) = delete;
+        waveform_stream &operator=(waveform_stream &&) = delete;
+        ~waveform_stream();
+
+        // Reads the next chunk, false once all points have been delivered
+        bool next(waveform_chunk &chunk);
+        std::size_t position() const { return m_position; }
+    };
+
+    using chunk_callback = std::function<void(const waveform_chunk &)>;
+
     class scope
     {
         std::unique_ptr<connection> m_connection;
+        // Backing memory of streamed chunks, kept between downloads
+        std::vector<std::uint8_t> m_chunk_buffer;
 
       public:
         scope(std::unique_ptr<connection> &&connection);
@@ -59,9 +158,42 @@ namespace rigol
         trigger_state get_trigger_state();
 
         void select_channel(channel ch);
+        // The following read_buffer() and stream_buffer() calls read the pod's packed lines
+        void select_pod(logic_pod pod);
+
+        std::size_t memory_depth();
+        // The scope only accepts a new depth while it runs, so this starts it
+        void set_memory_depth(std::size_t memory_depth);
+
+        bool channel_enabled(channel ch);
+        void enable_channel(channel ch, bool enabled);
+        bool pod_enabled(logic_pod pod);
+        // Enabling a pod also turns the logic analyzer on
+        void enable_pod(logic_pod pod, bool enabled);
 
         void read_buffer(std::vector<float> &buffer);
         void read_buffer(std::vector<uint8_t> &buffer);
+        void read_buffer(std::vector<uint8_t> &buffer, std::size_t memory_depth);
+        // Reads `memory_depth` points into caller owned storage
+        void read_buffer(uint8_t *buffer, std::size_t memory_depth);
+
+        // Streams `memory_depth` points of the selected channel in chunks of at most `chunk_size`
+        // bytes, the preamble is read first unless given
+        waveform_stream stream_buffer(std::size_t memory_depth, const preamble *pre = nullptr,
+                                      std::size_t chunk_size = waveform_stream::DEFAULT_CHUNK_SIZE);
+        // Same, calling `callback` for every chunk as it arrives
+        void stream_buffer(std::size_t memory_depth, const chunk_callback &callback, const preamble *pre = nullptr,
+                           std::size_t chunk_size = waveform_stream::DEFAULT_CHUNK_SIZE);
+
+        preamble read_preamble();
+
+        // Waveform recording, the scope stores up to max_recorded_frames() triggered frames in
+        // its memory which can then be selected one by one and read with read_buffer()
+        std::size_t max_recorded_frames();
+        void start_recording(std::size_t frames);
+        bool is_recording();
+        void stop_recording();
+        void select_frame(std::size_t frame);
 
         double x_origin();
         double x_increment();
@@ -69,5 +201,7 @@ namespace rigol
         double y_origin();
         double y_increment();
         double y_reference();
+
+        const connection_statistics &statistics() const { return m_connection->statistics(); }
     };
 } // namespace rigol
\ No newline at end of file
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <initializer_list>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 
 namespace rigol
 {
@@ -41,4 +45,80 @@ namespace rigol
         void run_on(connection &connection) override;
         const std::string &last_response() const { return m_last_response; };
     };
-} // namespace rigol
\ No newline at end of file
+
+    // Command header known at compile time, e.g. ":WAV:START" or ":TRIG:STAT?". The command line is
+    // assembled in the connection's command buffer and responses land in its response buffer, so
+    // sending a command or query does not allocate once the buffers have grown.
+    class scpi_mnemonic
+    {
+        std::string_view m_header;
+
+      public:
+        constexpr explicit scpi_mnemonic(std::string_view header)
+            : m_header((header.size() < 2 || header[0] != ':') ? throw std::logic_error("Invalid SCPI header")
+                                                                : header)
+        {
+        }
+
+        constexpr std::string_view header() const { return m_header; }
+        constexpr bool is_query() const { return m_header.back() == '?'; }
+
+        void send(connection &connection, std::string_view args = {}) const;
+        void send(connection &connection, std::size_t arg) const;
+
+        // Returned view points into the connection's response buffer and stays valid (and NUL
+        // terminated) until the next command on that connection.
+        std::string_view query(connection &connection) const;
+
+        // Reads an IEEE 488.2 definite length block straight into `out`, returns its size
+        std::size_t query_block(connection &connection, std::uint8_t *out, std::size_t capacity) const;
+
+        // Same query for reading the block piecewise: returns the block size once the header has
+        // arrived, the caller reads exactly that many bytes from the connection and then calls
+        // end_block(). The command latency recorded is the time to the header.
+        std::size_t begin_block(connection &connection) const;
+        void end_block(connection &connection) const;
+    };
+
+    namespace scpi
+    {
+        constexpr scpi_mnemonic RUN{":RUN"};
+        constexpr scpi_mnemonic STOP{":STOP"};
+        constexpr scpi_mnemonic SING{":SING"};
+        constexpr scpi_mnemonic TRIG_STAT_Q{":TRIG:STAT?"};
+        constexpr scpi_mnemonic ACQ_MDEP{":ACQ:MDEP"};
+        constexpr scpi_mnemonic ACQ_MDEP_Q{":ACQ:MDEP?"};
+        constexpr scpi_mnemonic CHAN1_DISP{":CHAN1:DISP"};
+        constexpr scpi_mnemonic CHAN2_DISP{":CHAN2:DISP"};
+        constexpr scpi_mnemonic CHAN3_DISP{":CHAN3:DISP"};
+        constexpr scpi_mnemonic CHAN4_DISP{":CHAN4:DISP"};
+        constexpr scpi_mnemonic CHAN1_DISP_Q{":CHAN1:DISP?"};
+        constexpr scpi_mnemonic CHAN2_DISP_Q{":CHAN2:DISP?"};
+        constexpr scpi_mnemonic CHAN3_DISP_Q{":CHAN3:DISP?"};
+        constexpr scpi_mnemonic CHAN4_DISP_Q{":CHAN4:DISP?"};
+        constexpr scpi_mnemonic WAV_SOUR{":WAV:SOUR"};
+        constexpr scpi_mnemonic WAV_MODE{":WAV:MODE"};
+        constexpr scpi_mnemonic WAV_FORM{":WAV:FORM"};
+        constexpr scpi_mnemonic WAV_START{":WAV:START"};
+        constexpr scpi_mnemonic WAV_STOP{":WAV:STOP"};
+        constexpr scpi_mnemonic WAV_DATA_Q{":WAV:DATA?"};
+        constexpr scpi_mnemonic WAV_PRE_Q{":WAV:PRE?"};
+        constexpr scpi_mnemonic WAV_XOR_Q{":WAV:XOR?"};
+        constexpr scpi_mnemonic WAV_XINC_Q{":WAV:XINC?"};
+        constexpr scpi_mnemonic WAV_XREF_Q{":WAV:XREF?"};
+        constexpr scpi_mnemonic WAV_YOR_Q{":WAV:YOR?"};
+        constexpr scpi_mnemonic WAV_YINC_Q{":WAV:YINC?"};
+        constexpr scpi_mnemonic WAV_YREF_Q{":WAV:YREF?"};
+        constexpr scpi_mnemonic FUNC_WREC_ENAB{":FUNC:WREC:ENAB"};
+        constexpr scpi_mnemonic FUNC_WREC_FEND{":FUNC:WREC:FEND"};
+        constexpr scpi_mnemonic FUNC_WREC_FMAX_Q{":FUNC:WREC:FMAX?"};
+        constexpr scpi_mnemonic FUNC_WREC_OPER{":FUNC:WREC:OPER"};
+        constexpr scpi_mnemonic FUNC_WREC_OPER_Q{":FUNC:WREC:OPER?"};
+        constexpr scpi_mnemonic FUNC_WREP_FCUR{":FUNC:WREP:FCUR"};
+        constexpr scpi_mnemonic LA_STAT{":LA:STAT"};
+        constexpr scpi_mnemonic LA_POD1_DISP{":LA:POD1:DISP"};
+        constexpr scpi_mnemonic LA_POD2_DISP{":LA:POD2:DISP"};
+        constexpr scpi_mnemonic LA_POD1_DISP_Q{":LA:POD1:DISP?"};
+        constexpr scpi_mnemonic LA_POD2_DISP_Q{":LA:POD2:DISP?"};
+    } // namespace scpi
+} // namespace rigol
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace rigol
+{
+    // Log-linear (HDR style) histogram of nanosecond latencies, 16 sub-buckets per power of two,
+    // which keeps the relative error below 6.25% over the whole 64-bit range.
+    class latency_histogram
+    {
+        static constexpr unsigned SUB_BUCKET_BITS = 5;
+        static constexpr unsigned SUB_BUCKET_HALF = 1 << (SUB_BUCKET_BITS - 1);
+
+        std::array<std::uint64_t, 1024> m_counts{};
+        std::uint64_t m_count = 0;
+        std::uint64_t m_total_ns = 0;
+        std::uint64_t m_min_ns = UINT64_MAX;
+        std::uint64_t m_max_ns = 0;
+
+        static unsigned bucket_index(std::uint64_t ns);
+        static std::uint64_t bucket_upper_bound(unsigned index);
+
+      public:
+        void record(std::uint64_t ns);
+        void merge(const latency_histogram &other);
+
+        std::uint64_t count() const { return m_count; }
+        std::uint64_t total_ns() const { return m_total_ns; }
+        std::uint64_t min_ns() const { return m_count ? m_min_ns : 0; }
+        std::uint64_t max_ns() const { return m_max_ns; }
+        double mean_ns() const { return m_count ? (double)m_total_ns / m_count : 0.0; }
+        std::uint64_t percentile_ns(double p) const;
+    };
+
+    struct connection_statistics
+    {
+        std::uint64_t bytes_sent = 0;
+        std::uint64_t bytes_received = 0;
+        std::uint64_t send_calls = 0;
+        std::uint64_t receive_calls = 0;
+
+        std::uint64_t payload_bytes = 0;
+        std::uint64_t payload_ns = 0;
+
+        std::map<std::string, latency_histogram, std::less<>> commands;
+
+        latency_histogram &command(std::string_view mnemonic);
+        void record_payload(std::uint64_t bytes, std::uint64_t ns);
+
+        // Waveform payload bytes per second spent in :WAV:DATA? transfers
+        double payload_throughput() const;
+    };
+
+    class command_timer
+    {
+        latency_histogram &m_histogram;
+        std::chrono::steady_clock::time_point m_start;
+
+      public:
+        command_timer(connection_statistics &stats, std::string_view mnemonic);
+        ~command_timer();
+    };
+
+    void write_summary(std::ostream &os, const connection_statistics &stats);
+    void write_prometheus(std::ostream &os, const connection_statistics &stats, std::string_view instance = {});
+    // Written next to `path` and renamed, so node_exporter never sees a partial file
+    void write_prometheus_file(const std::string &path, const connection_statistics &stats,
+                               std::string_view instance = {});
+} // namespace rigol
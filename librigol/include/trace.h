@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+namespace rigol
+{
+    namespace trace
+    {
+        struct event
+        {
+            std::uint64_t start_ns;
+            std::uint64_t duration_ns;
+            std::int64_t bytes;
+            std::uint32_t thread_id;
+            const char *category;
+            char name[48];
+        };
+
+        extern std::atomic<bool> is_enabled;
+        extern thread_local unsigned paused;
+
+        inline bool enabled() { return is_enabled.load(std::memory_order_relaxed) && paused == 0; }
+
+        // Starts recording into a ring buffer of `capacity` events (rounded up to a power of two),
+        // once full the oldest events are overwritten. Only call it while no other thread records:
+        // the buffer is kept when it is large enough, but one that has to grow is reallocated.
+        void enable(std::size_t capacity = 1 << 16);
+        void disable();
+
+        std::uint64_t now_ns();
+        void record(std::string_view name, const char *category, std::uint64_t start_ns, std::int64_t bytes);
+
+        // Chrome / Perfetto "trace event format" JSON
+        void write_chrome_json(std::ostream &os);
+
+        // Nothing is recorded on this thread while one exists, e.g. for the polls of a wait that is
+        // recorded as a whole, so they cannot push everything else out of the ring buffer
+        class pause
+        {
+            pause(const pause &) = delete;
+            pause &operator=(const pause &) = delete;
+
+          public:
+            pause() { paused++; }
+            ~pause() { paused--; }
+        };
+
+        class span
+        {
+            std::string_view m_name;
+            const char *m_category;
+            std::uint64_t m_start = 0;
+            std::int64_t m_bytes = -1;
+
+            span(const span &) = delete;
+            span &operator=(const span &) = delete;
+
+          public:
+            span(std::string_view name, const char *category) : m_name(name), m_category(category)
+            {
+                if (enabled())
+                    m_start = now_ns();
+            }
+
+            ~span()
+            {
+                if (m_start != 0)
+                    record(m_name, m_category, m_start, m_bytes);
+            }
+
+            void set_bytes(std::int64_t bytes) { m_bytes = bytes; }
+        };
+    } // namespace trace
+} // namespace rigol
@@ -2,11 +2,16 @@
 
 namespace rigol
 {
-    void connection::write(const std::string &s)
+    void connection::write(std::string_view s)
     {
         auto iter = s.cbegin();
         while (iter != s.cend())
-            iter += write((const std::uint8_t *)&*iter, s.cend() - iter);
+        {
+            const std::size_t cnt = write((const std::uint8_t *)&*iter, s.cend() - iter);
+            m_statistics.send_calls++;
+            m_statistics.bytes_sent += cnt;
+            iter += cnt;
+        }
     }
 
     std::string connection::read_line()
@@ -22,8 +27,10 @@ namespace rigol
 
         while (true)
         {
+            m_statistics.receive_calls++;
             if (read((uint8_t *)&ch, 1) == 1)
             {
+                m_statistics.bytes_received++;
                 if (ch == '\n')
                     return;
 
@@ -35,12 +42,18 @@ namespace rigol
     void connection::read(std::string &out, size_t count)
     {
         out.resize(count);
-        auto pos = out.begin();
+        read_exact((std::uint8_t *)out.data(), count);
+    }
+
+    void connection::read_exact(std::uint8_t *buffer, std::size_t count)
+    {
         while (count > 0)
         {
-            size_t cnt = read((uint8_t *)&*pos, count);
+            size_t cnt = read(buffer, count);
+            m_statistics.receive_calls++;
+            m_statistics.bytes_received += cnt;
             count -= cnt;
-            pos += cnt;
+            buffer += cnt;
         }
     }
 } // namespace rigol
\ No newline at end of file
@@ -0,0 +1,200 @@
+#include "scheduler.h"
+#include "scpi_command.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+namespace rigol
+{
+    command_scheduler::command_scheduler(std::unique_ptr<connection> &&connection)
+        : m_connection(std::move(connection)), m_worker([this] { work(); })
+    {
+    }
+
+    command_scheduler::~command_scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_wake.notify_one();
+        m_worker.join();
+    }
+
+    void command_scheduler::enqueue(command_priority priority, job &&j)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queues[(std::size_t)priority].push_back(std::move(j));
+        }
+        m_wake.notify_one();
+    }
+
+    void command_scheduler::work()
+    {
+        while (true)
+        {
+            job next;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                const auto pending = [this] {
+                    return std::find_if(m_queues.begin(), m_queues.end(),
+                                        [](const std::deque<job> &queue) { return !queue.empty(); });
+                };
+                m_wake.wait(lock, [&] { return m_stopping || pending() != m_queues.end(); });
+                if (m_stopping)
+                    return;
+
+                const auto queue = pending();
+                next = std::move(queue->front());
+                queue->pop_front();
+
+                // Once sent, a query answers only the callers that asked before
+                if (!next.query.empty())
+                    m_pending_queries.erase(next.query);
+
+                m_statistics.jobs++;
+                if (queue != m_queues.begin() + (std::size_t)command_priority::BULK && m_downloads > 0)
+                    m_statistics.interleaved++;
+            }
+
+            try
+            {
+                next.run(*m_connection);
+            }
+            catch (const std::exception &ex)
+            {
+                // Jobs report their errors through their futures, this is a bug in the job
+                spdlog::error("Scheduled job failed: {}", ex.what());
+            }
+        }
+    }
+
+    std::future<void> command_scheduler::send(std::string command, command_priority priority)
+    {
+        return submit(priority, [command = std::move(command)](connection &c) {
+            const std::string_view line = command;
+            const auto space = line.find(' ');
+            const scpi_mnemonic mnemonic{line.substr(0, space)};
+            mnemonic.send(c, space == std::string_view::npos ? std::string_view{} : line.substr(space + 1));
+        });
+    }
+
+    std::shared_future<std::string> command_scheduler::query(const std::string &command, command_priority priority)
+    {
+        auto answer = std::make_shared<std::promise<std::string>>();
+        std::shared_future<std::string> future;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const auto it = m_pending_queries.find(command);
+            if (it != m_pending_queries.end())
+            {
+                m_statistics.coalesced++;
+                return it->second;
+            }
+
+            future = answer->get_future().share();
+            m_pending_queries.emplace(command, future);
+        }
+
+        enqueue(priority, {[answer, command](connection &c) {
+                               try
+                               {
+                                   answer->set_value(std::string(scpi_mnemonic{command}.query(c)));
+                               }
+                               catch (...)
+                               {
+                                   answer->set_exception(std::current_exception());
+                               }
+                           },
+                           command});
+        return future;
+    }
+
+    std::future<void> command_scheduler::read_waveform(std::uint8_t *buffer, std::size_t memory_depth,
+                                                       std::size_t block_size)
+    {
+        if (block_size == 0)
+            throw std::invalid_argument("Block size has to be at least one point");
+
+        auto done = std::make_shared<std::promise<void>>();
+        std::future<void> future = done->get_future();
+        if (memory_depth == 0)
+        {
+            done->set_value();
+            return future;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_downloads++;
+        }
+        read_waveform_block(done, buffer, 0, memory_depth, block_size);
+        return future;
+    }
+
+    void command_scheduler::read_waveform_block(std::shared_ptr<std::promise<void>> done, std::uint8_t *buffer,
+                                                std::size_t position, std::size_t memory_depth,
+                                                std::size_t block_size)
+    {
+        auto block = [=](connection &c) {
+            try
+            {
+                if (position == 0)
+                {
+                    scpi::WAV_MODE.send(c, "RAW");
+                    scpi::WAV_FORM.send(c, "BYTE");
+                }
+
+                const std::size_t to_read = std::min(block_size, memory_depth - position);
+                trace::span span{"WAV:DATA chunk", "transfer"};
+                const auto start = std::chrono::steady_clock::now();
+
+                scpi::WAV_START.send(c, position + 1);
+                scpi::WAV_STOP.send(c, position + to_read);
+                const std::size_t count =
+                    scpi::WAV_DATA_Q.query_block(c, buffer + position, memory_depth - position);
+                if (count == 0)
+                    throw std::logic_error(
+                        fmt::format("Scope returned no data for points {}-{}", position + 1, position + to_read));
+
+                span.set_bytes(count);
+                c.statistics().record_payload(
+                    count, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+                               .count());
+
+                if (position + count < memory_depth)
+                {
+                    read_waveform_block(done, buffer, position + count, memory_depth, block_size);
+                    return;
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_downloads--;
+                }
+                done->set_value();
+            }
+            catch (...)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_downloads--;
+                }
+                done->set_exception(std::current_exception());
+            }
+        };
+
+        enqueue(command_priority::BULK, {block, {}});
+    }
+
+    scheduler_statistics command_scheduler::statistics()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_statistics;
+    }
+} // namespace rigol
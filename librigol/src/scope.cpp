@@ -1,6 +1,7 @@
 #include "scope.h"
 #include "scpi_command.h"
-#include <charconv>
+#include "trace.h"
+#include <chrono>
 #include <spdlog/fmt/fmt.h>
 #include <spdlog/spdlog.h>
 #include <stdexcept>
@@ -8,35 +9,155 @@
 
 namespace rigol
 {
+    namespace
+    {
+        // Points per :WAV:DATA? in BYTE format, the most the scope returns in one block
+        constexpr std::size_t BYTE_BATCH_SIZE = 250000;
+
+        constexpr scpi_mnemonic CHAN_DISP[] = {scpi::CHAN1_DISP, scpi::CHAN2_DISP, scpi::CHAN3_DISP,
+                                               scpi::CHAN4_DISP};
+        constexpr scpi_mnemonic CHAN_DISP_Q[] = {scpi::CHAN1_DISP_Q, scpi::CHAN2_DISP_Q, scpi::CHAN3_DISP_Q,
+                                                 scpi::CHAN4_DISP_Q};
+        constexpr scpi_mnemonic POD_DISP[] = {scpi::LA_POD1_DISP, scpi::LA_POD2_DISP};
+        constexpr scpi_mnemonic POD_DISP_Q[] = {scpi::LA_POD1_DISP_Q, scpi::LA_POD2_DISP_Q};
+    } // namespace
+
+    waveform_stream::waveform_stream(connection &connection, std::vector<std::uint8_t> &buffer,
+                                     const rigol::preamble &pre, std::size_t memory_depth, std::size_t chunk_size)
+        : m_connection(&connection), m_buffer(&buffer), m_preamble(pre), m_memory_depth(memory_depth),
+          m_chunk_size(chunk_size)
+    {
+        if (m_chunk_size == 0)
+            throw std::invalid_argument("Chunk size has to be at least one byte");
+        if (m_buffer->size() < m_chunk_size)
+            m_buffer->resize(m_chunk_size);
+    }
+
+    waveform_stream::waveform_stream(waveform_stream &&other) noexcept
+        : m_connection(other.m_connection), m_buffer(other.m_buffer), m_preamble(other.m_preamble),
+          m_memory_depth(other.m_memory_depth), m_chunk_size(other.m_chunk_size), m_position(other.m_position),
+          m_block_end(other.m_block_end), m_block_start(other.m_block_start), m_block_started(other.m_block_started)
+    {
+        other.m_connection = nullptr;
+    }
+
+    waveform_stream::~waveform_stream()
+    {
+        if (!m_connection || m_position == m_block_end)
+            return;
+
+        try
+        {
+            while (m_position < m_block_end)
+            {
+                const std::size_t size = std::min(m_buffer->size(), m_block_end - m_position);
+                m_connection->read_exact(m_buffer->data(), size);
+                m_position += size;
+            }
+            end_block();
+        }
+        catch (const std::exception &ex)
+        {
+            spdlog::error("Cannot drain abandoned waveform download: {}", ex.what());
+        }
+    }
+
+    void waveform_stream::begin_block()
+    {
+        const std::size_t to_read = std::min(BYTE_BATCH_SIZE, m_memory_depth - m_position);
+        m_block_started = std::chrono::steady_clock::now();
+        scpi::WAV_START.send(*m_connection, m_position + 1);
+        scpi::WAV_STOP.send(*m_connection, m_position + to_read);
+
+        const std::size_t count = scpi::WAV_DATA_Q.begin_block(*m_connection);
+        if (count == 0 || count > m_memory_depth - m_position)
+        {
+            // Consume the block so the connection stays in sync before giving up
+            for (std::size_t left = count; left > 0;)
+            {
+                const std::size_t size = std::min(m_buffer->size(), left);
+                m_connection->read_exact(m_buffer->data(), size);
+                left -= size;
+            }
+            scpi::WAV_DATA_Q.end_block(*m_connection);
+
+            if (count == 0)
+                throw std::logic_error(fmt::format("Scope returned no data for points {}-{}", m_position + 1,
+                                                   m_position + to_read));
+            throw std::length_error(fmt::format("Data block of {} bytes does not fit into {} remaining points", count,
+                                                m_memory_depth - m_position));
+        }
+
+        m_block_start = m_position;
+        m_block_end = m_position + count;
+    }
+
+    void waveform_stream::end_block()
+    {
+        scpi::WAV_DATA_Q.end_block(*m_connection);
+        const std::size_t count = m_block_end - m_block_start;
+        m_connection->statistics().record_payload(
+            count, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                        m_block_started)
+                       .count());
+        spdlog::debug("Streamed {} uint8_t's", count);
+    }
+
+    bool waveform_stream::next(waveform_chunk &chunk)
+    {
+        if (!m_connection || m_position == m_memory_depth)
+            return false;
+
+        if (m_position == m_block_end)
+            begin_block();
+
+        const std::size_t size = std::min(m_chunk_size, m_block_end - m_position);
+        {
+            trace::span span{"WAV:DATA stream chunk", "transfer"};
+            m_connection->read_exact(m_buffer->data(), size);
+            span.set_bytes(size);
+        }
+
+        chunk.offset = m_position;
+        chunk.data = m_buffer->data();
+        chunk.size = size;
+        chunk.preamble = &m_preamble;
+
+        m_position += size;
+        if (m_position == m_block_end)
+            end_block();
+
+        return true;
+    }
+
     scope::scope(std::unique_ptr<connection> &&connection) : m_connection(std::move(connection)) {}
 
-    void scope::run() { no_response_scpi_command({"RUN"}).run_on(*m_connection); }
+    void scope::run() { scpi::RUN.send(*m_connection); }
 
-    void scope::stop() { no_response_scpi_command({"STOP"}).run_on(*m_connection); }
+    void scope::stop() { scpi::STOP.send(*m_connection); }
 
-    void scope::single() { no_response_scpi_command({"SING"}).run_on(*m_connection); }
+    void scope::single() { scpi::SING.send(*m_connection); }
 
     trigger_state scope::get_trigger_state()
     {
-        text_query_scpi_command cmd{"TRIG", "STAT"};
-        cmd.run_on(*m_connection);
+        const std::string_view response = scpi::TRIG_STAT_Q.query(*m_connection);
 
-        if (cmd.last_response() == "TD")
+        if (response == "TD")
             return trigger_state::TD;
 
-        if (cmd.last_response() == "WAIT")
+        if (response == "WAIT")
             return trigger_state::WAIT;
 
-        if (cmd.last_response() == "RUN")
+        if (response == "RUN")
             return trigger_state::RUN;
 
-        if (cmd.last_response() == "AUTO")
+        if (response == "AUTO")
             return trigger_state::AUTO;
 
-        if (cmd.last_response() == "STOP")
+        if (response == "STOP")
             return trigger_state::STOP;
 
-        throw std::logic_error(fmt::format("Unknown trigger state response '{}'", cmd.last_response()));
+        throw std::logic_error(fmt::format("Unknown trigger state response '{}'", response));
     }
 
     void scope::select_channel(channel ch)
@@ -44,55 +165,107 @@ namespace rigol
         switch (ch)
         {
         case channel::CHANNEL_1:
-            no_response_scpi_command({"WAV", "SOUR"}, "CHAN1").run_on(*m_connection);
+            scpi::WAV_SOUR.send(*m_connection, "CHAN1");
             return;
         case channel::CHANNEL_2:
-            no_response_scpi_command({"WAV", "SOUR"}, "CHAN2").run_on(*m_connection);
+            scpi::WAV_SOUR.send(*m_connection, "CHAN2");
             return;
         case channel::CHANNEL_3:
-            no_response_scpi_command({"WAV", "SOUR"}, "CHAN3").run_on(*m_connection);
+            scpi::WAV_SOUR.send(*m_connection, "CHAN3");
             return;
         case channel::CHANNEL_4:
-            no_response_scpi_command({"WAV", "SOUR"}, "CHAN4").run_on(*m_connection);
+            scpi::WAV_SOUR.send(*m_connection, "CHAN4");
             return;
         }
 
         throw std::logic_error("Invalid channel");
     }
 
-    void scope::read_buffer(std::vector<float> &buffer)
+    void scope::select_pod(logic_pod pod)
+    {
+        // Any line of a pod selects the whole pod
+        switch (pod)
+        {
+        case logic_pod::POD_1:
+            scpi::WAV_SOUR.send(*m_connection, "D0");
+            return;
+        case logic_pod::POD_2:
+            scpi::WAV_SOUR.send(*m_connection, "D8");
+            return;
+        }
+
+        throw std::logic_error("Invalid pod");
+    }
+
+    std::size_t scope::memory_depth()
     {
-        text_query_scpi_command get_memory_depth{"ACQ", "MDEP"};
-        get_memory_depth.run_on(*m_connection);
+        const std::string_view response = scpi::ACQ_MDEP_Q.query(*m_connection);
 
-        if (get_memory_depth.last_response() == "AUTO")
+        if (response == "AUTO")
             throw std::logic_error("Cannot read buffer with 'AUTO' memory depth");
 
-        std::size_t memory_depth = (std::size_t)std::atol(get_memory_depth.last_response().c_str());
+        return (std::size_t)std::atol(response.data());
+    }
+
+    void scope::set_memory_depth(std::size_t memory_depth)
+    {
+        scpi::RUN.send(*m_connection);
+        scpi::ACQ_MDEP.send(*m_connection, memory_depth);
+    }
+
+    bool scope::channel_enabled(channel ch)
+    {
+        const std::string_view response = CHAN_DISP_Q[(std::size_t)ch].query(*m_connection);
+        return response == "1" || response == "ON";
+    }
+
+    void scope::enable_channel(channel ch, bool enabled)
+    {
+        CHAN_DISP[(std::size_t)ch].send(*m_connection, enabled ? "ON" : "OFF");
+    }
+
+    bool scope::pod_enabled(logic_pod pod)
+    {
+        const std::string_view response = POD_DISP_Q[(std::size_t)pod].query(*m_connection);
+        return response == "1" || response == "ON";
+    }
+
+    void scope::enable_pod(logic_pod pod, bool enabled)
+    {
+        if (enabled)
+            scpi::LA_STAT.send(*m_connection, "ON");
+        POD_DISP[(std::size_t)pod].send(*m_connection, enabled ? "ON" : "OFF");
+    }
+
+    void scope::read_buffer(std::vector<float> &buffer)
+    {
+        const std::size_t memory_depth = this->memory_depth();
 
         buffer.clear();
         buffer.reserve(memory_depth);
 
-        text_query_scpi_command get_data{"WAV", "DATA"};
-        no_response_scpi_command({"WAV", "MODE"}, "RAW").run_on(*m_connection);
-        no_response_scpi_command({"WAV", "FORM"}, "ASC").run_on(*m_connection);
+        scpi::WAV_MODE.send(*m_connection, "RAW");
+        scpi::WAV_FORM.send(*m_connection, "ASC");
 
         constexpr std::size_t BATCH_SIZE = 15625;
         for (std::size_t i = 0; i < memory_depth; i += BATCH_SIZE)
         {
             const std::size_t to_read = std::min(BATCH_SIZE, memory_depth - i);
-
-            no_response_scpi_command({"WAV", "START"}, fmt::format("{}", i + 1)).run_on(*m_connection);
-            no_response_scpi_command({"WAV", "STOP"}, fmt::format("{}", i + to_read)).run_on(*m_connection);
-            get_data.run_on(*m_connection);
-            const std::string &resp = get_data.last_response();
-            const std::string_view header{&*resp.begin(), 2};
-            const std::string_view s_count{&*resp.begin() + 2, 9};
-            std::string_view rest{&*resp.begin() + 11, resp.size() - 11};
-
-            if (header != "#9")
+            trace::span span{"WAV:DATA chunk", "transfer"};
+            const auto start = std::chrono::steady_clock::now();
+
+            scpi::WAV_START.send(*m_connection, i + 1);
+            scpi::WAV_STOP.send(*m_connection, i + to_read);
+            const std::string_view resp = scpi::WAV_DATA_Q.query(*m_connection);
+            span.set_bytes(resp.size());
+            m_connection->statistics().record_payload(
+                resp.size(),
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+            if (resp.size() < 11 || resp.substr(0, 2) != "#9")
                 throw std::logic_error(fmt::format("Invalid data header, expected #9. Whole line: {}", resp));
 
+            std::string_view rest = resp.substr(11);
             std::size_t temp = 0;
             while (!rest.empty())
             {
@@ -115,92 +288,118 @@ namespace rigol
         }
     }
 
-    void scope::read_buffer(std::vector<uint8_t> &buffer)
-    {
-        text_query_scpi_command get_memory_depth{"ACQ", "MDEP"};
-        get_memory_depth.run_on(*m_connection);
-
-        if (get_memory_depth.last_response() == "AUTO")
-            throw std::logic_error("Cannot read buffer with 'AUTO' memory depth");
-
-        std::size_t memory_depth = (std::size_t)std::atol(get_memory_depth.last_response().c_str());
+    void scope::read_buffer(std::vector<uint8_t> &buffer) { read_buffer(buffer, memory_depth()); }
 
-        buffer.clear();
-        buffer.reserve(memory_depth);
+    void scope::read_buffer(std::vector<uint8_t> &buffer, std::size_t memory_depth)
+    {
+        buffer.resize(memory_depth);
+        read_buffer(buffer.data(), memory_depth);
+    }
 
-        no_response_scpi_command({"WAV", "MODE"}, "RAW").run_on(*m_connection);
-        no_response_scpi_command({"WAV", "FORM"}, "BYTE").run_on(*m_connection);
+    void scope::read_buffer(uint8_t *buffer, std::size_t memory_depth)
+    {
+        scpi::WAV_MODE.send(*m_connection, "RAW");
+        scpi::WAV_FORM.send(*m_connection, "BYTE");
 
-        constexpr std::size_t BATCH_SIZE = 250000;
         std::size_t count = 0;
         for (std::size_t i = 0; i < memory_depth; i += count)
         {
-            const std::size_t to_read = std::min(BATCH_SIZE, memory_depth - i);
-
-            no_response_scpi_command({"WAV", "START"}, fmt::format("{}", i + 1)).run_on(*m_connection);
-            no_response_scpi_command({"WAV", "STOP"}, fmt::format("{}", i + to_read)).run_on(*m_connection);
-
-            no_response_scpi_command({"WAV", "DATA?"}).run_on(*m_connection);
-            std::string resp;
-            m_connection->read(resp, 11);
-            const std::string_view header{&*resp.begin(), 2};
-            const std::string_view s_count{&*resp.begin() + 2, 9};
-
-            if (header != "#9")
-                throw std::logic_error(fmt::format("Invalid data header, expected #9. Whole line: {}", resp));
-
-            auto ret = std::from_chars(s_count.begin(), s_count.end(), count, 10);
-            if (ret.ec != std::errc())
-                throw std::system_error((int)ret.ec, std::generic_category(),
-                                        "Cannot interpter number of bytes to read");
-
-            m_connection->read(resp, count + 1);
-            std::string_view rest{&*resp.begin(), resp.size() - 1};
-
-            buffer.insert(buffer.end(), rest.cbegin(), rest.cend());
+            const std::size_t to_read = std::min(BYTE_BATCH_SIZE, memory_depth - i);
+            trace::span span{"WAV:DATA chunk", "transfer"};
+            const auto start = std::chrono::steady_clock::now();
+
+            scpi::WAV_START.send(*m_connection, i + 1);
+            scpi::WAV_STOP.send(*m_connection, i + to_read);
+            count = scpi::WAV_DATA_Q.query_block(*m_connection, buffer + i, memory_depth - i);
+            if (count == 0)
+                throw std::logic_error(fmt::format("Scope returned no data for points {}-{}", i + 1, i + to_read));
+
+            span.set_bytes(count);
+            m_connection->statistics().record_payload(
+                count, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+                           .count());
             spdlog::debug("Read {} uint8_t's", count);
         }
     }
 
-    double scope::x_origin()
+    waveform_stream scope::stream_buffer(std::size_t memory_depth, const preamble *pre, std::size_t chunk_size)
     {
-        text_query_scpi_command cmd{"WAV", "XOR"};
-        cmd.run_on(*m_connection);
-        return strtod(&*cmd.last_response().begin(), nullptr);
+        const preamble read = pre ? preamble{} : read_preamble();
+        scpi::WAV_MODE.send(*m_connection, "RAW");
+        scpi::WAV_FORM.send(*m_connection, "BYTE");
+        return waveform_stream{*m_connection, m_chunk_buffer, pre ? *pre : read, memory_depth, chunk_size};
     }
 
-    double scope::x_increment()
+    void scope::stream_buffer(std::size_t memory_depth, const chunk_callback &callback, const preamble *pre,
+                              std::size_t chunk_size)
     {
-        text_query_scpi_command cmd{"WAV", "XINC"};
-        cmd.run_on(*m_connection);
-        return strtod(&*cmd.last_response().begin(), nullptr);
+        waveform_stream stream = stream_buffer(memory_depth, pre, chunk_size);
+        waveform_chunk chunk;
+        while (stream.next(chunk))
+            callback(chunk);
     }
 
-    double scope::x_reference()
+    preamble scope::read_preamble()
     {
-        text_query_scpi_command cmd{"WAV", "XREF"};
-        cmd.run_on(*m_connection);
-        return strtod(&*cmd.last_response().begin(), nullptr);
+        const std::string_view response = scpi::WAV_PRE_Q.query(*m_connection);
+        const char *pos = response.data();
+        char *end = nullptr;
+
+        double values[10];
+        for (std::size_t i = 0; i < 10; i++)
+        {
+            values[i] = strtod(pos, &end);
+            if (end == pos || (i < 9 && *end != ','))
+                throw std::logic_error(fmt::format("Invalid waveform preamble '{}'", response));
+            pos = end + 1;
+        }
+
+        preamble ret;
+        ret.format = (int)values[0];
+        ret.type = (int)values[1];
+        ret.points = (std::size_t)values[2];
+        ret.count = (std::size_t)values[3];
+        ret.x_increment = values[4];
+        ret.x_origin = values[5];
+        ret.x_reference = values[6];
+        ret.y_increment = values[7];
+        ret.y_origin = values[8];
+        ret.y_reference = values[9];
+        return ret;
     }
 
-    double scope::y_origin()
+    std::size_t scope::max_recorded_frames()
     {
-        text_query_scpi_command cmd{"WAV", "YOR"};
-        cmd.run_on(*m_connection);
-        return strtod(&*cmd.last_response().begin(), nullptr);
+        return (std::size_t)std::atol(scpi::FUNC_WREC_FMAX_Q.query(*m_connection).data());
     }
 
-    double scope::y_increment()
+    void scope::start_recording(std::size_t frames)
     {
-        text_query_scpi_command cmd{"WAV", "YINC"};
-        cmd.run_on(*m_connection);
-        return strtod(&*cmd.last_response().begin(), nullptr);
+        scpi::FUNC_WREC_ENAB.send(*m_connection, "ON");
+        scpi::FUNC_WREC_FEND.send(*m_connection, frames);
+        scpi::RUN.send(*m_connection);
+        scpi::FUNC_WREC_OPER.send(*m_connection, "RUN");
     }
 
-    double scope::y_reference()
+    bool scope::is_recording() { return scpi::FUNC_WREC_OPER_Q.query(*m_connection) == "RUN"; }
+
+    void scope::stop_recording()
     {
-        text_query_scpi_command cmd{"WAV", "YREF"};
-        cmd.run_on(*m_connection);
-        return strtod(&*cmd.last_response().begin(), nullptr);
+        scpi::FUNC_WREC_OPER.send(*m_connection, "STOP");
+        scpi::STOP.send(*m_connection);
     }
+
+    void scope::select_frame(std::size_t frame) { scpi::FUNC_WREP_FCUR.send(*m_connection, frame); }
+
+    double scope::x_origin() { return strtod(scpi::WAV_XOR_Q.query(*m_connection).data(), nullptr); }
+
+    double scope::x_increment() { return strtod(scpi::WAV_XINC_Q.query(*m_connection).data(), nullptr); }
+
+    double scope::x_reference() { return strtod(scpi::WAV_XREF_Q.query(*m_connection).data(), nullptr); }
+
+    double scope::y_origin() { return strtod(scpi::WAV_YOR_Q.query(*m_connection).data(), nullptr); }
+
+    double scope::y_increment() { return strtod(scpi::WAV_YINC_Q.query(*m_connection).data(), nullptr); }
+
+    double scope::y_reference() { return strtod(scpi::WAV_YREF_Q.query(*m_connection).data(), nullptr); }
 } // namespace rigol
\ No newline at end of file
@@ -1,12 +1,53 @@
 #include "scpi_command.h"
 #include "connection.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <charconv>
 #include <cstddef>
 #include <numeric>
 #include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <system_error>
 
 namespace rigol
 {
+    namespace
+    {
+        std::string_view prepare(connection &connection, std::string_view header, std::string_view args)
+        {
+            std::string &command = connection.command_buffer();
+            command.clear();
+            command.append(header);
+            if (!args.empty())
+            {
+                command.push_back(' ');
+                command.append(args);
+            }
+            command.push_back('\n');
+            return std::string_view(command).substr(0, command.size() - 1);
+        }
+
+        std::size_t read_block_length(connection &connection)
+        {
+            char header[11];
+            connection.read_exact((std::uint8_t *)header, 2);
+            if (header[0] != '#' || header[1] < '1' || header[1] > '9')
+                throw std::logic_error(
+                    fmt::format("Invalid data header, expected #<digit>. Got: {}", std::string_view(header, 2)));
+
+            const std::size_t digits = header[1] - '0';
+            connection.read_exact((std::uint8_t *)header + 2, digits);
+            std::size_t count = 0;
+            auto ret = std::from_chars(header + 2, header + 2 + digits, count, 10);
+            if (ret.ec != std::errc())
+                throw std::system_error((int)ret.ec, std::generic_category(),
+                                        "Cannot interpter number of bytes to read");
+
+            return count;
+        }
+    } // namespace
+
     no_response_scpi_command::no_response_scpi_command(const std::string &command) : m_command(command) {}
 
     no_response_scpi_command::no_response_scpi_command(const std::initializer_list<std::string> &parts,
@@ -32,7 +73,10 @@ namespace rigol
 
     void no_response_scpi_command::run_on(connection &connection)
     {
-        spdlog::debug("Sending command: {}", std::string_view(m_command).substr(0, m_command.size() - 1));
+        const std::string_view command = std::string_view(m_command).substr(0, m_command.size() - 1);
+        trace::span span{command, "scpi"};
+        command_timer timer{connection.statistics(), command};
+        spdlog::debug("Sending command: {}", command);
         connection.write(m_command);
     }
 
@@ -55,10 +99,92 @@ namespace rigol
 
     void text_query_scpi_command::run_on(connection &connection)
     {
-        spdlog::debug("Sending query: {}", std::string_view(m_command).substr(0, m_command.size() - 1));
+        const std::string_view command = std::string_view(m_command).substr(0, m_command.size() - 1);
+        trace::span span{command, "scpi"};
+        command_timer timer{connection.statistics(), command};
+        spdlog::debug("Sending query: {}", command);
         connection.write(m_command);
         m_last_response.clear();
         connection.read_line(m_last_response);
         spdlog::debug("Got response: {}", m_last_response);
     }
-} // namespace rigol
\ No newline at end of file
+
+    void scpi_mnemonic::send(connection &connection, std::string_view args) const
+    {
+        const std::string_view command = prepare(connection, m_header, args);
+        trace::span span{command, "scpi"};
+        command_timer timer{connection.statistics(), m_header};
+        spdlog::debug("Sending command: {}", command);
+        connection.write(connection.command_buffer());
+    }
+
+    void scpi_mnemonic::send(connection &connection, std::size_t arg) const
+    {
+        char digits[24];
+        auto ret = std::to_chars(std::begin(digits), std::end(digits), arg);
+        send(connection, std::string_view(digits, ret.ptr - digits));
+    }
+
+    std::string_view scpi_mnemonic::query(connection &connection) const
+    {
+        const std::string_view command = prepare(connection, m_header, {});
+        trace::span span{command, "scpi"};
+        command_timer timer{connection.statistics(), m_header};
+        spdlog::debug("Sending query: {}", command);
+        connection.write(connection.command_buffer());
+
+        std::string &response = connection.response_buffer();
+        response.clear();
+        connection.read_line(response);
+        spdlog::debug("Got response: {}", response);
+        return response;
+    }
+
+    std::size_t scpi_mnemonic::query_block(connection &connection, std::uint8_t *out, std::size_t capacity) const
+    {
+        const std::string_view command = prepare(connection, m_header, {});
+        trace::span span{command, "scpi"};
+        command_timer timer{connection.statistics(), m_header};
+        spdlog::debug("Sending query: {}", command);
+        connection.write(connection.command_buffer());
+
+        const std::size_t count = read_block_length(connection);
+        if (count > capacity)
+        {
+            // Drained with its terminator, the next response would otherwise start inside the block
+            std::uint8_t scratch[4096];
+            for (std::size_t left = count + 1; left;)
+            {
+                const std::size_t size = std::min(left, sizeof(scratch));
+                connection.read_exact(scratch, size);
+                left -= size;
+            }
+            throw std::length_error(fmt::format("Data block of {} bytes does not fit into {} bytes", count, capacity));
+        }
+
+        connection.read_exact(out, count);
+        char terminator;
+        connection.read_exact((std::uint8_t *)&terminator, 1);
+        spdlog::debug("Got {} bytes of binary response", count);
+        return count;
+    }
+
+    std::size_t scpi_mnemonic::begin_block(connection &connection) const
+    {
+        const std::string_view command = prepare(connection, m_header, {});
+        trace::span span{command, "scpi"};
+        command_timer timer{connection.statistics(), m_header};
+        spdlog::debug("Sending query: {}", command);
+        connection.write(connection.command_buffer());
+
+        const std::size_t count = read_block_length(connection);
+        spdlog::debug("Streaming {} bytes of binary response", count);
+        return count;
+    }
+
+    void scpi_mnemonic::end_block(connection &connection) const
+    {
+        char terminator;
+        connection.read_exact((std::uint8_t *)&terminator, 1);
+    }
+} // namespace rigol
@@ -0,0 +1,193 @@
+#include "statistics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <spdlog/fmt/fmt.h>
+#include <stdexcept>
+
+namespace rigol
+{
+    unsigned latency_histogram::bucket_index(std::uint64_t ns)
+    {
+        if (ns < (1u << SUB_BUCKET_BITS))
+            return (unsigned)ns;
+
+        unsigned msb = 63;
+        while ((ns >> msb) == 0)
+            msb--;
+
+        const unsigned exponent = msb - SUB_BUCKET_BITS + 1;
+        return exponent * SUB_BUCKET_HALF + (unsigned)(ns >> exponent);
+    }
+
+    std::uint64_t latency_histogram::bucket_upper_bound(unsigned index)
+    {
+        if (index < (1u << SUB_BUCKET_BITS))
+            return index;
+
+        const unsigned exponent = index / SUB_BUCKET_HALF - 1;
+        const std::uint64_t sub_bucket = index - exponent * SUB_BUCKET_HALF;
+        return ((sub_bucket + 1) << exponent) - 1;
+    }
+
+    void latency_histogram::record(std::uint64_t ns)
+    {
+        m_counts[bucket_index(ns)]++;
+        m_count++;
+        m_total_ns += ns;
+        m_min_ns = std::min(m_min_ns, ns);
+        m_max_ns = std::max(m_max_ns, ns);
+    }
+
+    void latency_histogram::merge(const latency_histogram &other)
+    {
+        for (std::size_t i = 0; i < m_counts.size(); i++)
+            m_counts[i] += other.m_counts[i];
+
+        m_count += other.m_count;
+        m_total_ns += other.m_total_ns;
+        m_min_ns = std::min(m_min_ns, other.m_min_ns);
+        m_max_ns = std::max(m_max_ns, other.m_max_ns);
+    }
+
+    std::uint64_t latency_histogram::percentile_ns(double p) const
+    {
+        if (m_count == 0)
+            return 0;
+
+        const std::uint64_t rank = std::max<std::uint64_t>(1, (std::uint64_t)(p / 100.0 * m_count + 0.5));
+        std::uint64_t seen = 0;
+        for (unsigned i = 0; i < m_counts.size(); i++)
+        {
+            seen += m_counts[i];
+            if (seen >= rank)
+                return std::clamp(bucket_upper_bound(i), min_ns(), m_max_ns);
+        }
+
+        return m_max_ns;
+    }
+
+    latency_histogram &connection_statistics::command(std::string_view mnemonic)
+    {
+        auto it = commands.find(mnemonic);
+        if (it == commands.end())
+            it = commands.emplace(std::string(mnemonic), latency_histogram{}).first;
+
+        return it->second;
+    }
+
+    void connection_statistics::record_payload(std::uint64_t bytes, std::uint64_t ns)
+    {
+        payload_bytes += bytes;
+        payload_ns += ns;
+    }
+
+    double connection_statistics::payload_throughput() const
+    {
+        return payload_ns ? payload_bytes * 1e9 / payload_ns : 0.0;
+    }
+
+    command_timer::command_timer(connection_statistics &stats, std::string_view mnemonic)
+        : m_histogram(stats.command(mnemonic.substr(0, mnemonic.find(' ')))),
+          m_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    command_timer::~command_timer()
+    {
+        m_histogram.record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count());
+    }
+
+    void write_summary(std::ostream &os, const connection_statistics &stats)
+    {
+        os << fmt::format("{:<16} {:>8} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "command", "count", "min [us]",
+                          "p50 [us]", "p90 [us]", "p99 [us]", "max [us]", "total [ms]");
+
+        for (const auto &[mnemonic, hist] : stats.commands)
+        {
+            os << fmt::format("{:<16} {:>8} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.2f}\n", mnemonic,
+                              hist.count(), hist.min_ns() / 1e3, hist.percentile_ns(50) / 1e3,
+                              hist.percentile_ns(90) / 1e3, hist.percentile_ns(99) / 1e3, hist.max_ns() / 1e3,
+                              hist.total_ns() / 1e6);
+        }
+
+        os << fmt::format("sent {} bytes in {} calls, received {} bytes in {} calls\n", stats.bytes_sent,
+                          stats.send_calls, stats.bytes_received, stats.receive_calls);
+        os << fmt::format("payload {} bytes in {:.3f} s ({:.2f} MB/s)\n", stats.payload_bytes, stats.payload_ns / 1e9,
+                          stats.payload_throughput() / 1e6);
+    }
+
+    namespace
+    {
+        // Label values escape backslash, double quote and line feed in the text exposition format
+        std::string label_value(std::string_view value)
+        {
+            std::string escaped;
+            escaped.reserve(value.size());
+            for (char ch : value)
+            {
+                if (ch == '\\' || ch == '"')
+                    escaped.push_back('\\');
+                if (ch == '\n')
+                    escaped += "\\n";
+                else
+                    escaped.push_back(ch);
+            }
+            return escaped;
+        }
+    } // namespace
+
+    void write_prometheus(std::ostream &os, const connection_statistics &stats, std::string_view instance)
+    {
+        const std::string labels =
+            instance.empty() ? std::string{} : fmt::format("instance=\"{}\"", label_value(instance));
+        const std::string plain_labels = labels.empty() ? std::string{} : fmt::format("{{{}}}", labels);
+        const std::string label_prefix = labels.empty() ? std::string{} : labels + ",";
+
+        auto counter = [&](const char *name, const char *help, std::uint64_t value) {
+            os << fmt::format("# HELP {} {}\n# TYPE {} counter\n{}{} {}\n", name, help, name, name, plain_labels,
+                              value);
+        };
+
+        counter("rigol_bytes_sent_total", "Bytes written to the scope connection", stats.bytes_sent);
+        counter("rigol_bytes_received_total", "Bytes read from the scope connection", stats.bytes_received);
+        counter("rigol_send_calls_total", "Send system calls on the scope connection", stats.send_calls);
+        counter("rigol_receive_calls_total", "Receive system calls on the scope connection", stats.receive_calls);
+        counter("rigol_payload_bytes_total", "Waveform payload bytes received", stats.payload_bytes);
+
+        os << fmt::format("# HELP rigol_payload_throughput_bytes_per_second Waveform payload throughput\n"
+                          "# TYPE rigol_payload_throughput_bytes_per_second gauge\n"
+                          "rigol_payload_throughput_bytes_per_second{} {:.0f}\n",
+                          plain_labels, stats.payload_throughput());
+
+        os << "# HELP rigol_command_latency_seconds SCPI command round trip latency\n"
+              "# TYPE rigol_command_latency_seconds summary\n";
+        for (const auto &[mnemonic, hist] : stats.commands)
+        {
+            for (double q : {0.5, 0.9, 0.99, 1.0})
+            {
+                os << fmt::format("rigol_command_latency_seconds{{{}command=\"{}\",quantile=\"{}\"}} {:.9f}\n",
+                                  label_prefix, label_value(mnemonic), q, hist.percentile_ns(q * 100) / 1e9);
+            }
+            os << fmt::format("rigol_command_latency_seconds_sum{{{}command=\"{}\"}} {:.9f}\n", label_prefix,
+                              label_value(mnemonic), hist.total_ns() / 1e9);
+            os << fmt::format("rigol_command_latency_seconds_count{{{}command=\"{}\"}} {}\n", label_prefix,
+                              label_value(mnemonic), hist.count());
+        }
+    }
+
+    void write_prometheus_file(const std::string &path, const connection_statistics &stats, std::string_view instance)
+    {
+        const std::string temporary = path + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::trunc | std::ios::out);
+            write_prometheus(file, stats, instance);
+            if (!file)
+                throw std::runtime_error(fmt::format("Cannot write {}", temporary));
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0)
+            throw std::runtime_error(fmt::format("Cannot replace {}", path));
+    }
+} // namespace rigol
@@ -1,6 +1,7 @@
 #ifdef __unix__
 #include "connection.h"
 #include "spdlog/spdlog.h"
+#include "trace.h"
 
 #include <arpa/inet.h>
 #include <stdexcept>
@@ -12,6 +13,7 @@ namespace rigol
 {
     tcp_connection::tcp_connection(const std::string &address, std::uint16_t port)
     {
+        trace::span span{"connect", "io"};
         struct sockaddr_in scope_addr;
         scope_addr.sin_family = AF_INET;
         scope_addr.sin_port = htons(port);
@@ -46,6 +48,8 @@ namespace rigol
         ssize_t ret = recv(m_fd, buffer, max_len, 0);
         if (ret == -1)
             throw std::system_error(errno, std::system_category(), "Cannot receive from scope");
+        if (ret == 0 && max_len > 0)
+            throw std::runtime_error("Connection closed by scope");
 
         return (std::size_t)ret;
     }
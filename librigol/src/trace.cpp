@@ -0,0 +1,109 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <spdlog/fmt/fmt.h>
+
+namespace rigol
+{
+    namespace trace
+    {
+        std::atomic<bool> is_enabled{false};
+        thread_local unsigned paused = 0;
+
+        namespace
+        {
+            std::unique_ptr<event[]> events;
+            std::size_t events_mask = 0;
+            std::atomic<std::uint64_t> events_head{0};
+            std::uint64_t epoch_ns = 0;
+            std::atomic<std::uint32_t> next_thread_id{1};
+
+            std::uint32_t this_thread_id()
+            {
+                thread_local const std::uint32_t id = next_thread_id.fetch_add(1, std::memory_order_relaxed);
+                return id;
+            }
+
+            void write_escaped(std::ostream &os, const char *s)
+            {
+                for (; *s != '\0'; s++)
+                {
+                    if (*s == '"' || *s == '\\')
+                        os.put('\\');
+                    os.put(*s);
+                }
+            }
+        } // namespace
+
+        void enable(std::size_t capacity)
+        {
+            std::size_t size = 1;
+            while (size < capacity)
+                size <<= 1;
+
+            is_enabled.store(false);
+            if (!events || size > events_mask + 1)
+            {
+                events = std::make_unique<event[]>(size);
+                events_mask = size - 1;
+            }
+            events_head.store(0);
+            epoch_ns = now_ns();
+            is_enabled.store(true);
+        }
+
+        void disable() { is_enabled.store(false); }
+
+        std::uint64_t now_ns()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+        }
+
+        void record(std::string_view name, const char *category, std::uint64_t start_ns, std::int64_t bytes)
+        {
+            const std::uint64_t end_ns = now_ns();
+            if (!is_enabled.load(std::memory_order_relaxed))
+                return;
+
+            event &ev = events[events_head.fetch_add(1, std::memory_order_relaxed) & events_mask];
+            ev.start_ns = start_ns;
+            ev.duration_ns = end_ns - start_ns;
+            ev.bytes = bytes;
+            ev.thread_id = this_thread_id();
+            ev.category = category;
+
+            const std::size_t len = std::min(name.size(), sizeof(ev.name) - 1);
+            std::memcpy(ev.name, name.data(), len);
+            ev.name[len] = '\0';
+        }
+
+        void write_chrome_json(std::ostream &os)
+        {
+            const std::uint64_t head = events_head.load();
+            const std::uint64_t count = std::min<std::uint64_t>(head, events ? events_mask + 1 : 0);
+
+            os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+            for (std::uint64_t i = head - count; i < head; i++)
+            {
+                const event &ev = events[i & events_mask];
+                if (i != head - count)
+                    os << ',';
+
+                os << "\n{\"name\":\"";
+                write_escaped(os, ev.name);
+                os << fmt::format("\",\"cat\":\"{}\",\"ph\":\"X\",\"ts\":{:.3f},\"dur\":{:.3f},\"pid\":1,\"tid\":{}",
+                                  ev.category, (ev.start_ns - epoch_ns) / 1000.0, ev.duration_ns / 1000.0,
+                                  ev.thread_id);
+                if (ev.bytes >= 0)
+                    os << fmt::format(",\"args\":{{\"bytes\":{}}}", ev.bytes);
+                os << '}';
+            }
+            os << "\n]}\n";
+        }
+    } // namespace trace
+} // namespace rigol
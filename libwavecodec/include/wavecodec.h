@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Lossless codec for 8-bit ADC codes. Every sample is replaced by the zigzag encoded difference to
+// its predecessor, the residuals are then bit-packed in blocks of BLOCK_SIZE samples using the
+// narrowest width that fits the whole block:
+//
+//   header: magic, block size, sample count (16 bytes)
+//   block:  width w (1 byte), then for each group of 16 samples w bit planes of 16 bits each
+//
+// A quiet 8-bit signal usually needs 2-3 bits per sample.
+namespace wavecodec
+{
+    constexpr std::size_t BLOCK_SIZE = 128;
+    constexpr std::size_t HEADER_SIZE = 16;
+
+    std::size_t max_encoded_size(std::size_t count);
+    // Returns the number of bytes written to `out`, which needs max_encoded_size(count) bytes
+    std::size_t encode(const uint8_t *data, std::size_t count, uint8_t *out);
+    void encode(const uint8_t *data, std::size_t count, std::vector<uint8_t> &out);
+
+    // Sample count stored in the header of an encoded buffer
+    std::size_t decoded_size(const uint8_t *encoded, std::size_t size);
+    // `out` needs decoded_size() bytes, throws std::runtime_error on malformed input
+    void decode(const uint8_t *encoded, std::size_t size, uint8_t *out);
+    void decode(const uint8_t *encoded, std::size_t size, std::vector<uint8_t> &out);
+} // namespace wavecodec
@@ -0,0 +1,214 @@
+#include "wavecodec.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace wavecodec
+{
+    namespace
+    {
+        constexpr uint32_t MAGIC = 0x31433857; // "W8C1"
+        constexpr std::size_t GROUP_SIZE = 16;
+        constexpr std::size_t GROUPS = BLOCK_SIZE / GROUP_SIZE;
+        constexpr uint8_t INITIAL_PREDICTION = 128;
+
+        constexpr std::array<uint64_t, 256> make_expand_table()
+        {
+            std::array<uint64_t, 256> table{};
+            for (unsigned m = 0; m < 256; m++)
+            {
+                for (unsigned bit = 0; bit < 8; bit++)
+                {
+                    if (m & (1u << bit))
+                        table[m] |= uint64_t(1) << (8 * bit);
+                }
+            }
+            return table;
+        }
+
+        // Byte j of expand[m] is bit j of m
+        constexpr std::array<uint64_t, 256> EXPAND = make_expand_table();
+
+        uint8_t zigzag(uint8_t sample, uint8_t prediction)
+        {
+            const int8_t d = (int8_t)(uint8_t)(sample - prediction);
+            return (uint8_t)((d * 2) ^ (d >> 7));
+        }
+
+        // Residuals of one block, zero padded past `count`, returns the OR of all of them
+        uint8_t residuals(const uint8_t *data, std::size_t count, uint8_t prediction, uint8_t *zz)
+        {
+            std::size_t i = 0;
+            uint8_t acc = 0;
+
+#ifdef __SSE2__
+            if (count == BLOCK_SIZE)
+            {
+                const __m128i zero = _mm_setzero_si128();
+                __m128i any = zero;
+                for (; i < BLOCK_SIZE; i += GROUP_SIZE)
+                {
+                    const __m128i cur = _mm_loadu_si128((const __m128i *)(data + i));
+                    const uint8_t before = i ? data[i - 1] : prediction;
+                    const __m128i prev = _mm_or_si128(_mm_slli_si128(cur, 1), _mm_cvtsi32_si128(before));
+                    const __m128i d = _mm_sub_epi8(cur, prev);
+                    const __m128i z = _mm_xor_si128(_mm_add_epi8(d, d), _mm_cmpgt_epi8(zero, d));
+                    _mm_store_si128((__m128i *)(zz + i), z);
+                    any = _mm_or_si128(any, z);
+                }
+                any = _mm_or_si128(any, _mm_srli_si128(any, 8));
+                any = _mm_or_si128(any, _mm_srli_si128(any, 4));
+                any = _mm_or_si128(any, _mm_srli_si128(any, 2));
+                any = _mm_or_si128(any, _mm_srli_si128(any, 1));
+                return (uint8_t)_mm_cvtsi128_si32(any);
+            }
+#endif
+
+            for (; i < count; i++)
+            {
+                zz[i] = zigzag(data[i], prediction);
+                prediction = data[i];
+                acc |= zz[i];
+            }
+            std::memset(zz + count, 0, BLOCK_SIZE - count);
+            return acc;
+        }
+
+        void pack(const uint8_t *zz, unsigned width, uint8_t *out)
+        {
+            for (std::size_t g = 0; g < GROUPS; g++)
+            {
+#ifdef __SSE2__
+                const __m128i v = _mm_load_si128((const __m128i *)(zz + g * GROUP_SIZE));
+                for (unsigned k = 0; k < width; k++)
+                {
+                    // Moves bit k of every byte to its top bit, movemask collects them
+                    const uint16_t plane = (uint16_t)_mm_movemask_epi8(_mm_slli_epi16(v, 7 - k));
+                    std::memcpy(out, &plane, 2);
+                    out += 2;
+                }
+#else
+                for (unsigned k = 0; k < width; k++)
+                {
+                    uint16_t plane = 0;
+                    for (std::size_t j = 0; j < GROUP_SIZE; j++)
+                        plane |= ((zz[g * GROUP_SIZE + j] >> k) & 1) << j;
+                    std::memcpy(out, &plane, 2);
+                    out += 2;
+                }
+#endif
+            }
+        }
+
+        void unpack(const uint8_t *in, unsigned width, uint8_t *zz)
+        {
+            for (std::size_t g = 0; g < GROUPS; g++)
+            {
+                uint64_t lo = 0;
+                uint64_t hi = 0;
+                for (unsigned k = 0; k < width; k++)
+                {
+                    lo |= EXPAND[in[0]] << k;
+                    hi |= EXPAND[in[1]] << k;
+                    in += 2;
+                }
+                std::memcpy(zz + g * GROUP_SIZE, &lo, 8);
+                std::memcpy(zz + g * GROUP_SIZE + 8, &hi, 8);
+            }
+        }
+    } // namespace
+
+    std::size_t max_encoded_size(std::size_t count)
+    {
+        const std::size_t blocks = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        return HEADER_SIZE + blocks * (1 + GROUPS * 2 * 8);
+    }
+
+    std::size_t encode(const uint8_t *data, std::size_t count, uint8_t *out)
+    {
+        const uint32_t header[2] = {MAGIC, (uint32_t)BLOCK_SIZE};
+        const uint64_t samples = count;
+        std::memcpy(out, header, 8);
+        std::memcpy(out + 8, &samples, 8);
+        uint8_t *pos = out + HEADER_SIZE;
+
+        alignas(16) uint8_t zz[BLOCK_SIZE];
+        uint8_t prediction = INITIAL_PREDICTION;
+        for (std::size_t start = 0; start < count; start += BLOCK_SIZE)
+        {
+            const std::size_t n = std::min(BLOCK_SIZE, count - start);
+            const uint8_t any = residuals(data + start, n, prediction, zz);
+            prediction = data[start + n - 1];
+
+            unsigned width = 0;
+            while (width < 8 && (any >> width))
+                width++;
+
+            *pos++ = (uint8_t)width;
+            pack(zz, width, pos);
+            pos += GROUPS * 2 * width;
+        }
+
+        return pos - out;
+    }
+
+    void encode(const uint8_t *data, std::size_t count, std::vector<uint8_t> &out)
+    {
+        out.resize(max_encoded_size(count));
+        out.resize(encode(data, count, out.data()));
+    }
+
+    std::size_t decoded_size(const uint8_t *encoded, std::size_t size)
+    {
+        uint32_t header[2];
+        uint64_t samples;
+        if (size < HEADER_SIZE)
+            throw std::runtime_error("Encoded waveform is truncated");
+        std::memcpy(header, encoded, 8);
+        std::memcpy(&samples, encoded + 8, 8);
+        if (header[0] != MAGIC || header[1] != BLOCK_SIZE)
+            throw std::runtime_error("Not an encoded waveform");
+        return samples;
+    }
+
+    void decode(const uint8_t *encoded, std::size_t size, uint8_t *out)
+    {
+        const std::size_t count = decoded_size(encoded, size);
+        std::size_t pos = HEADER_SIZE;
+
+        alignas(16) uint8_t zz[BLOCK_SIZE];
+        uint8_t prediction = INITIAL_PREDICTION;
+        for (std::size_t start = 0; start < count; start += BLOCK_SIZE)
+        {
+            if (pos >= size)
+                throw std::runtime_error("Encoded waveform is truncated");
+            const unsigned width = encoded[pos++];
+            if (width > 8)
+                throw std::runtime_error("Encoded waveform is corrupted");
+            if (size - pos < GROUPS * 2 * width)
+                throw std::runtime_error("Encoded waveform is truncated");
+
+            unpack(encoded + pos, width, zz);
+            pos += GROUPS * 2 * width;
+
+            const std::size_t n = std::min(BLOCK_SIZE, count - start);
+            for (std::size_t i = 0; i < n; i++)
+            {
+                prediction += (uint8_t)((zz[i] >> 1) ^ -(zz[i] & 1));
+                out[start + i] = prediction;
+            }
+        }
+    }
+
+    void decode(const uint8_t *encoded, std::size_t size, std::vector<uint8_t> &out)
+    {
+        out.resize(decoded_size(encoded, size));
+        decode(encoded, size, out.data());
+    }
+} // namespace wavecodec
@@ -0,0 +1,126 @@
+#include "binary_output.h"
+#include "trace.h"
+#include "wavecodec.h"
+
+#include <filesystem>
+#include <fstream>
+#include <spdlog/fmt/ostr.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+namespace
+{
+    constexpr std::uint64_t ALIGNMENT = 4096;
+
+    std::uint64_t align(std::uint64_t offset) { return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+    std::string shape(const channel_data &data)
+    {
+        return data.frames > 1 ? fmt::format("{}, {}", data.frames, data.points) : fmt::format("{},", data.points);
+    }
+
+    void pad(std::ostream &os, std::uint64_t from, std::uint64_t to)
+    {
+        static const char zeros[ALIGNMENT] = {};
+        os.write(zeros, to - from);
+    }
+
+    // NPY format 1.0, the header is padded so the data starts at ALIGNMENT
+    sink_statistics write_npy(const std::string &path, const channel_data &data, const sink_settings &settings)
+    {
+        file_sink file(path, settings);
+
+        std::string header =
+            fmt::format("{{'descr': '|u1', 'fortran_order': False, 'shape': ({}), }}", shape(data));
+        header.resize(ALIGNMENT - 10 - 1, ' ');
+        header.push_back('\n');
+
+        const uint16_t header_length = (uint16_t)header.size();
+        file.write("\x93NUMPY\x01\x00", 8);
+        file.write((const char *)&header_length, 2);
+        file.write(header.data(), header.size());
+        file.write((const char *)data.raw.data(), data.raw.size());
+
+        file.close();
+        return file.statistics();
+    }
+} // namespace
+
+binary_output::binary_output(const std::string &outfile, output_format format, const sink_settings &settings)
+    : m_format(format), m_base(std::filesystem::path(outfile).replace_extension().string()), m_outfile(outfile),
+      m_settings(settings)
+{
+    if (m_format != output_format::NPY)
+        m_raw = std::make_unique<file_sink>(outfile, m_settings);
+}
+
+void binary_output::write(const channel_data &data)
+{
+    spdlog::info("Saving data for {}", data.channel);
+    entry e{data.channel, data.preamble, {}, 0, data.raw.size(), data.frames, data.points};
+
+    if (m_format == output_format::NPY)
+    {
+        e.file = fmt::format("{}_{}.npy", m_base, data.channel);
+        e.offset = ALIGNMENT;
+        m_statistics += write_npy(e.file, data, m_settings);
+    }
+    else
+    {
+        const uint8_t *bytes = data.raw.data();
+        if (m_format == output_format::PACKED)
+        {
+            rigol::trace::span span{"wavecodec", "output"};
+            wavecodec::encode(data.raw.data(), data.raw.size(), m_encoded);
+            bytes = m_encoded.data();
+            e.size = m_encoded.size();
+        }
+
+        e.file = m_outfile;
+        e.offset = align(m_raw_size);
+        pad(*m_raw, m_raw_size, e.offset);
+        m_raw->write((const char *)bytes, e.size);
+        m_raw_size = e.offset + e.size;
+    }
+
+    m_entries.push_back(std::move(e));
+}
+
+void binary_output::finish()
+{
+    if (m_format != output_format::NPY)
+    {
+        m_raw->close();
+        m_statistics += m_raw->statistics();
+    }
+
+    const std::string path = m_base + ".json";
+    std::ofstream sidecar(path, std::ios::trunc | std::ios::out);
+    if (!sidecar)
+        throw std::runtime_error(fmt::format("Cannot open output file '{}'", path));
+
+    const char *format = m_format == output_format::NPY ? "npy" : m_format == output_format::RAW ? "raw" : "packed";
+    sidecar << fmt::format("{{\n  \"format\": \"{}\",\n  \"dtype\": \"uint8\",\n", format);
+    if (m_format == output_format::PACKED)
+        sidecar << "  \"codec\": \"wavecodec\",\n";
+    sidecar << "  \"volts\": \"(code - y_reference - y_origin) * y_increment\",\n";
+    sidecar << "  \"time\": \"(index - x_reference) * x_increment + x_origin\",\n";
+    sidecar << "  \"channels\": [";
+    for (std::size_t i = 0; i < m_entries.size(); i++)
+    {
+        const entry &e = m_entries[i];
+        const std::string file = std::filesystem::path(e.file).filename().string();
+        sidecar << fmt::format("{}\n    {{\"name\": \"{}\", \"file\": \"{}\", \"offset\": {}, \"size\": {}, "
+                               "\"frames\": {}, \"points\": {},\n",
+                               i ? "," : "", e.channel, file, e.offset, e.size, e.frames, e.points);
+        sidecar << fmt::format("     \"x_increment\": {:.17g}, \"x_origin\": {:.17g}, \"x_reference\": {:.17g},\n",
+                               e.preamble.x_increment, e.preamble.x_origin, e.preamble.x_reference);
+        sidecar << fmt::format("     \"y_increment\": {:.17g}, \"y_origin\": {:.17g}, \"y_reference\": {:.17g}}}",
+                               e.preamble.y_increment, e.preamble.y_origin, e.preamble.y_reference);
+    }
+    sidecar << "\n  ]\n}\n";
+
+    sidecar.close();
+    if (!sidecar)
+        throw std::runtime_error(fmt::format("Cannot write output file '{}'", path));
+}
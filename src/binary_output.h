@@ -0,0 +1,47 @@
+#pragma once
+
+#include "capture.h"
+#include "file_sink.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Writes raw ADC codes for consumers that want to mmap them: either one .npy file per channel or
+// all channels in a single raw file, in both cases every channel's data starts on a 4096 byte
+// boundary. The packed format is the single file layout with every channel run through wavecodec.
+// A JSON sidecar next to the data describes the layout and carries the preambles needed to convert
+// codes to volts.
+class binary_output
+{
+    struct entry
+    {
+        rigol::channel channel;
+        rigol::preamble preamble;
+        std::string file;
+        std::uint64_t offset;
+        std::uint64_t size;
+        std::size_t frames;
+        std::size_t points;
+    };
+
+    output_format m_format;
+    std::string m_base;
+    std::string m_outfile;
+    sink_settings m_settings;
+    std::unique_ptr<file_sink> m_raw;
+    std::uint64_t m_raw_size = 0;
+    std::vector<uint8_t> m_encoded;
+    std::vector<entry> m_entries;
+    sink_statistics m_statistics;
+
+  public:
+    binary_output(const std::string &outfile, output_format format, const sink_settings &settings = {});
+
+    void write(const channel_data &data);
+    // Writes the sidecar, the output is not usable before this is called
+    void finish();
+
+    const sink_statistics &statistics() const { return m_statistics; }
+};
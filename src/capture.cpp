@@ -0,0 +1,1503 @@
+#include "capture.h"
+#include "binary_output.h"
+#include "container.h"
+#include "mat_writer.h"
+#include "memory_budget.h"
+#include "preview.h"
+#include "trace.h"
+#include "waveform_statistics.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <spdlog/fmt/ostr.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+    double elapsed_ms(std::chrono::steady_clock::time_point since)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    }
+
+    // Returns whether a pod had to be switched on
+    bool switch_on_pods(rigol::scope &scope)
+    {
+        bool enabled = false;
+        for (auto pod : {rigol::logic_pod::POD_1, rigol::logic_pod::POD_2})
+        {
+            if (scope.pod_enabled(pod))
+                continue;
+            spdlog::info("Enabling {}", pod);
+            scope.enable_pod(pod, true);
+            enabled = true;
+        }
+        return enabled;
+    }
+} // namespace
+
+void scope_setup::learn(rigol::scope &scope, const std::vector<rigol::channel> &channels, bool logic)
+{
+    // The pods share the acquisition memory with the channels, so they are on before the depth is read
+    if (logic)
+        switch_on_pods(scope);
+    memory_depth = scope.memory_depth();
+    preambles.clear();
+    for (auto ch : channels)
+    {
+        scope.select_channel(ch);
+        preambles[ch] = scope.read_preamble();
+    }
+    logic_preamble.reset();
+    if (logic)
+    {
+        scope.select_pod(rigol::logic_pod::POD_1);
+        logic_preamble = scope.read_preamble();
+    }
+    spdlog::info("Learned scope setup: memory depth {}, {} channel(s){}", memory_depth, preambles.size(),
+                 logic ? " and D0-D15" : "");
+}
+
+std::vector<rigol::channel> parse_channels(std::string_view value)
+{
+    std::vector<rigol::channel> channels;
+    for (char ch : value)
+    {
+        switch (ch)
+        {
+        case '1':
+            channels.push_back(rigol::channel::CHANNEL_1);
+            break;
+        case '2':
+            channels.push_back(rigol::channel::CHANNEL_2);
+            break;
+        case '3':
+            channels.push_back(rigol::channel::CHANNEL_3);
+            break;
+        case '4':
+            channels.push_back(rigol::channel::CHANNEL_4);
+            break;
+        default:
+            throw std::invalid_argument(
+                fmt::format("'{}' is not a valid channel specifier, expected on of: 1,2,3,4", ch));
+        }
+    }
+    return channels;
+}
+
+trigger_mode parse_trigger(std::string_view value)
+{
+    if (value == "stop")
+        return trigger_mode::STOP;
+    if (value == "single")
+        return trigger_mode::SINGLE;
+
+    throw std::invalid_argument(fmt::format("'{}' is not a valid trigger mode, expected stop or single", value));
+}
+
+output_format parse_format(std::string_view value)
+{
+    if (value == "mat")
+        return output_format::MAT;
+    if (value == "mat73")
+        return output_format::MAT73;
+    if (value == "npy")
+        return output_format::NPY;
+    if (value == "raw")
+        return output_format::RAW;
+    if (value == "packed")
+        return output_format::PACKED;
+    if (value == "container")
+        return output_format::CONTAINER;
+
+    throw std::invalid_argument(
+        fmt::format("'{}' is not a valid output format, expected mat, mat73, npy, raw, packed or container", value));
+}
+
+matrix_layout parse_layout(std::string_view value)
+{
+    if (value == "separate")
+        return matrix_layout::SEPARATE;
+    if (value == "combined")
+        return matrix_layout::COMBINED;
+
+    throw std::invalid_argument(fmt::format("'{}' is not a valid layout, expected separate or combined", value));
+}
+
+namespace
+{
+    std::size_t parse_count(std::string_view key, std::string_view value)
+    {
+        std::size_t count = 0;
+        const auto result = std::from_chars(value.data(), value.data() + value.size(), count);
+        if (value.empty() || result.ec != std::errc() || result.ptr != value.data() + value.size())
+            throw std::invalid_argument(fmt::format("'{}' is not a valid {}, expected a whole number", value, key));
+        return count;
+    }
+
+    double parse_number(std::string_view key, std::string_view value)
+    {
+        const std::string text(value);
+        std::size_t end = 0;
+        double number = 0;
+        try
+        {
+            number = std::stod(text, &end);
+        }
+        catch (const std::logic_error &)
+        {
+        }
+        if (text.empty() || end != text.size() || !std::isfinite(number))
+            throw std::invalid_argument(fmt::format("'{}' is not a valid {}, expected a number", value, key));
+        return number;
+    }
+
+    // Settings of a mode that `key` only adjusts, the mode itself is switched on by `mode_key`
+    template <typename Settings>
+    Settings &enabled_settings(std::optional<Settings> &settings, std::string_view key, std::string_view mode_key)
+    {
+        if (!settings)
+            throw std::invalid_argument(fmt::format("{} needs {}= before it", key, mode_key));
+        return *settings;
+    }
+
+    event_settings &event_defaults(capture_request &request)
+    {
+        if (!request.events)
+            request.events.emplace();
+        return *request.events;
+    }
+
+    spectrum_settings &spectrum_defaults(capture_request &request)
+    {
+        // Same thread count as the MAT 7.3 compression, like on the command line
+        if (!request.spectrum)
+            request.spectrum.emplace().threads = request.mat73.threads;
+        return *request.spectrum;
+    }
+
+    change_settings &change_defaults(capture_request &request)
+    {
+        if (!request.changes)
+            request.changes.emplace();
+        return *request.changes;
+    }
+
+    decimation_settings &decimation_defaults(capture_request &request)
+    {
+        // Filter settings given before decimate= apply, like on the command line
+        if (!request.decimation)
+            request.decimation.emplace(request.decimation_filter);
+        return *request.decimation;
+    }
+
+    logic_settings &logic_defaults(capture_request &request)
+    {
+        if (!request.logic)
+            request.logic.emplace();
+        return *request.logic;
+    }
+} // namespace
+
+void set_request_parameter(capture_request &request, std::string_view key, std::string_view value)
+{
+    if (key == "channels")
+        request.channels = parse_channels(value);
+    else if (key == "trigger")
+        request.trigger = parse_trigger(value);
+    else if (key == "format")
+        request.format = parse_format(value);
+    else if (key == "layout")
+        request.layout = parse_layout(value);
+    else if (key == "io")
+        request.output.backend = parse_sink_backend(value);
+    else if (key == "direct")
+        request.output.direct = value != "0";
+    else if (key == "out")
+        request.outfile = std::string(value);
+    else if (key == "shuffle")
+        request.mat73.shuffle = value != "0";
+    else if (key == "zlib")
+    {
+        const std::size_t level = parse_count(key, value);
+        if (level > 9)
+            throw std::invalid_argument("compression level has to be between 0 and 9");
+        request.compression = (int)level;
+    }
+    else if (key == "frames")
+    {
+        request.frames = parse_count(key, value);
+        if (request.frames == 0)
+            throw std::invalid_argument("frames has to be at least 1");
+    }
+    else if (key == "preview")
+        request.preview_factors = parse_preview_factors(std::string(value));
+    else if (key == "stats")
+        request.statistics = value != "0";
+    else if (key == "events")
+        event_defaults(request).edge = parse_edge(std::string(value));
+    else if (key == "threshold")
+        enabled_settings(request.events, key, "events").threshold = parse_number(key, value);
+    else if (key == "hysteresis")
+        enabled_settings(request.events, key, "events").hysteresis = parse_number(key, value);
+    else if (key == "window")
+        parse_event_window(std::string(value), enabled_settings(request.events, key, "events"));
+    else if (key == "spectrum")
+        spectrum_defaults(request).segment = parse_count(key, value);
+    else if (key == "spectrum_window")
+        enabled_settings(request.spectrum, key, "spectrum").window = parse_spectrum_window(std::string(value));
+    else if (key == "overlap")
+        enabled_settings(request.spectrum, key, "spectrum").overlap = parse_number(key, value);
+    else if (key == "threads")
+    {
+        request.mat73.threads = (unsigned)parse_count(key, value);
+        if (request.spectrum)
+            request.spectrum->threads = request.mat73.threads;
+    }
+    else if (key == "unchanged")
+        change_defaults(request).tolerance = parse_count(key, value);
+    else if (key == "delta")
+        change_defaults(request).keyframe_interval = parse_count(key, value);
+    else if (key == "decimate")
+    {
+        // 0 or 1 turns decimation off again
+        const std::size_t factor = parse_count(key, value);
+        if (factor > 1)
+            decimation_defaults(request).factor = factor;
+        else
+            request.decimation.reset();
+    }
+    else if (key == "decimate_taps")
+    {
+        request.decimation_filter.taps = parse_count(key, value);
+        if (request.decimation)
+            request.decimation->taps = request.decimation_filter.taps;
+    }
+    else if (key == "cutoff")
+    {
+        request.decimation_filter.cutoff = parse_number(key, value);
+        if (request.decimation)
+            request.decimation->cutoff = request.decimation_filter.cutoff;
+    }
+    else if (key == "logic")
+    {
+        if (value != "0")
+            logic_defaults(request);
+        else
+            request.logic.reset();
+    }
+    else if (key == "logic_lines")
+        enabled_settings(request.logic, key, "logic").lines = value != "0";
+    else if (key == "logic_edges")
+        enabled_settings(request.logic, key, "logic").edges = value != "0";
+    else if (key == "memory_budget")
+        request.memory_budget = parse_memory_size(value);
+    else
+        throw std::invalid_argument(fmt::format("Unknown request parameter '{}'", key));
+}
+
+bool is_mode_parameter(std::string_view key)
+{
+    return key == "events" || key == "spectrum" || key == "decimate" || key == "logic";
+}
+
+void read_channel_data(rigol::scope &scope, rigol::channel ch, channel_data &data, const scope_setup *setup,
+                       decimation_worker *decimation)
+{
+    const bool first_frame = data.frames == 0;
+    const bool known = setup && setup->preambles.count(ch);
+    const std::size_t memory_depth = known ? setup->memory_depth : scope.memory_depth();
+    if (!first_frame && memory_depth != data.points)
+        throw std::logic_error(fmt::format("Frame {} of {} has {} points, expected {}", data.frames + 1, ch,
+                                           memory_depth, data.points));
+
+    // The buffers may move when they grow, the previous frame has to be filtered by then
+    if (decimation)
+        decimation->wait();
+
+    // Later frames go straight behind the earlier ones
+    data.raw.resize((data.frames + 1) * memory_depth);
+    uint8_t *frame = data.raw.data() + data.frames * memory_depth;
+    scope.select_channel(ch);
+    if (decimation)
+    {
+        // Needed up front by the stream
+        if (first_frame)
+            data.preamble = known ? setup->preambles.at(ch) : scope.read_preamble();
+
+        const std::size_t outputs = decimated_points(memory_depth, decimation->factor());
+        data.decimation = decimation->factor();
+        data.decimated.resize((data.frames + 1) * outputs);
+        decimation->start(frame, memory_depth, data.decimated.data() + data.frames * outputs);
+        scope.stream_buffer(
+            memory_depth,
+            [&](const rigol::waveform_chunk &chunk) {
+                std::memcpy(frame + chunk.offset, chunk.data, chunk.size);
+                decimation->arrived(chunk.offset + chunk.size);
+            },
+            &data.preamble);
+    }
+    else
+    {
+        scope.read_buffer(frame, memory_depth);
+        if (first_frame)
+            data.preamble = known ? setup->preambles.at(ch) : scope.read_preamble();
+    }
+
+    if (first_frame)
+    {
+        data.channel = ch;
+        data.points = memory_depth;
+    }
+
+    data.frames++;
+    spdlog::info("Read {} items", memory_depth);
+}
+
+void read_logic_data(rigol::scope &scope, logic_data &data, const scope_setup *setup)
+{
+    const bool first_frame = data.frames == 0;
+    const std::size_t memory_depth = setup ? setup->memory_depth : scope.memory_depth();
+    if (!first_frame && memory_depth != data.points)
+        throw std::logic_error(fmt::format("Frame {} of the digital lines has {} points, expected {}",
+                                           data.frames + 1, memory_depth, data.points));
+
+    data.packed.resize((data.frames + 1) * memory_depth);
+    uint16_t *frame = data.packed.data() + data.frames * memory_depth;
+    data.pod.resize(memory_depth);
+
+    scope.select_pod(rigol::logic_pod::POD_1);
+    scope.read_buffer(data.pod.data(), memory_depth);
+    if (first_frame)
+        data.preamble = setup && setup->logic_preamble ? *setup->logic_preamble : scope.read_preamble();
+
+    scope.select_pod(rigol::logic_pod::POD_2);
+    scope.stream_buffer(
+        memory_depth,
+        [&](const rigol::waveform_chunk &chunk) {
+            interleave_pods(data.pod.data() + chunk.offset, chunk.data, chunk.size, frame + chunk.offset);
+        },
+        &data.preamble);
+
+    data.points = memory_depth;
+    data.frames++;
+    spdlog::info("Read {} samples of D0-D15", memory_depth);
+}
+
+capture_arena::capture_arena(bool huge_pages) : m_huge_pages(huge_pages)
+{
+    scaled.set_huge_pages(huge_pages);
+    combined.set_huge_pages(huge_pages);
+    line.set_huge_pages(huge_pages);
+    m_logic.packed.set_huge_pages(huge_pages);
+    m_logic.pod.set_huge_pages(huge_pages);
+}
+
+channel_data &capture_arena::channel(std::size_t i)
+{
+    while (m_channels.size() <= i)
+    {
+        m_channels.emplace_back();
+        m_channels.back().raw.set_huge_pages(m_huge_pages);
+        m_channels.back().decimated.set_huge_pages(m_huge_pages);
+    }
+
+    channel_data &data = m_channels[i];
+    data.points = 0;
+    data.frames = 0;
+    data.raw.clear();
+    data.decimation = 1;
+    data.decimated.clear();
+    return data;
+}
+
+logic_data &capture_arena::logic()
+{
+    m_logic.points = 0;
+    m_logic.frames = 0;
+    m_logic.packed.clear();
+    return m_logic;
+}
+
+mat::compressed_section &capture_arena::compressor(int level)
+{
+    if (m_compressor)
+        m_compressor->reset(level);
+    else
+        m_compressor = std::make_unique<mat::compressed_section>(level);
+    return *m_compressor;
+}
+
+void capture_arena::reserve(std::size_t memory_depth, std::size_t channels)
+{
+    for (std::size_t i = 0; i < channels; i++)
+        channel(i).raw.reserve(memory_depth);
+}
+
+void capture_arena::reserve(std::size_t memory_depth, const capture_request &request)
+{
+    capture_strategy strategy = default_strategy(request);
+    if (request.memory_budget)
+    {
+        memory_estimate estimate;
+        strategy = plan_memory(request, memory_depth, strategy, false, estimate);
+    }
+
+    std::size_t samples = memory_depth * request.frames;
+    reserve(samples, strategy.buffered ? request.channels.size() : 1);
+    if (request.logic)
+    {
+        m_logic.packed.reserve(samples);
+        m_logic.pod.reserve(memory_depth);
+        if (request.logic->lines)
+            line.reserve(samples);
+    }
+
+    const bool matrix = request.format == output_format::MAT || request.format == output_format::MAT73;
+    if (!matrix || request.events || request.spectrum)
+        return;
+    if (request.decimation)
+    {
+        samples = decimated_points(memory_depth, request.decimation->factor) * request.frames;
+        for (std::size_t i = 0; i < request.channels.size(); i++)
+            channel(i).decimated.reserve(samples);
+    }
+    if (strategy.chunked)
+        return;
+    if (request.layout == matrix_layout::COMBINED)
+        combined.reserve(samples * (request.channels.size() + 1));
+    else
+        scaled.reserve(samples * 2);
+}
+
+namespace
+{
+    // Samples per frame of the saved waveform
+    std::size_t waveform_points(const channel_data &data) { return decimated_points(data.points, data.decimation); }
+
+    template <typename T>
+    void scale_samples(const T *codes, std::size_t count, std::size_t points, const rigol::preamble &pre,
+                       page_buffer<double> &scaled)
+    {
+        scaled.resize(count * 2);
+        for (size_t i = 0; i < count; i++)
+        {
+            scaled[2 * i] = pre.x_origin + (i % points - pre.x_reference) * pre.x_increment;
+            scaled[2 * i + 1] = (codes[i] - pre.y_reference - pre.y_origin) * pre.y_increment;
+        }
+    }
+
+    template <typename T> void scale_column(const T *codes, std::size_t count, const rigol::preamble &pre, double *out)
+    {
+        for (std::size_t i = 0; i < count; i++)
+            out[i] = (codes[i] - pre.y_reference - pre.y_origin) * pre.y_increment;
+    }
+
+    rigol::preamble waveform_preamble(const channel_data &data)
+    {
+        return data.decimation > 1 ? decimated_preamble(data.preamble, data.decimation) : data.preamble;
+    }
+
+    // Elements [first, first + count) of the 2 x points (x frames) time and value matrix
+    template <typename T>
+    void scale_range(const T *codes, std::size_t points, const rigol::preamble &pre, std::size_t first,
+                     std::size_t count, double *out)
+    {
+        for (std::size_t e = first; e < first + count; e++)
+        {
+            const std::size_t i = e / 2;
+            *out++ = e % 2 ? (codes[i] - pre.y_reference - pre.y_origin) * pre.y_increment
+                           : pre.x_origin + (i % points - pre.x_reference) * pre.x_increment;
+        }
+    }
+
+    // Scales the waveform of `data` piece by piece as a chunked output asks for it
+    std::function<void(std::size_t, std::size_t, double *)> waveform_generator(const channel_data &data)
+    {
+        return [&data, pre = waveform_preamble(data), points = waveform_points(data)](
+                   std::size_t first, std::size_t count, double *out) {
+            if (data.decimation > 1)
+                scale_range(data.decimated.data(), points, pre, first, count, out);
+            else
+                scale_range(data.raw.data(), points, pre, first, count, out);
+        };
+    }
+} // namespace
+
+void scale_channel_data(const channel_data &data, page_buffer<double> &scaled)
+{
+    rigol::trace::span span{"scaling", "convert"};
+    if (data.decimation > 1)
+        scale_samples(data.decimated.data(), data.decimated.size(), waveform_points(data), waveform_preamble(data),
+                      scaled);
+    else
+        scale_samples(data.raw.data(), data.raw.size(), data.points, data.preamble, scaled);
+}
+
+void write_variable(std::ostream &file, const mat::data_element &element, int compression, capture_arena *arena)
+{
+    if (compression != 0)
+    {
+        std::unique_ptr<mat::compressed_section> own;
+        if (!arena)
+            own = std::make_unique<mat::compressed_section>(compression);
+        mat::compressed_section &cmp = arena ? arena->compressor(compression) : *own;
+        {
+            rigol::trace::span span{"compression", "output"};
+            cmp << element;
+            cmp.finish();
+        }
+        rigol::trace::span span{"file write", "output"};
+        file << cmp;
+    }
+    else
+    {
+        rigol::trace::span span{"file write", "output"};
+        file << element;
+    }
+}
+
+namespace
+{
+    // Previews are 3 x blocks (x frames) arrays of block start time, minimum and maximum
+    void write_previews(std::ostream &file, const channel_data &data, const capture_request &request,
+                        capture_arena &arena)
+    {
+        const rigol::preamble &pre = data.preamble;
+        std::vector<std::vector<double>> previews(request.preview_factors.size());
+
+        for (std::size_t frame = 0; frame < data.frames; frame++)
+        {
+            rigol::trace::span span{"preview", "convert"};
+            const auto levels =
+                build_preview(data.raw.data() + frame * data.points, data.points, request.preview_factors);
+
+            for (std::size_t l = 0; l < levels.size(); l++)
+            {
+                const preview_level &level = levels[l];
+                for (std::size_t i = 0; i < level.min.size(); i++)
+                {
+                    const double x = double(i * level.factor) - pre.x_reference;
+                    previews[l].push_back(pre.x_origin + x * pre.x_increment);
+                    previews[l].push_back((level.min[i] - pre.y_reference - pre.y_origin) * pre.y_increment);
+                    previews[l].push_back((level.max[i] - pre.y_reference - pre.y_origin) * pre.y_increment);
+                }
+            }
+        }
+
+        for (std::size_t l = 0; l < previews.size(); l++)
+        {
+            const std::size_t factor = request.preview_factors[l];
+            const int32_t blocks = (int32_t)((data.points + factor - 1) / factor);
+            std::vector<int32_t> dimensions{3, blocks};
+            if (data.frames > 1)
+                dimensions.push_back((int32_t)data.frames);
+
+            write_variable(file,
+                           mat::numeric_array<double>{fmt::format("{}_preview_{}", data.channel, factor),
+                                                      previews[l].data(), dimensions},
+                           request.compression, &arena);
+        }
+    }
+
+    void write_statistics(std::ostream &file, const channel_data &data, const capture_request &request,
+                          capture_arena &arena)
+    {
+        waveform_statistics stats;
+        {
+            rigol::trace::span span{"statistics", "convert"};
+            stats.add(data.raw.data(), data.raw.size());
+            stats.finish(data.preamble);
+        }
+
+        mat::structure element{fmt::format("{}_stats", data.channel)};
+        element.field("count", (double)stats.count)
+            .field("min", stats.min)
+            .field("max", stats.max)
+            .field("mean", stats.mean)
+            .field("rms", stats.rms)
+            .field("std", stats.std_dev)
+            .field("peak_to_peak", stats.peak_to_peak)
+            .field("min_code", stats.min_code)
+            .field("max_code", stats.max_code)
+            .field("histogram", std::vector<double>(stats.histogram.begin(), stats.histogram.end()));
+
+        write_variable(file, element, request.compression, &arena);
+    }
+
+    // 2 x bins matrix of frequency and power spectral density
+    void write_spectrum(std::ostream &file, const channel_data &data, const capture_request &request,
+                        capture_arena &arena)
+    {
+        const power_spectrum spectrum =
+            welch_spectrum(data.raw.data(), data.points, data.frames, data.preamble, *request.spectrum);
+
+        std::vector<double> values;
+        values.reserve(2 * spectrum.frequency.size());
+        for (std::size_t k = 0; k < spectrum.frequency.size(); k++)
+        {
+            values.push_back(spectrum.frequency[k]);
+            values.push_back(spectrum.density[k]);
+        }
+
+        spdlog::info("Saving spectrum of {} averaged over {} segment(s)", data.channel, spectrum.segments);
+        write_variable(file,
+                       mat::numeric_array<double>{fmt::format("{}_spectrum", data.channel), values.data(),
+                                                  {2, (int32_t)spectrum.frequency.size()}},
+                       request.compression, &arena);
+    }
+
+    void write_events(std::ostream &file, const channel_data &data, const capture_request &request,
+                      capture_arena &arena)
+    {
+        const rigol::preamble &pre = data.preamble;
+        const event_settings &settings = *request.events;
+        const std::size_t window = settings.pre + settings.post;
+
+        std::vector<double> windows;
+        std::vector<double> times;
+        std::vector<double> frames;
+        for (std::size_t frame = 0; frame < data.frames; frame++)
+        {
+            rigol::trace::span span{"events", "convert"};
+            const uint8_t *raw = data.raw.data() + frame * data.points;
+            for (std::size_t event : find_events(raw, data.points, pre, settings))
+            {
+                for (std::size_t i = 0; i < window; i++)
+                {
+                    const std::size_t sample = event + i - settings.pre;
+                    // Wraps around for samples before the start of the frame
+                    windows.push_back(sample < data.points
+                                          ? (raw[sample] - pre.y_reference - pre.y_origin) * pre.y_increment
+                                          : std::numeric_limits<double>::quiet_NaN());
+                }
+                times.push_back(pre.x_origin + (double(event) - pre.x_reference) * pre.x_increment);
+                frames.push_back(double(frame + 1));
+            }
+        }
+
+        spdlog::info("Saving {} event(s) for {}", times.size(), data.channel);
+        write_variable(file,
+                       mat::numeric_array<double>{fmt::format("{}_events", data.channel), windows.data(),
+                                                  {(int32_t)window, (int32_t)times.size()}},
+                       request.compression, &arena);
+        write_variable(file,
+                       mat::numeric_array<double>{fmt::format("{}_event_times", data.channel), times.data(),
+                                                  {1, (int32_t)times.size()}},
+                       request.compression, &arena);
+        if (data.frames > 1)
+        {
+            write_variable(file,
+                           mat::numeric_array<double>{fmt::format("{}_event_frames", data.channel), frames.data(),
+                                                      {1, (int32_t)frames.size()}},
+                           request.compression, &arena);
+        }
+    }
+} // namespace
+
+void write_waveform(std::ostream &file, const channel_data &data, const capture_request &request,
+                    capture_arena &arena, bool chunked)
+{
+    std::vector<int32_t> dimensions{2, (int32_t)waveform_points(data)};
+    if (data.frames > 1)
+        dimensions.push_back((int32_t)data.frames);
+
+    if (chunked)
+    {
+        spdlog::info("Saving data for {} in chunks", data.channel);
+        write_variable(file,
+                       mat::numeric_array<double>{fmt::format("{}", data.channel), waveform_generator(data),
+                                                  dimensions},
+                       request.compression, &arena);
+        return;
+    }
+
+    scale_channel_data(data, arena.scaled);
+    spdlog::info("Saving data for {}", data.channel);
+    write_variable(file,
+                   mat::numeric_array<double>{fmt::format("{}", data.channel), arena.scaled.data(), dimensions},
+                   request.compression, &arena);
+}
+
+void write_waveform(mat73::writer &file, const channel_data &data, capture_arena &arena, bool chunked)
+{
+    std::vector<std::size_t> dimensions{2, waveform_points(data)};
+    if (data.frames > 1)
+        dimensions.push_back(data.frames);
+
+    if (chunked)
+    {
+        spdlog::info("Saving data for {} in chunks", data.channel);
+        rigol::trace::span span{"file write", "output"};
+        file.write(fmt::format("{}", data.channel), dimensions, waveform_generator(data));
+        return;
+    }
+
+    scale_channel_data(data, arena.scaled);
+    spdlog::info("Saving data for {}", data.channel);
+    rigol::trace::span span{"file write", "output"};
+    file.write(fmt::format("{}", data.channel), arena.scaled.data(), dimensions);
+}
+
+void combined_matrix::add(const channel_data &data)
+{
+    rigol::trace::span span{"scaling", "convert"};
+    const rigol::preamble pre = waveform_preamble(data);
+    const std::size_t points = waveform_points(data);
+
+    if (m_channels.empty())
+    {
+        m_points = points;
+        m_frames = data.frames;
+        m_time = pre;
+    }
+    else if (points != m_points || data.frames != m_frames)
+    {
+        throw std::runtime_error(fmt::format("{} has {}x{} samples, expected {}x{}", data.channel, points,
+                                             data.frames, m_points, m_frames));
+    }
+
+    if (m_channels.size() + 1 == m_columns)
+        throw std::logic_error("Too many channels for combined matrix");
+    m_channels.push_back(double((int)data.channel + 1));
+
+    if (m_chunked)
+    {
+        m_sources.push_back(&data);
+        return;
+    }
+
+    if (m_channels.size() == 1)
+    {
+        m_data.resize(m_points * m_columns * m_frames);
+        for (std::size_t frame = 0; frame < m_frames; frame++)
+        {
+            double *time = m_data.data() + frame * m_points * m_columns;
+            for (std::size_t i = 0; i < m_points; i++)
+                time[i] = pre.x_origin + (i - pre.x_reference) * pre.x_increment;
+        }
+    }
+
+    const std::size_t column = m_channels.size();
+    for (std::size_t frame = 0; frame < m_frames; frame++)
+    {
+        double *out = m_data.data() + (frame * m_columns + column) * m_points;
+        if (data.decimation > 1)
+            scale_column(data.decimated.data() + frame * m_points, m_points, pre, out);
+        else
+            scale_column(data.raw.data() + frame * m_points, m_points, pre, out);
+    }
+}
+
+void combined_matrix::fill(std::size_t first, std::size_t count, double *out) const
+{
+    // One run per column piece, the matrix is column-major
+    while (count)
+    {
+        const std::size_t frame = first / (m_points * m_columns);
+        const std::size_t column = first / m_points % m_columns;
+        const std::size_t row = first % m_points;
+        const std::size_t run = std::min(count, m_points - row);
+
+        if (column == 0)
+        {
+            for (std::size_t i = row; i < row + run; i++)
+                *out++ = m_time.x_origin + (i - m_time.x_reference) * m_time.x_increment;
+        }
+        else
+        {
+            const channel_data &data = *m_sources[column - 1];
+            const std::size_t start = frame * m_points + row;
+            if (data.decimation > 1)
+                scale_column(data.decimated.data() + start, run, waveform_preamble(data), out);
+            else
+                scale_column(data.raw.data() + start, run, data.preamble, out);
+            out += run;
+        }
+
+        first += run;
+        count -= run;
+    }
+}
+
+void combined_matrix::write(std::ostream &file, int compression, capture_arena *arena) const
+{
+    std::vector<int32_t> dimensions{(int32_t)m_points, (int32_t)m_columns};
+    if (m_frames > 1)
+        dimensions.push_back((int32_t)m_frames);
+
+    spdlog::info("Saving combined data of {} channel(s)", m_channels.size());
+    if (m_chunked)
+        write_variable(file,
+                       mat::numeric_array<double>{"CHANNELS",
+                                                  [this](std::size_t first, std::size_t count, double *out) {
+                                                      fill(first, count, out);
+                                                  },
+                                                  dimensions},
+                       compression, arena);
+    else
+        write_variable(file, mat::numeric_array<double>{"CHANNELS", m_data.data(), dimensions}, compression, arena);
+    write_variable(file,
+                   mat::numeric_array<double>{"CHANNELS_index", m_channels.data(), {1, (int32_t)m_channels.size()}},
+                   compression, arena);
+}
+
+void combined_matrix::write(mat73::writer &file) const
+{
+    std::vector<std::size_t> dimensions{m_points, m_columns};
+    if (m_frames > 1)
+        dimensions.push_back(m_frames);
+
+    spdlog::info("Saving combined data of {} channel(s)", m_channels.size());
+    rigol::trace::span span{"file write", "output"};
+    if (m_chunked)
+        file.write("CHANNELS", dimensions,
+                   [this](std::size_t first, std::size_t count, double *out) { fill(first, count, out); });
+    else
+        file.write("CHANNELS", m_data.data(), dimensions);
+    file.write("CHANNELS_index", m_channels.data(), {1, m_channels.size()});
+}
+
+namespace
+{
+    std::vector<int32_t> logic_dimensions(const logic_data &data)
+    {
+        std::vector<int32_t> dimensions{1, (int32_t)data.points};
+        if (data.frames > 1)
+            dimensions.push_back((int32_t)data.frames);
+        return dimensions;
+    }
+
+    // Per line a column per transition: its time, the line's new level and with several frames the frame
+    std::array<std::vector<double>, LOGIC_LINES> logic_edges(const logic_data &data, std::size_t &rows)
+    {
+        rigol::trace::span span{"logic edges", "convert"};
+        const rigol::preamble &pre = data.preamble;
+        rows = data.frames > 1 ? 3 : 2;
+
+        std::array<std::vector<double>, LOGIC_LINES> edges;
+        logic_transitions transitions;
+        for (std::size_t frame = 0; frame < data.frames; frame++)
+        {
+            const uint16_t *packed = data.packed.data() + frame * data.points;
+            for (auto &line : transitions)
+                line.clear();
+            find_transitions(packed, data.points, transitions);
+
+            for (std::size_t line = 0; line < LOGIC_LINES; line++)
+            {
+                for (std::size_t i : transitions[line])
+                {
+                    edges[line].push_back(pre.x_origin + (double(i) - pre.x_reference) * pre.x_increment);
+                    edges[line].push_back(double((packed[i] >> line) & 1));
+                    if (rows == 3)
+                        edges[line].push_back(double(frame + 1));
+                }
+            }
+        }
+        return edges;
+    }
+
+    std::array<double, 2> logic_time(const logic_data &data)
+    {
+        const rigol::preamble &pre = data.preamble;
+        return {pre.x_origin - pre.x_reference * pre.x_increment, pre.x_increment};
+    }
+} // namespace
+
+void write_logic(std::ostream &file, const logic_data &data, const capture_request &request, capture_arena &arena)
+{
+    const std::vector<int32_t> dimensions = logic_dimensions(data);
+    const std::size_t samples = data.points * data.frames;
+
+    spdlog::info("Saving D0-D15");
+    write_variable(file, mat::numeric_array<uint16_t>{"LOGIC", data.packed.data(), dimensions}, request.compression,
+                   &arena);
+    const std::array<double, 2> time = logic_time(data);
+    write_variable(file, mat::numeric_array<double>{"LOGIC_time", time.data(), {1, 2}}, request.compression, &arena);
+
+    if (request.logic->lines)
+    {
+        arena.line.resize(samples);
+        for (unsigned line = 0; line < LOGIC_LINES; line++)
+        {
+            {
+                rigol::trace::span span{"logic unpack", "convert"};
+                unpack_line(data.packed.data(), samples, line, arena.line.data());
+            }
+            write_variable(file,
+                           mat::numeric_array<uint8_t>{fmt::format("D{}", line), arena.line.data(), dimensions}
+                               .logical(),
+                           request.compression, &arena);
+        }
+    }
+
+    if (request.logic->edges)
+    {
+        std::size_t rows = 0;
+        const auto edges = logic_edges(data, rows);
+        for (std::size_t line = 0; line < LOGIC_LINES; line++)
+            write_variable(file,
+                           mat::numeric_array<double>{fmt::format("D{}_edges", line), edges[line].data(),
+                                                      {(int32_t)rows, (int32_t)(edges[line].size() / rows)}},
+                           request.compression, &arena);
+    }
+}
+
+void write_logic(mat73::writer &file, const logic_data &data, const capture_request &request, capture_arena &arena)
+{
+    const std::vector<int32_t> matlab_dimensions = logic_dimensions(data);
+    const std::vector<std::size_t> dimensions{matlab_dimensions.begin(), matlab_dimensions.end()};
+    const std::size_t samples = data.points * data.frames;
+
+    spdlog::info("Saving D0-D15");
+    rigol::trace::span span{"file write", "output"};
+    file.write("LOGIC", data.packed.data(), dimensions);
+    const std::array<double, 2> time = logic_time(data);
+    file.write("LOGIC_time", time.data(), {1, 2});
+
+    if (request.logic->lines)
+    {
+        arena.line.resize(samples);
+        for (unsigned line = 0; line < LOGIC_LINES; line++)
+        {
+            unpack_line(data.packed.data(), samples, line, arena.line.data());
+            file.write_logical(fmt::format("D{}", line), arena.line.data(), dimensions);
+        }
+    }
+
+    if (request.logic->edges)
+    {
+        std::size_t rows = 0;
+        const auto edges = logic_edges(data, rows);
+        for (std::size_t line = 0; line < LOGIC_LINES; line++)
+            file.write(fmt::format("D{}_edges", line), edges[line].data(), {rows, edges[line].size() / rows});
+    }
+}
+
+void write_channel(std::ostream &file, const channel_data &data, const capture_request &request,
+                   capture_arena &arena, bool chunked)
+{
+    if (request.spectrum)
+        write_spectrum(file, data, request, arena);
+    else if (request.events)
+        write_events(file, data, request, arena);
+    else if (request.layout == matrix_layout::SEPARATE)
+        write_waveform(file, data, request, arena, chunked);
+
+    if (!request.preview_factors.empty())
+        write_previews(file, data, request, arena);
+
+    if (request.statistics)
+        write_statistics(file, data, request, arena);
+}
+
+double wait_for_trigger(rigol::scope &scope, trigger_mode trigger)
+{
+    switch (trigger)
+    {
+    case trigger_mode::STOP:
+        spdlog::info("Stopping the scope");
+        scope.stop();
+        break;
+
+    case trigger_mode::SINGLE:
+    {
+        spdlog::info("Arming the scope");
+        scope.single();
+
+        // The scope keeps reporting STOP for a while after :SING, wait until it is armed (or
+        // 400 ms have passed in case it already triggered in between two polls)
+        rigol::trace::span span{"arming", "capture"};
+        rigol::trace::pause polls;
+        const auto armed_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(400);
+        while (scope.get_trigger_state() == rigol::trigger_state::STOP &&
+               std::chrono::steady_clock::now() < armed_deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        spdlog::info("Waiting for trigger");
+
+        break;
+    }
+    }
+
+    rigol::trace::span span{"trigger wait", "capture"};
+    rigol::trace::pause polls;
+    // The scope stopped after the last poll that still saw it running was sent
+    auto running_poll = std::chrono::steady_clock::now();
+    while (true)
+    {
+        const auto poll = std::chrono::steady_clock::now();
+        if (scope.get_trigger_state() == rigol::trigger_state::STOP)
+            return elapsed_ms(running_poll);
+        running_poll = poll;
+    }
+}
+
+double record_frames(rigol::scope &scope, std::size_t frames)
+{
+    const std::size_t max_frames = scope.max_recorded_frames();
+    if (frames > max_frames)
+        throw std::invalid_argument(fmt::format("Cannot record {} frames, the scope holds at most {} at this memory depth",
+                                                frames, max_frames));
+
+    spdlog::info("Recording {} frames", frames);
+    rigol::trace::span span{"recording", "capture"};
+    scope.start_recording(frames);
+
+    double detect_ms = 0;
+    {
+        rigol::trace::pause polls;
+        // Same as with :SING the scope needs a moment before it reports that it is recording
+        const auto started_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(400);
+        while (!scope.is_recording() && std::chrono::steady_clock::now() < started_deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        auto recording_poll = std::chrono::steady_clock::now();
+        while (true)
+        {
+            const auto poll = std::chrono::steady_clock::now();
+            if (!scope.is_recording())
+                break;
+            recording_poll = poll;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        detect_ms = elapsed_ms(recording_poll);
+    }
+
+    scope.stop_recording();
+    return detect_ms;
+}
+
+namespace
+{
+    void check_request(const capture_request &request)
+    {
+        if (request.format != output_format::MAT &&
+            (request.events || request.spectrum || request.statistics || !request.preview_factors.empty()))
+            throw std::invalid_argument(
+                "Events, spectra, previews and waveform statistics are only saved in MAT v5 files");
+        if (request.layout == matrix_layout::COMBINED &&
+            ((request.format != output_format::MAT && request.format != output_format::MAT73) || request.events ||
+             request.spectrum))
+            throw std::invalid_argument("The combined layout needs MAT output without events or spectra");
+        if (request.spectrum && request.events)
+            throw std::invalid_argument("Spectra and events cannot be saved together");
+        if (request.spectrum)
+            check_spectrum_settings(*request.spectrum);
+        if (request.changes && (request.frames > 1 || request.layout == matrix_layout::COMBINED))
+            throw std::invalid_argument(
+                "Unchanged channels can only be skipped for single frames in the separate layout");
+        if (request.changes && request.changes->keyframe_interval && request.format != output_format::CONTAINER)
+            throw std::invalid_argument("Deltas are only stored in containers");
+        if (request.decimation)
+        {
+            check_decimation_settings(*request.decimation);
+            if ((request.format != output_format::MAT && request.format != output_format::MAT73) || request.events ||
+                request.spectrum)
+                throw std::invalid_argument("Decimated waveforms are only saved in MAT and MAT 7.3 files");
+        }
+        if (request.logic)
+        {
+            if (request.format != output_format::MAT && request.format != output_format::MAT73)
+                throw std::invalid_argument("Digital lines are only saved in MAT and MAT 7.3 files");
+            if (request.changes)
+                throw std::invalid_argument("Digital lines cannot be captured while skipping unchanged channels");
+        }
+    }
+
+    // Strategy of a capture, the fastest one unless it has a memory budget
+    capture_strategy plan_capture(rigol::scope &scope, const capture_request &request, const scope_setup *setup,
+                                  capture_strategy fastest, capture_timings &timings)
+    {
+        if (!request.memory_budget)
+            return fastest;
+
+        memory_estimate estimate;
+        const capture_strategy strategy =
+            plan_memory(request, setup ? setup->memory_depth : scope.memory_depth(), fastest, false, estimate);
+        timings.estimated_bytes = estimate.total();
+        spdlog::info("Capture planned with {} for {:.1f} MiB of the {:.1f} MiB memory budget", describe(strategy),
+                     estimate.total() / 1048576.0, request.memory_budget / 1048576.0);
+        return strategy;
+    }
+
+    // Raises `peak` to the peak resident set size over its lifetime, only with a memory budget
+    class stage_memory
+    {
+        std::size_t *m_peak = nullptr;
+
+      public:
+        stage_memory(const capture_request &request, std::size_t &peak)
+        {
+            if (request.memory_budget)
+            {
+                m_peak = &peak;
+                memory_usage::reset_peak();
+            }
+        }
+        stage_memory(const stage_memory &) = delete;
+        stage_memory &operator=(const stage_memory &) = delete;
+        ~stage_memory()
+        {
+            if (m_peak)
+                *m_peak = std::max(*m_peak, memory_usage::peak());
+        }
+    };
+
+    // The output file of one capture, opened by the first channel written
+    class capture_output
+    {
+        const capture_request &m_request;
+        const capture_strategy &m_strategy;
+        capture_arena &m_arena;
+        std::chrono::system_clock::time_point m_triggered;
+
+        std::unique_ptr<file_sink> m_file;
+        std::unique_ptr<combined_matrix> m_combined;
+        std::unique_ptr<binary_output> m_binary;
+        std::unique_ptr<container::writer> m_archive;
+        std::unique_ptr<mat73::writer> m_hdf5;
+        bool m_open = false;
+
+        // Channels that became a keyframe (with their capture index) or were stored against one
+        std::vector<std::pair<const channel_data *, std::optional<std::size_t>>> m_stored;
+
+        void open()
+        {
+            m_open = true;
+            if (m_request.format == output_format::MAT)
+            {
+                m_file = std::make_unique<file_sink>(m_request.outfile, m_request.output);
+                *m_file << mat::header{};
+                if (m_request.layout == matrix_layout::COMBINED)
+                    m_combined = std::make_unique<combined_matrix>(m_request.channels.size(), m_arena.combined,
+                                                                   m_strategy.chunked);
+            }
+            else if (m_request.format == output_format::MAT73)
+            {
+                mat73::settings settings = m_request.mat73;
+                settings.compression = m_request.compression;
+                if (m_strategy.compressors)
+                    settings.threads = m_strategy.compressors;
+                m_hdf5 = std::make_unique<mat73::writer>(m_request.outfile, settings);
+                if (m_request.layout == matrix_layout::COMBINED)
+                    m_combined = std::make_unique<combined_matrix>(m_request.channels.size(), m_arena.combined,
+                                                                   m_strategy.chunked);
+            }
+            else if (m_request.format == output_format::CONTAINER)
+            {
+                m_archive = std::make_unique<container::writer>(m_request.outfile, m_request.compression);
+                m_archive->begin(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(m_triggered.time_since_epoch()).count());
+            }
+            else
+            {
+                m_binary = std::make_unique<binary_output>(m_request.outfile, m_request.format, m_request.output);
+            }
+        }
+
+      public:
+        capture_output(const capture_request &request, const capture_strategy &strategy, capture_arena &arena,
+                       std::chrono::system_clock::time_point triggered)
+            : m_request(request), m_strategy(strategy), m_arena(arena), m_triggered(triggered)
+        {
+        }
+
+        void write(const channel_data &data)
+        {
+            if (!m_open)
+                open();
+
+            const std::size_t keyframe_interval = m_request.changes ? m_request.changes->keyframe_interval : 0;
+            std::optional<std::size_t> new_keyframe;
+            if (m_binary)
+            {
+                m_binary->write(data);
+            }
+            else if (m_archive)
+            {
+                std::size_t index = 0;
+                const uint8_t *keyframe = m_arena.changes.keyframe(data, m_request.outfile, keyframe_interval, index);
+                if (keyframe)
+                {
+                    m_arena.changes.delta.resize(data.raw.size());
+                    xor_frames(data.raw.data(), keyframe, m_arena.changes.delta.data(), data.raw.size());
+                    m_archive->write_delta(data, m_arena.changes.delta.data(), index);
+                }
+                else
+                {
+                    // The capture being written gets the next index
+                    if (keyframe_interval)
+                        new_keyframe = m_archive->size();
+                    m_archive->write(data);
+                }
+            }
+            else if (m_hdf5)
+            {
+                if (m_request.layout == matrix_layout::SEPARATE)
+                    write_waveform(*m_hdf5, data, m_arena, m_strategy.chunked);
+            }
+            else
+            {
+                write_channel(*m_file, data, m_request, m_arena, m_strategy.chunked);
+            }
+
+            if (m_combined)
+                m_combined->add(data);
+            m_stored.emplace_back(&data, new_keyframe);
+        }
+
+        void write(const logic_data &data)
+        {
+            if (!m_open)
+                open();
+
+            if (m_hdf5)
+                write_logic(*m_hdf5, data, m_request, m_arena);
+            else
+                write_logic(*m_file, data, m_request, m_arena);
+        }
+
+        void finish(capture_timings &timings)
+        {
+            const auto stage_start = std::chrono::steady_clock::now();
+            if (m_binary)
+            {
+                m_binary->finish();
+                timings.output = m_binary->statistics();
+            }
+            else if (m_archive)
+            {
+                m_archive->finish();
+                spdlog::info("Appended capture {} to {}", m_archive->size(), m_request.outfile);
+            }
+            else if (m_hdf5)
+            {
+                if (m_combined)
+                    m_combined->write(*m_hdf5);
+                m_hdf5->close();
+            }
+            else if (m_file)
+            {
+                if (m_combined)
+                    m_combined->write(*m_file, m_request.compression, &m_arena);
+
+                m_file->close();
+                timings.output = m_file->statistics();
+            }
+            timings.write_ms += elapsed_ms(stage_start);
+
+            // Only now that the output is complete do the stored frames become the reference
+            if (m_request.changes)
+            {
+                for (const auto &[data, keyframe] : m_stored)
+                    m_arena.changes.stored(*data, m_request.outfile, keyframe);
+            }
+
+            if (timings.output.writes)
+                spdlog::debug(
+                    "Wrote {} bytes in {} writes, queue depth up to {}, write latency {:.2f} ms mean, {:.2f} ms max",
+                    timings.output.bytes, timings.output.writes, timings.output.max_queue_depth,
+                    timings.output.mean_latency_ms(), timings.output.max_latency_ms);
+        }
+    };
+} // namespace
+
+namespace
+{
+    // Pods are only acquired while they are on, so they are switched on before the scope is armed
+    void enable_pods(rigol::scope &scope, const scope_setup *setup)
+    {
+        // A setup learned for the digital lines switched them on already
+        if (setup && setup->logic_preamble)
+            return;
+
+        // The pods share the acquisition memory with the channels
+        if (switch_on_pods(scope) && setup && scope.memory_depth() != setup->memory_depth)
+            throw std::runtime_error(
+                "Enabling the digital lines changed the memory depth, the scope setup is outdated");
+    }
+
+    acquisition acquire(rigol::scope &scope, const capture_request &request, const scope_setup *setup,
+                        capture_arena &arena, acquisition &&acquired)
+    {
+        if (request.logic)
+            enable_pods(scope, setup);
+        if (request.frames > 1)
+            acquired.timings.detect_ms = record_frames(scope, request.frames);
+        else
+            acquired.timings.detect_ms = wait_for_trigger(scope, request.trigger);
+        acquired.timings.trigger_ms = elapsed_ms(acquired.start);
+        acquired.triggered = std::chrono::system_clock::now();
+
+        // Walk the recorded frames once, every frame switch makes the scope reload its memory
+        for (std::size_t i = 0; i < request.channels.size(); i++)
+            acquired.channels.push_back(&arena.channel(i));
+        if (request.logic)
+            acquired.logic = &arena.logic();
+
+        // One filter thread per channel, each catches up with its channel while the next one downloads
+        std::vector<std::unique_ptr<decimation_worker>> decimation;
+        if (request.decimation)
+        {
+            for (std::size_t i = 0; i < request.channels.size(); i++)
+                decimation.push_back(std::make_unique<decimation_worker>(*request.decimation));
+            spdlog::info("Decimating by {} with {} taps", request.decimation->factor, decimation.front()->taps());
+        }
+
+        const auto stage_start = std::chrono::steady_clock::now();
+        {
+            stage_memory memory{request, acquired.timings.transfer_peak_rss};
+            for (std::size_t frame = 1; frame <= request.frames; frame++)
+            {
+                if (request.frames > 1)
+                {
+                    spdlog::info("Reading frame {} of {}", frame, request.frames);
+                    scope.select_frame(frame);
+                }
+                for (std::size_t i = 0; i < request.channels.size(); i++)
+                    read_channel_data(scope, request.channels[i], *acquired.channels[i], setup,
+                                      decimation.empty() ? nullptr : decimation[i].get());
+                if (acquired.logic)
+                    read_logic_data(scope, *acquired.logic, setup);
+            }
+            for (auto &worker : decimation)
+                worker->wait();
+        }
+        acquired.timings.transfer_ms += elapsed_ms(stage_start);
+        return std::move(acquired);
+    }
+} // namespace
+
+acquisition acquire(rigol::scope &scope, const capture_request &request, const scope_setup *setup,
+                    capture_arena &arena)
+{
+    check_request(request);
+
+    acquisition acquired;
+    acquired.start = std::chrono::steady_clock::now();
+    // An acquisition holds every channel, requests that only fit the budget one channel at a time
+    // have to go through capture()
+    capture_strategy fastest = default_strategy(request);
+    fastest.buffered = true;
+    acquired.strategy = plan_capture(scope, request, setup, fastest, acquired.timings);
+    return acquire(scope, request, setup, arena, std::move(acquired));
+}
+
+capture_timings store(const capture_request &request, acquisition &&acquired, capture_arena &arena)
+{
+    capture_timings timings = acquired.timings;
+    std::vector<channel_data *> &data = acquired.channels;
+
+    if (request.changes)
+    {
+        data.erase(std::remove_if(data.begin(), data.end(),
+                                  [&](const channel_data *channel) {
+                                      return !arena.changes.changed(*channel, request.changes->tolerance);
+                                  }),
+                   data.end());
+        if (data.empty())
+        {
+            spdlog::info("No channel changed, {} not written", request.outfile);
+            timings.skipped = true;
+            timings.total_ms = elapsed_ms(acquired.start);
+            return timings;
+        }
+    }
+
+    {
+        stage_memory memory{request, timings.write_peak_rss};
+        const auto stage_start = std::chrono::steady_clock::now();
+        capture_output output{request, acquired.strategy, arena, acquired.triggered};
+        for (const channel_data *channel : data)
+            output.write(*channel);
+        if (acquired.logic)
+            output.write(*acquired.logic);
+        timings.write_ms += elapsed_ms(stage_start);
+        output.finish(timings);
+    }
+
+    timings.total_ms = elapsed_ms(acquired.start);
+    return timings;
+}
+
+capture_timings capture(rigol::scope &scope, const capture_request &request, const scope_setup *setup,
+                        capture_arena *arena)
+{
+    std::unique_ptr<capture_arena> own_arena;
+    if (!arena)
+    {
+        own_arena = std::make_unique<capture_arena>();
+        arena = own_arena.get();
+    }
+
+    check_request(request);
+    capture_timings timings;
+    const auto start = std::chrono::steady_clock::now();
+    const capture_strategy strategy = plan_capture(scope, request, setup, default_strategy(request), timings);
+
+    // With change detection the whole capture is read before deciding whether to write anything, a
+    // decimated one so that every channel is filtered on its own thread
+    if (strategy.buffered)
+    {
+        acquisition acquired;
+        acquired.start = start;
+        acquired.strategy = strategy;
+        acquired.timings = timings;
+        return store(request, acquire(scope, request, setup, *arena, std::move(acquired)), *arena);
+    }
+
+    if (request.logic)
+        enable_pods(scope, setup);
+    timings.detect_ms = wait_for_trigger(scope, request.trigger);
+    timings.trigger_ms = elapsed_ms(start);
+    const auto triggered = std::chrono::system_clock::now();
+
+    // Channels are written as they arrive, only one download buffer is in use
+    capture_output output{request, strategy, *arena, triggered};
+    for (auto ch : request.channels)
+    {
+        spdlog::info("Reading data for {}", ch);
+        channel_data &data = arena->channel(0);
+        auto stage_start = std::chrono::steady_clock::now();
+        {
+            stage_memory memory{request, timings.transfer_peak_rss};
+            read_channel_data(scope, ch, data, setup);
+        }
+        timings.transfer_ms += elapsed_ms(stage_start);
+
+        stage_start = std::chrono::steady_clock::now();
+        stage_memory memory{request, timings.write_peak_rss};
+        output.write(data);
+        timings.write_ms += elapsed_ms(stage_start);
+    }
+    if (request.logic)
+    {
+        spdlog::info("Reading data for D0-D15");
+        logic_data &data = arena->logic();
+        auto stage_start = std::chrono::steady_clock::now();
+        {
+            stage_memory memory{request, timings.transfer_peak_rss};
+            read_logic_data(scope, data, setup);
+        }
+        timings.transfer_ms += elapsed_ms(stage_start);
+
+        stage_start = std::chrono::steady_clock::now();
+        stage_memory memory{request, timings.write_peak_rss};
+        output.write(data);
+        timings.write_ms += elapsed_ms(stage_start);
+    }
+    {
+        stage_memory memory{request, timings.write_peak_rss};
+        output.finish(timings);
+    }
+
+    timings.total_ms = elapsed_ms(start);
+    return timings;
+}
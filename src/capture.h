@@ -0,0 +1,263 @@
+#pragma once
+
+#include "change_detection.h"
+#include "decimation.h"
+#include "events.h"
+#include "file_sink.h"
+#include "logic.h"
+#include "mat73_writer.h"
+#include "mat_writer.h"
+#include "page_buffer.h"
+#include "scope.h"
+#include "spectrum.h"
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+enum class trigger_mode
+{
+    STOP,
+    SINGLE,
+};
+
+enum class output_format
+{
+    MAT,
+    // HDF5 based, for variables beyond the 2 GB limit of MAT v5
+    MAT73,
+    NPY,
+    RAW,
+    PACKED,
+    CONTAINER,
+};
+
+enum class matrix_layout
+{
+    // One 2xN CHANNEL_n matrix of time and value per channel
+    SEPARATE,
+    // A single Nx(1+C) CHANNELS matrix, time in the first column and one column per channel
+    COMBINED,
+};
+
+struct capture_request
+{
+    std::vector<rigol::channel> channels;
+    trigger_mode trigger = trigger_mode::SINGLE;
+    output_format format = output_format::MAT;
+    matrix_layout layout = matrix_layout::SEPARATE;
+    std::string outfile;
+    int compression = 0;
+    // Chunk layout of MAT 7.3 files, their zlib level is `compression`
+    mat73::settings mat73;
+    // More than one frame uses the scope's waveform recording instead of the trigger mode
+    std::size_t frames = 1;
+    std::vector<std::size_t> preview_factors;
+    // Also write a CHANNEL_n_stats struct per channel
+    bool statistics = false;
+    // Write only windows around threshold crossings instead of the whole waveform
+    std::optional<event_settings> events;
+    // Write the Welch power spectrum instead of the waveform
+    std::optional<spectrum_settings> spectrum;
+    // Skip channels that did not change since they were last stored, single frames only
+    std::optional<change_settings> changes;
+    // Save the waveform low pass filtered and decimated, filtered while it downloads
+    std::optional<decimation_settings> decimation;
+    // Filter taps and cutoff, also kept without decimation so that decimate= can turn it on later
+    decimation_settings decimation_filter;
+    // Also capture the digital lines D0-D15 of MSO models, MAT and MAT 7.3 only
+    std::optional<logic_settings> logic;
+    sink_settings output;
+    // Bytes the capture buffers may take, the capture is run in the fastest way that fits. 0 is unlimited.
+    std::size_t memory_budget = 0;
+};
+
+// How a capture is run, the default one is what the request needs to be fastest
+struct capture_strategy
+{
+    // Every channel is downloaded before the output is written, otherwise one channel at a time
+    bool buffered = false;
+    // Waveforms are scaled chunk by chunk straight into the output instead of into a whole matrix
+    bool chunked = false;
+    // MAT 7.3 compression threads, 0 keeps the request's
+    unsigned compressors = 0;
+};
+
+struct capture_timings
+{
+    double trigger_ms = 0;
+    // Upper bound of the time between the scope stopping and the capture noticing
+    double detect_ms = 0;
+    double transfer_ms = 0;
+    double write_ms = 0;
+    double total_ms = 0;
+    sink_statistics output;
+    // No channel changed, nothing was written
+    bool skipped = false;
+    // Only with a memory budget: the planned footprint and the peak resident set size while
+    // downloading and while writing, 0 where the kernel does not tell
+    std::size_t estimated_bytes = 0;
+    std::size_t transfer_peak_rss = 0;
+    std::size_t write_peak_rss = 0;
+    // Peak resident set size of the whole process, set instead of the stage peaks when downloads
+    // and writes overlap
+    std::size_t peak_rss = 0;
+};
+
+// Scope state that is expensive to re-learn before every capture. It is only valid for as long as
+// nobody touches the scope's memory depth, timebase or vertical settings.
+struct scope_setup
+{
+    std::size_t memory_depth = 0;
+    std::map<rigol::channel, rigol::preamble> preambles;
+    // Preamble of the digital lines, only learned for logic capture, which switches the pods on
+    std::optional<rigol::preamble> logic_preamble;
+
+    void learn(rigol::scope &scope, const std::vector<rigol::channel> &channels, bool logic = false);
+};
+
+// Raw codes of one channel, `frames` recorded frames of `points` samples each stored back to back
+struct channel_data
+{
+    rigol::channel channel;
+    rigol::preamble preamble;
+    std::size_t points = 0;
+    std::size_t frames = 0;
+    page_buffer<uint8_t> raw;
+    // Set when the download was decimated, `decimated` then holds decimated_points(points, decimation)
+    // filtered codes per frame, which the waveform is saved from
+    std::size_t decimation = 1;
+    page_buffer<float> decimated;
+};
+
+// Packed digital lines D0-D15, `frames` frames of `points` samples stored back to back
+struct logic_data
+{
+    rigol::preamble preamble;
+    std::size_t points = 0;
+    std::size_t frames = 0;
+    page_buffer<uint16_t> packed;
+    // D0-D7 of the frame being read, D8-D15 are interleaved with them as they arrive
+    page_buffer<uint8_t> pod;
+};
+
+// Buffers reused across channels and captures, once they have grown to the largest capture a
+// capture loop no longer allocates and its RSS stays flat
+class capture_arena
+{
+    bool m_huge_pages;
+    // References handed out stay valid while more slots are added
+    std::deque<channel_data> m_channels;
+    logic_data m_logic;
+    std::unique_ptr<mat::compressed_section> m_compressor;
+
+  public:
+    page_buffer<double> scaled;
+    page_buffer<double> combined;
+    // One unpacked digital line
+    page_buffer<uint8_t> line;
+    change_tracker changes;
+
+    explicit capture_arena(bool huge_pages = false);
+
+    // Slot `i` emptied for a new capture, its memory is kept
+    channel_data &channel(std::size_t i);
+    // The digital lines emptied for a new capture
+    logic_data &logic();
+    mat::compressed_section &compressor(int level);
+    // Allocates and pre-faults the download buffers up front
+    void reserve(std::size_t memory_depth, std::size_t channels);
+    // Also sizes the conversion buffers `request` needs, for all its frames
+    void reserve(std::size_t memory_depth, const capture_request &request);
+};
+
+std::vector<rigol::channel> parse_channels(std::string_view value);
+trigger_mode parse_trigger(std::string_view value);
+output_format parse_format(std::string_view value);
+matrix_layout parse_layout(std::string_view value);
+// Sets a request parameter by its name in daemon requests and plan files, e.g. "zlib" or "frames"
+void set_request_parameter(capture_request &request, std::string_view key, std::string_view value);
+// Keys that switch a mode on, e.g. "events", they are applied before the keys adjusting that mode
+bool is_mode_parameter(std::string_view key);
+
+// Both return the detection latency in milliseconds, see capture_timings::detect_ms
+double wait_for_trigger(rigol::scope &scope, trigger_mode trigger);
+double record_frames(rigol::scope &scope, std::size_t frames);
+
+// Appends one frame of `ch` to `data`, with `decimation` the frame is also filtered while it arrives
+void read_channel_data(rigol::scope &scope, rigol::channel ch, channel_data &data, const scope_setup *setup = nullptr,
+                       decimation_worker *decimation = nullptr);
+// Appends one frame of the digital lines to `data`
+void read_logic_data(rigol::scope &scope, logic_data &data, const scope_setup *setup = nullptr);
+// Writes the packed lines as LOGIC, the time of their first sample and their sample interval as
+// LOGIC_time and any requested unpacked lines and transitions
+void write_logic(std::ostream &file, const logic_data &data, const capture_request &request, capture_arena &arena);
+void write_logic(mat73::writer &file, const logic_data &data, const capture_request &request, capture_arena &arena);
+// Interleaved time and value pairs
+void scale_channel_data(const channel_data &data, page_buffer<double> &scaled);
+// Writes the waveform (or its spectrum or events, nothing with the combined layout) and any
+// requested previews and statistics. A `chunked` waveform is scaled piece by piece while it is written.
+void write_channel(std::ostream &file, const channel_data &data, const capture_request &request,
+                   capture_arena &arena, bool chunked = false);
+void write_waveform(std::ostream &file, const channel_data &data, const capture_request &request,
+                    capture_arena &arena, bool chunked = false);
+void write_waveform(mat73::writer &file, const channel_data &data, capture_arena &arena, bool chunked = false);
+// Compresses with the arena's zlib state if one is given
+void write_variable(std::ostream &file, const mat::data_element &element, int compression,
+                    capture_arena *arena = nullptr);
+
+// Nx(1+C)[xF] matrix that channels are converted into in place as they arrive. A `chunked` one only
+// keeps the channels, which then have to stay valid until it is written, and scales them while writing.
+class combined_matrix
+{
+    page_buffer<double> &m_data;
+    bool m_chunked;
+    std::size_t m_points = 0;
+    std::size_t m_frames = 0;
+    std::size_t m_columns;
+    std::vector<double> m_channels;
+    std::vector<const channel_data *> m_sources;
+    rigol::preamble m_time;
+
+    void fill(std::size_t first, std::size_t count, double *out) const;
+
+  public:
+    combined_matrix(std::size_t channels, page_buffer<double> &storage, bool chunked = false)
+        : m_data(storage), m_chunked(chunked), m_columns(channels + 1)
+    {
+    }
+
+    void add(const channel_data &data);
+    void write(std::ostream &file, int compression, capture_arena *arena = nullptr) const;
+    void write(mat73::writer &file) const;
+};
+
+// Waits for the trigger and writes all requested channels, `setup` (if given) replaces the
+// memory depth and preamble queries and `arena` (if given) provides the buffers. With a memory
+// budget the strategy is planned from the memory depth before arming.
+capture_timings capture(rigol::scope &scope, const capture_request &request, const scope_setup *setup = nullptr,
+                        capture_arena *arena = nullptr);
+
+// A capture read completely into its arena but not written yet
+struct acquisition
+{
+    capture_strategy strategy;
+    capture_timings timings;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::system_clock::time_point triggered;
+    std::vector<channel_data *> channels;
+    logic_data *logic = nullptr;
+};
+
+// capture() in two halves: acquire() only talks to the scope and store() only writes the output,
+// so the next capture can be armed while the previous one is stored from another arena
+acquisition acquire(rigol::scope &scope, const capture_request &request, const scope_setup *setup,
+                    capture_arena &arena);
+capture_timings store(const capture_request &request, acquisition &&acquired, capture_arena &arena);
@@ -0,0 +1,145 @@
+#include "change_detection.h"
+#include "capture.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <spdlog/fmt/ostr.h>
+#include <spdlog/spdlog.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    int popcount(unsigned mask)
+    {
+#if defined(__GNUC__)
+        return __builtin_popcount(mask);
+#else
+        int n = 0;
+        for (; mask; mask &= mask - 1)
+            n++;
+        return n;
+#endif
+    }
+
+    void copy_frame(const channel_data &data, page_buffer<uint8_t> &to)
+    {
+        to.resize(data.raw.size());
+        std::copy(data.raw.begin(), data.raw.end(), to.begin());
+    }
+} // namespace
+
+frame_difference compare_frames(const uint8_t *a, const uint8_t *b, std::size_t count, unsigned tolerance)
+{
+    frame_difference diff;
+    const uint8_t limit = (uint8_t)std::min(tolerance, 255u);
+    std::size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i tol = _mm_set1_epi8((char)limit);
+    __m128i max = zero;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        const __m128i delta = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        max = _mm_max_epu8(max, delta);
+        // Lanes within tolerance saturate to zero
+        const unsigned within = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(delta, tol), zero));
+        diff.changed += 16 - popcount(within);
+    }
+
+    alignas(16) uint8_t lanes[16];
+    _mm_store_si128((__m128i *)lanes, max);
+    for (uint8_t lane : lanes)
+        diff.max_delta = std::max<unsigned>(diff.max_delta, lane);
+#endif
+
+    for (; i < count; i++)
+    {
+        const unsigned delta = (unsigned)std::abs(a[i] - b[i]);
+        diff.max_delta = std::max(diff.max_delta, delta);
+        if (delta > limit)
+            diff.changed++;
+    }
+
+    return diff;
+}
+
+void xor_frames(const uint8_t *a, const uint8_t *b, uint8_t *out, std::size_t count)
+{
+    std::size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(va, vb));
+    }
+#endif
+
+    for (; i < count; i++)
+        out[i] = a[i] ^ b[i];
+}
+
+bool change_tracker::changed(const channel_data &data, unsigned tolerance) const
+{
+    const auto it = m_channels.find(data.channel);
+    if (it == m_channels.end() || it->second.previous.size() != data.raw.size())
+        return true;
+
+    frame_difference diff;
+    {
+        rigol::trace::span span{"change detection", "convert"};
+        diff = compare_frames(data.raw.data(), it->second.previous.data(), data.raw.size(), tolerance);
+    }
+
+    if (diff.changed == 0)
+    {
+        spdlog::info("{} unchanged (largest difference {} codes), skipped", data.channel, diff.max_delta);
+        return false;
+    }
+
+    spdlog::info("{} changed in {} of {} samples (largest difference {} codes)", data.channel, diff.changed,
+                 data.raw.size(), diff.max_delta);
+    return true;
+}
+
+const uint8_t *change_tracker::keyframe(const channel_data &data, const std::string &file, std::size_t interval,
+                                        std::size_t &index) const
+{
+    const auto it = m_channels.find(data.channel);
+    if (interval == 0 || it == m_channels.end())
+        return nullptr;
+
+    const channel_state &state = it->second;
+    if (state.keyframe_file != file || state.keyframe.size() != data.raw.size() || state.deltas >= interval)
+        return nullptr;
+
+    index = state.keyframe_index;
+    return state.keyframe.data();
+}
+
+void change_tracker::stored(const channel_data &data, const std::string &file,
+                            std::optional<std::size_t> keyframe_index)
+{
+    channel_state &state = m_channels[data.channel];
+    copy_frame(data, state.previous);
+
+    if (keyframe_index)
+    {
+        copy_frame(data, state.keyframe);
+        state.keyframe_file = file;
+        state.keyframe_index = *keyframe_index;
+        state.deltas = 0;
+    }
+    else if (state.keyframe_file == file)
+    {
+        state.deltas++;
+    }
+}
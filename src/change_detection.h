@@ -0,0 +1,62 @@
+#pragma once
+
+#include "page_buffer.h"
+#include "scope.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+
+struct channel_data;
+
+struct frame_difference
+{
+    // Samples that moved by more than the tolerance
+    std::size_t changed = 0;
+    unsigned max_delta = 0;
+};
+
+// Per-sample comparison of two frames of raw codes
+frame_difference compare_frames(const uint8_t *a, const uint8_t *b, std::size_t count, unsigned tolerance);
+// out = a ^ b, `out` may be either input
+void xor_frames(const uint8_t *a, const uint8_t *b, uint8_t *out, std::size_t count);
+
+struct change_settings
+{
+    // Largest per-sample code difference that still counts as unchanged
+    unsigned tolerance = 0;
+    // Store changed frames in a container as XOR against a keyframe, 0 stores full frames. A new
+    // keyframe is taken after this many deltas.
+    std::size_t keyframe_interval = 0;
+};
+
+// Remembers the last stored frame (and keyframe) of every channel between captures. Frames are
+// compared against the last one stored rather than the last one seen, so slow drift still adds up
+// to a change.
+class change_tracker
+{
+    struct channel_state
+    {
+        page_buffer<uint8_t> previous;
+        page_buffer<uint8_t> keyframe;
+        std::string keyframe_file;
+        std::size_t keyframe_index = 0;
+        std::size_t deltas = 0;
+    };
+
+    std::map<rigol::channel, channel_state> m_channels;
+
+  public:
+    page_buffer<uint8_t> delta;
+
+    // Logs the outcome, a channel seen for the first time or with a new memory depth has changed
+    bool changed(const channel_data &data, unsigned tolerance) const;
+    // The keyframe `data` can be stored against in container `file`, nullptr when a new keyframe is due
+    const uint8_t *keyframe(const channel_data &data, const std::string &file, std::size_t interval,
+                            std::size_t &index) const;
+    // Called once `data` is safely written, `keyframe_index` is set when it became a keyframe
+    void stored(const channel_data &data, const std::string &file, std::optional<std::size_t> keyframe_index);
+    void reset() { m_channels.clear(); }
+};
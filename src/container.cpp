@@ -0,0 +1,325 @@
+#include "container.h"
+#include "change_detection.h"
+#include "mat_reader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <spdlog/fmt/ostr.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace container
+{
+    namespace
+    {
+        constexpr char FILE_MAGIC[8] = {'S', 'C', 'O', 'P', 'E', 'C', 'A', 'P'};
+        constexpr uint32_t VERSION = 1;
+        constexpr uint32_t BLOCK_MAGIC = 0x4b424353;   // "SCBK"
+        constexpr uint32_t TRAILER_MAGIC = 0x58494353; // "SCIX"
+
+        struct file_header
+        {
+            char magic[8];
+            uint32_t version;
+            uint32_t record_size;
+        };
+
+        struct block_header
+        {
+            uint32_t magic;
+            uint32_t reserved;
+            capture_record record;
+        };
+
+        struct trailer
+        {
+            uint64_t index_offset;
+            uint64_t count;
+            uint32_t crc;
+            uint32_t magic;
+        };
+
+        uint32_t index_crc(const std::vector<capture_record> &index)
+        {
+            return (uint32_t)crc32(0, (const Bytef *)index.data(), (uInt)(index.size() * sizeof(capture_record)));
+        }
+
+        void check_header(std::istream &file, const std::string &path)
+        {
+            file_header header{};
+            file.seekg(0);
+            file.read((char *)&header, sizeof(header));
+            if (!file || std::memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0)
+                throw std::runtime_error(fmt::format("'{}' is not a capture container", path));
+            if (header.version != VERSION || header.record_size != sizeof(capture_record))
+                throw std::runtime_error(fmt::format("'{}' has unsupported container version {}", path, header.version));
+        }
+
+        // Reads the index from the trailer, fails if anything about it does not add up
+        bool read_index(std::istream &file, uint64_t file_size, std::vector<capture_record> &index, uint64_t &end)
+        {
+            if (file_size == sizeof(file_header))
+            {
+                index.clear();
+                end = file_size;
+                return true;
+            }
+            if (file_size < sizeof(file_header) + sizeof(trailer))
+                return false;
+
+            trailer t{};
+            file.seekg(file_size - sizeof(trailer));
+            file.read((char *)&t, sizeof(t));
+            if (!file || t.magic != TRAILER_MAGIC ||
+                t.index_offset + t.count * sizeof(capture_record) + sizeof(trailer) != file_size)
+                return false;
+
+            index.resize(t.count);
+            file.seekg(t.index_offset);
+            file.read((char *)index.data(), t.count * sizeof(capture_record));
+            if (!file || index_crc(index) != t.crc)
+                return false;
+
+            end = t.index_offset;
+            return true;
+        }
+
+        void load(std::istream &file, const std::string &path, std::vector<capture_record> &index, uint64_t &end)
+        {
+            check_header(file, path);
+            const uint64_t file_size = std::filesystem::file_size(path);
+            if (read_index(file, file_size, index, end))
+                return;
+
+            spdlog::warn("Index of '{}' is missing or damaged, rebuilding it from the capture blocks", path);
+            file.clear();
+            std::tie(index, end) = rebuild_index(file, file_size);
+            spdlog::warn("Recovered {} capture(s) from '{}'", index.size(), path);
+        }
+    } // namespace
+
+    rigol::preamble channel_record::preamble() const
+    {
+        rigol::preamble pre;
+        pre.points = points;
+        pre.count = 1;
+        pre.x_increment = x_increment;
+        pre.x_origin = x_origin;
+        pre.x_reference = x_reference;
+        pre.y_increment = y_increment;
+        pre.y_origin = y_origin;
+        pre.y_reference = y_reference;
+        return pre;
+    }
+
+    std::pair<std::vector<capture_record>, uint64_t> rebuild_index(std::istream &file, uint64_t file_size)
+    {
+        std::vector<capture_record> index;
+        uint64_t offset = sizeof(file_header);
+
+        while (offset + sizeof(block_header) <= file_size)
+        {
+            block_header header{};
+            file.seekg(offset);
+            file.read((char *)&header, sizeof(header));
+            const capture_record &record = header.record;
+            if (!file || header.magic != BLOCK_MAGIC || record.size == 0 ||
+                record.offset != offset + sizeof(block_header) || record.size > file_size - record.offset)
+                break;
+
+            index.push_back(record);
+            offset = record.offset + record.size;
+        }
+
+        return {std::move(index), offset};
+    }
+
+    writer::writer(const std::string &path, int compression) : m_path(path), m_compression(compression)
+    {
+        if (!std::filesystem::exists(path) || std::filesystem::file_size(path) == 0)
+        {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc | std::ios::out);
+            file_header header{};
+            std::memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+            header.version = VERSION;
+            header.record_size = sizeof(capture_record);
+            file.write((const char *)&header, sizeof(header));
+            if (!file)
+                throw std::runtime_error(fmt::format("Cannot create container '{}'", path));
+        }
+
+        m_file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+        if (!m_file)
+            throw std::runtime_error(fmt::format("Cannot open container '{}'", path));
+        load(m_file, path, m_index, m_block_offset);
+
+        // Drop the old index (and whatever a crash left behind), it is rewritten after the next block
+        m_file.close();
+        std::filesystem::resize_file(path, m_block_offset);
+        m_file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+        if (!m_file)
+            throw std::runtime_error(fmt::format("Cannot open container '{}'", path));
+        write_index();
+    }
+
+    void writer::begin(int64_t timestamp_ns)
+    {
+        m_current = {};
+        m_current.offset = m_block_offset + sizeof(block_header);
+        m_current.timestamp_ns = timestamp_ns;
+        m_current.compression = m_compression;
+
+        block_header header{BLOCK_MAGIC, 0, m_current};
+        m_file.seekp(m_block_offset);
+        m_file.write((const char *)&header, sizeof(header));
+    }
+
+    void writer::add_channel(const channel_data &data)
+    {
+        if (m_current.channel_count == std::size(m_current.channels))
+            throw std::logic_error("Too many channels in one capture");
+
+        const rigol::preamble &pre = data.preamble;
+        m_current.channels[m_current.channel_count++] = {
+            (uint32_t)data.channel + 1, (uint32_t)data.frames, data.points, pre.x_increment, pre.x_origin,
+            pre.x_reference,            pre.y_increment,        pre.y_origin, pre.y_reference};
+    }
+
+    void writer::write(const channel_data &data)
+    {
+        spdlog::info("Saving data for {}", data.channel);
+        add_channel(data);
+        write_variable(m_file,
+                       mat::numeric_array<uint8_t>{fmt::format("{}", data.channel), data.raw.data(),
+                                                   {(int32_t)data.points, (int32_t)data.frames}},
+                       m_compression);
+    }
+
+    void writer::write_delta(const channel_data &data, const uint8_t *delta, std::size_t keyframe)
+    {
+        if (keyframe >= m_index.size())
+            throw std::logic_error(fmt::format("Keyframe {} is not in the container", keyframe));
+
+        spdlog::info("Saving data for {} as delta to capture {}", data.channel, keyframe);
+        add_channel(data);
+        write_variable(m_file,
+                       mat::numeric_array<uint8_t>{fmt::format("{}_delta", data.channel), delta,
+                                                   {(int32_t)data.points, (int32_t)data.frames}},
+                       m_compression);
+        const double index = (double)keyframe;
+        write_variable(m_file, mat::numeric_array<double>{fmt::format("{}_keyframe", data.channel), &index, {1, 1}},
+                       m_compression);
+    }
+
+    void writer::finish()
+    {
+        const uint64_t end = m_file.tellp();
+        m_current.size = end - m_current.offset;
+
+        block_header header{BLOCK_MAGIC, 0, m_current};
+        m_file.seekp(m_block_offset);
+        m_file.write((const char *)&header, sizeof(header));
+
+        m_index.push_back(m_current);
+        m_block_offset = end;
+        write_index();
+    }
+
+    void writer::write_index()
+    {
+        const trailer t{m_block_offset, m_index.size(), index_crc(m_index), TRAILER_MAGIC};
+        m_file.seekp(m_block_offset);
+        m_file.write((const char *)m_index.data(), m_index.size() * sizeof(capture_record));
+        m_file.write((const char *)&t, sizeof(t));
+        m_file.flush();
+        if (!m_file)
+            throw std::runtime_error(fmt::format("Cannot write container '{}'", m_path));
+    }
+
+    reader::reader(const std::string &path) : m_file(path, std::ios::binary | std::ios::in)
+    {
+        if (!m_file)
+            throw std::runtime_error(fmt::format("Cannot open container '{}'", path));
+
+        uint64_t end;
+        load(m_file, path, m_index, end);
+    }
+
+    std::pair<std::size_t, std::size_t> reader::range(int64_t from_ns, int64_t to_ns) const
+    {
+        // Captures are appended in time order
+        auto before = [](int64_t limit) { return [limit](const capture_record &r) { return r.timestamp_ns < limit; }; };
+        const auto first = std::partition_point(m_index.begin(), m_index.end(), before(from_ns));
+        const auto last = std::partition_point(first, m_index.end(), before(to_ns));
+        return {first - m_index.begin(), last - m_index.begin()};
+    }
+
+    void reader::read_payload(std::size_t n, std::vector<uint8_t> &payload) const
+    {
+        const capture_record &r = record(n);
+        payload.resize(r.size);
+        m_file.clear();
+        m_file.seekg(r.offset);
+        m_file.read((char *)payload.data(), r.size);
+        if (!m_file)
+            throw std::runtime_error(fmt::format("Cannot read capture {}", n));
+    }
+
+    void reader::read_codes(std::size_t n, rigol::channel ch, std::vector<uint8_t> &codes) const
+    {
+        std::vector<uint8_t> payload;
+        read_payload(n, payload);
+        const mat::reader elements{payload.data(), payload.size()};
+        const std::string name = fmt::format("{}", ch);
+
+        const auto &variables = elements.variables();
+        if (std::any_of(variables.begin(), variables.end(), [&](const mat::variable &v) { return v.name == name; }))
+        {
+            elements.read(elements.find(name), codes);
+            return;
+        }
+
+        std::vector<double> keyframe;
+        elements.read(elements.find(name + "_keyframe"), keyframe);
+        if (keyframe.size() != 1 || keyframe[0] < 0 || keyframe[0] >= n)
+            throw std::runtime_error(fmt::format("Capture {} has an invalid keyframe for {}", n, ch));
+
+        std::vector<uint8_t> delta;
+        elements.read(elements.find(name + "_delta"), delta);
+        read_codes((std::size_t)keyframe[0], ch, codes);
+        if (codes.size() != delta.size())
+            throw std::runtime_error(fmt::format("Capture {} does not match its keyframe for {}", n, ch));
+        xor_frames(delta.data(), codes.data(), codes.data(), codes.size());
+    }
+
+    void reader::write_mat(std::size_t n, std::ostream &os) const
+    {
+        std::vector<uint8_t> payload;
+        read_payload(n, payload);
+        os << mat::header{};
+
+        const capture_record &r = record(n);
+        const mat::reader elements{payload.data(), payload.size()};
+        const auto &variables = elements.variables();
+        if (std::none_of(variables.begin(), variables.end(),
+                         [](const mat::variable &v) { return v.name.find("_delta") != std::string::npos; }))
+        {
+            os.write((const char *)payload.data(), payload.size());
+            return;
+        }
+
+        std::vector<uint8_t> codes;
+        for (uint32_t i = 0; i < r.channel_count; i++)
+        {
+            const channel_record &c = r.channels[i];
+            const rigol::channel ch = (rigol::channel)(c.channel - 1);
+            read_codes(n, ch, codes);
+            write_variable(os,
+                           mat::numeric_array<uint8_t>{fmt::format("{}", ch), codes.data(),
+                                                       {(int32_t)c.points, (int32_t)c.frames}},
+                           r.compression);
+        }
+    }
+} // namespace container
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "capture.h"
+
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Append-only file holding many captures:
+//
+//   file header | block | block | ... | index | trailer
+//
+// Every block is a block header (magic followed by its capture_record) and a payload made of MAT
+// data elements, one uint8 array of raw codes per channel. Prepending a MAT header to a payload
+// gives a valid MAT file. The index repeats all capture_records and is rewritten after every
+// append, when it is missing or damaged it is rebuilt by walking the block headers.
+//
+// A channel stored as delta has a CHANNEL_n_delta array (its codes XOR those of the same channel in
+// an earlier keyframe capture) and a CHANNEL_n_keyframe scalar with that capture's index instead of
+// the CHANNEL_n array.
+namespace container
+{
+    struct channel_record
+    {
+        uint32_t channel;
+        uint32_t frames;
+        uint64_t points;
+        double x_increment;
+        double x_origin;
+        double x_reference;
+        double y_increment;
+        double y_origin;
+        double y_reference;
+
+        rigol::preamble preamble() const;
+    };
+
+    struct capture_record
+    {
+        // Payload position in the file
+        uint64_t offset;
+        uint64_t size;
+        int64_t timestamp_ns;
+        uint32_t channel_count;
+        uint32_t compression;
+        channel_record channels[4];
+    };
+
+    class writer
+    {
+        std::string m_path;
+        std::fstream m_file;
+        std::vector<capture_record> m_index;
+        capture_record m_current;
+        uint64_t m_block_offset = 0;
+        int m_compression;
+
+        void write_index();
+        void add_channel(const channel_data &data);
+
+      public:
+        // Creates the file or opens it for appending, rebuilding the index if needed
+        writer(const std::string &path, int compression);
+
+        void begin(int64_t timestamp_ns);
+        void write(const channel_data &data);
+        // `delta` holds the codes of `data` XOR those in capture `keyframe`
+        void write_delta(const channel_data &data, const uint8_t *delta, std::size_t keyframe);
+        void finish();
+
+        // Also the index the capture being written will get
+        std::size_t size() const { return m_index.size(); }
+    };
+
+    class reader
+    {
+        mutable std::ifstream m_file;
+        std::vector<capture_record> m_index;
+
+      public:
+        explicit reader(const std::string &path);
+
+        std::size_t size() const { return m_index.size(); }
+        const capture_record &record(std::size_t n) const { return m_index.at(n); }
+        // Indices [first, last) of captures with from_ns <= timestamp < to_ns
+        std::pair<std::size_t, std::size_t> range(int64_t from_ns, int64_t to_ns) const;
+
+        // MAT data elements of capture `n`
+        void read_payload(std::size_t n, std::vector<uint8_t> &payload) const;
+        // Resolves deltas against their keyframe
+        void read_codes(std::size_t n, rigol::channel ch, std::vector<uint8_t> &codes) const;
+        // Writes capture `n` as a standalone MAT file, deltas are stored resolved
+        void write_mat(std::size_t n, std::ostream &os) const;
+    };
+
+    // Walks the block headers of a container, dropping a trailing incomplete block. Returns the
+    // records and the offset where the next block belongs.
+    std::pair<std::vector<capture_record>, uint64_t> rebuild_index(std::istream &file, uint64_t file_size);
+} // namespace container
@@ -0,0 +1,329 @@
+#include "daemon.h"
+#include "realtime.h"
+#include "statistics.h"
+
+#include <algorithm>
+#include <iostream>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#ifdef __unix__
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace
+{
+    // A client that connects but does not send its request would otherwise block all later ones
+    constexpr int REQUEST_TIMEOUT_S = 5;
+
+    class socket_fd
+    {
+        int m_fd;
+
+      public:
+        explicit socket_fd(int fd) : m_fd(fd) {}
+        socket_fd(const socket_fd &) = delete;
+        socket_fd &operator=(const socket_fd &) = delete;
+        ~socket_fd()
+        {
+            if (m_fd != -1)
+                close(m_fd);
+        }
+
+        operator int() const { return m_fd; }
+    };
+
+    bool read_request(int fd, std::string &line)
+    {
+        line.clear();
+        char ch;
+        while (true)
+        {
+            ssize_t ret = recv(fd, &ch, 1, 0);
+            if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                throw std::runtime_error("Client sent no request in time");
+            if (ret == -1)
+                throw std::system_error(errno, std::system_category(), "Cannot receive from client");
+            if (ret == 0)
+                return !line.empty();
+            if (ch == '\n')
+                return true;
+            if (ch != '\r')
+                line.push_back(ch);
+        }
+    }
+
+    void send_response(int fd, const std::string &response)
+    {
+        std::string_view rest = response;
+        while (!rest.empty())
+        {
+            ssize_t ret = send(fd, rest.data(), rest.size(), MSG_NOSIGNAL);
+            if (ret == -1)
+            {
+                spdlog::warn("Cannot send response to client: {}", std::system_category().message(errno));
+                return;
+            }
+            rest.remove_prefix(ret);
+        }
+    }
+
+    class capture_daemon
+    {
+        const std::function<std::unique_ptr<rigol::connection>()> &m_connect;
+        const capture_request &m_defaults;
+        std::unique_ptr<rigol::scope> m_scope;
+        scope_setup m_setup;
+        capture_arena m_arena;
+        const daemon_options &m_options;
+        cycle_statistics m_cycles;
+        bool m_running = true;
+
+        rigol::scope &scope()
+        {
+            if (!m_scope)
+            {
+                m_scope = std::make_unique<rigol::scope>(m_connect());
+                learn(m_defaults.channels, m_defaults.logic.has_value());
+            }
+            return *m_scope;
+        }
+
+        void learn(const std::vector<rigol::channel> &channels, bool logic)
+        {
+            m_setup.learn(*m_scope, channels, logic);
+            if (m_options.realtime)
+            {
+                capture_request sizing = m_defaults;
+                sizing.channels = channels;
+                m_arena.reserve(m_setup.memory_depth, sizing);
+            }
+            else
+            {
+                m_arena.reserve(m_setup.memory_depth, channels.size());
+            }
+        }
+
+        // A failed export is no reason to fail the capture or to reconnect
+        void write_prometheus() const
+        {
+            if (m_options.prometheus.empty())
+                return;
+            try
+            {
+                rigol::write_prometheus_file(m_options.prometheus, m_scope->statistics(), m_options.instance);
+            }
+            catch (const std::exception &ex)
+            {
+                spdlog::warn("{}", ex.what());
+            }
+        }
+
+        capture_request parse_request(std::string_view args, bool &refresh) const
+        {
+            capture_request request = m_defaults;
+            std::vector<std::pair<std::string_view, std::string_view>> values;
+            while (!args.empty())
+            {
+                const auto space = args.find(' ');
+                const std::string_view token = args.substr(0, space);
+                args = space == std::string_view::npos ? std::string_view{} : args.substr(space + 1);
+                if (token.empty())
+                    continue;
+
+                const auto eq = token.find('=');
+                if (eq == std::string_view::npos)
+                    throw std::invalid_argument(fmt::format("Expected key=value, got '{}'", token));
+
+                values.emplace_back(token.substr(0, eq), token.substr(eq + 1));
+            }
+
+            std::stable_partition(values.begin(), values.end(),
+                                  [](const auto &value) { return is_mode_parameter(value.first); });
+            for (const auto &[key, value] : values)
+            {
+                if (key == "refresh")
+                    refresh = value != "0";
+                else
+                    set_request_parameter(request, key, value);
+            }
+
+            return request;
+        }
+
+        std::string handle(std::string_view line)
+        {
+            const auto space = line.find(' ');
+            const std::string_view command = line.substr(0, space);
+            const std::string_view args = space == std::string_view::npos ? std::string_view{} : line.substr(space + 1);
+
+            if (command == "ping")
+                return "ok";
+
+            if (command == "quit")
+            {
+                m_running = false;
+                return "ok";
+            }
+
+            bool refresh = command == "refresh";
+            capture_request request = parse_request(args, refresh);
+
+            if (command == "refresh")
+            {
+                scope();
+                learn(request.channels, request.logic.has_value());
+                return fmt::format("ok memory_depth={}", m_setup.memory_depth);
+            }
+
+            if (command != "capture")
+                throw std::invalid_argument(fmt::format("Unknown command '{}'", command));
+
+            if (request.outfile.empty())
+                throw std::invalid_argument("capture needs out=<path>");
+
+            rigol::scope &s = scope();
+            for (auto ch : request.channels)
+                refresh = refresh || !m_setup.preambles.count(ch);
+            if (refresh || (request.logic && !m_setup.logic_preamble))
+                learn(request.channels, request.logic.has_value());
+
+            const capture_timings timings = capture(s, request, &m_setup, &m_arena);
+            spdlog::info("Captured {} in {:.1f} ms", request.outfile, timings.total_ms);
+            m_cycles.add(timings.detect_ms, timings.total_ms);
+            write_prometheus();
+            std::string response =
+                fmt::format("ok trigger_ms={:.3f} detect_ms={:.3f} transfer_ms={:.3f} write_ms={:.3f} "
+                            "total_ms={:.3f} queue_depth={} write_latency_ms={:.3f} skipped={:d}",
+                            timings.trigger_ms, timings.detect_ms, timings.transfer_ms, timings.write_ms,
+                            timings.total_ms, timings.output.max_queue_depth, timings.output.mean_latency_ms(),
+                            timings.skipped);
+            if (request.memory_budget)
+                response += fmt::format(" estimated_mb={:.1f} transfer_rss_mb={:.1f} write_rss_mb={:.1f}",
+                                        timings.estimated_bytes / 1048576.0, timings.transfer_peak_rss / 1048576.0,
+                                        timings.write_peak_rss / 1048576.0);
+            return response;
+        }
+
+      public:
+        capture_daemon(const std::function<std::unique_ptr<rigol::connection>()> &connect,
+                       const capture_request &defaults, const daemon_options &options)
+            : m_connect(connect), m_defaults(defaults), m_arena(options.huge_pages), m_options(options)
+        {
+            scope();
+            if (m_options.realtime)
+                realtime::lock_memory();
+        }
+
+        void serve(int client)
+        {
+            std::string line;
+            try
+            {
+                if (!read_request(client, line))
+                    return;
+            }
+            catch (const std::exception &ex)
+            {
+                spdlog::warn("Dropping client: {}", ex.what());
+                return;
+            }
+
+            std::string response;
+            try
+            {
+                response = handle(line);
+            }
+            catch (const std::invalid_argument &ex)
+            {
+                response = fmt::format("error {}", ex.what());
+            }
+            catch (const std::exception &ex)
+            {
+                // Requests are validated before the scope is touched, anything else leaves the scope
+                // connection in unknown state, reconnect on next request
+                spdlog::error("Request '{}' failed: {}", line, ex.what());
+                response = fmt::format("error {}", ex.what());
+                m_scope.reset();
+            }
+
+            send_response(client, response + "\n");
+        }
+
+        bool running() const { return m_running; }
+
+        void write_latencies(std::ostream &os) const
+        {
+            m_cycles.write(os, m_scope ? m_scope->statistics() : rigol::connection_statistics{});
+        }
+
+        void write_statistics(std::ostream &os) const
+        {
+            rigol::write_summary(os, m_scope ? m_scope->statistics() : rigol::connection_statistics{});
+        }
+    };
+} // namespace
+
+void run_daemon(const std::function<std::unique_ptr<rigol::connection>()> &connect, const std::string &socket_path,
+                const capture_request &defaults, const daemon_options &options)
+{
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error(fmt::format("Socket path '{}' is too long", socket_path));
+    socket_path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+    socket_fd listener{socket(AF_UNIX, SOCK_STREAM, 0)};
+    if (listener == -1)
+        throw std::system_error(errno, std::system_category(), "Cannot create control socket");
+
+    unlink(socket_path.c_str());
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        throw std::system_error(errno, std::system_category(), "Cannot bind control socket");
+
+    if (listen(listener, 4) == -1)
+        throw std::system_error(errno, std::system_category(), "Cannot listen on control socket");
+
+    capture_daemon daemon{connect, defaults, options};
+    spdlog::info("Waiting for capture requests on {}", socket_path);
+
+    while (daemon.running())
+    {
+        socket_fd client{accept(listener, nullptr, nullptr)};
+        if (client == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::system_category(), "Cannot accept control connection");
+        }
+
+        const struct timeval timeout = {REQUEST_TIMEOUT_S, 0};
+        if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1)
+            spdlog::warn("Cannot set receive timeout: {}", std::system_category().message(errno));
+
+        daemon.serve(client);
+    }
+
+    unlink(socket_path.c_str());
+    if (options.realtime)
+        daemon.write_latencies(std::cout);
+    if (options.stats)
+        daemon.write_statistics(std::cout);
+}
+
+#else
+
+void run_daemon(const std::function<std::unique_ptr<rigol::connection>()> &, const std::string &,
+                const capture_request &, const daemon_options &)
+{
+    throw std::runtime_error("Daemon mode is only supported on unix platforms");
+}
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "capture.h"
+#include "connection.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+// Keeps one scope connection open and serves capture requests on a unix domain socket, one
+// request line per client connection:
+//
+//   capture channels=12 trigger=single format=mat|mat73|npy|raw|packed|container zlib=3 out=/data/run1.mat
+//           [frames=N] [shuffle=1] [decimate=N [decimate_taps=32] [cutoff=0.8]]
+//           [logic=1 [logic_lines=1] [logic_edges=1]]
+//           [layout=separate|combined] [preview=16,256] [stats=1] [events=rising threshold=V hysteresis=V window=pre,post]
+//           [spectrum=4096 [spectrum_window=hann] [overlap=0.5]] [threads=N]
+//           [unchanged=TOLERANCE [delta=KEYFRAME_INTERVAL]] [memory_budget=SIZE] [io=uring|thread] [direct=1]
+//           [refresh=1]
+//   refresh channels=1234
+//   ping
+//   quit
+//
+// Each request is answered by a single line, either "ok key=value ..." (captures report their
+// timings in milliseconds, the deepest output write queue, the mean write latency and whether nothing
+// was written because no channel changed since the last capture, with a memory budget also the
+// planned footprint and the peak RSS while downloading and writing in MiB) or "error <message>".
+// Capture buffers are kept between requests, sized from the scope's memory depth.
+struct daemon_options
+{
+    bool huge_pages = false;
+    // Capture buffers are sized for the default request and locked, latency histograms are printed on quit
+    bool realtime = false;
+    // Connection statistics are printed on quit
+    bool stats = false;
+    // Prometheus textfile rewritten after every capture, and its instance label
+    std::string prometheus;
+    std::string instance;
+};
+
+void run_daemon(const std::function<std::unique_ptr<rigol::connection>()> &connect, const std::string &socket_path,
+                const capture_request &defaults, const daemon_options &options = {});
@@ -0,0 +1,206 @@
+#include "decimation.h"
+#include "realtime.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <spdlog/fmt/fmt.h>
+#include <stdexcept>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    constexpr double PI = 3.14159265358979323846;
+    // Two SSE registers
+    constexpr std::size_t WIDTH = 8;
+
+    // `count` is a multiple of WIDTH
+    inline float dot(const float *x, const float *h, std::size_t count)
+    {
+#ifdef __SSE2__
+        __m128 a = _mm_setzero_ps();
+        __m128 b = _mm_setzero_ps();
+        for (std::size_t i = 0; i < count; i += WIDTH)
+        {
+            a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i)));
+            b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(h + i + 4)));
+        }
+        a = _mm_add_ps(a, b);
+        a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+        a = _mm_add_ss(a, _mm_shuffle_ps(a, a, 1));
+        return _mm_cvtss_f32(a);
+#else
+        float sum = 0;
+        for (std::size_t i = 0; i < count; i++)
+            sum += x[i] * h[i];
+        return sum;
+#endif
+    }
+} // namespace
+
+void check_decimation_settings(const decimation_settings &settings)
+{
+    if (settings.factor < 2)
+        throw std::invalid_argument(fmt::format("Decimation factor {} is not at least 2", settings.factor));
+    if (settings.taps < 2)
+        throw std::invalid_argument(fmt::format("{} taps per decimation phase are not at least 2", settings.taps));
+    if (!(settings.cutoff > 0 && settings.cutoff <= 1))
+        throw std::invalid_argument(fmt::format("Decimation cutoff {} is not in (0, 1]", settings.cutoff));
+}
+
+rigol::preamble decimated_preamble(const rigol::preamble &pre, std::size_t factor)
+{
+    rigol::preamble decimated = pre;
+    decimated.points = decimated_points(pre.points, factor);
+    decimated.x_increment = pre.x_increment * factor;
+    decimated.x_reference = pre.x_reference / factor;
+    return decimated;
+}
+
+fir_decimator::fir_decimator(const decimation_settings &settings) : m_factor(settings.factor)
+{
+    check_decimation_settings(settings);
+
+    const std::size_t length = settings.factor * settings.taps / 2 * 2 + 1;
+    m_delay = length / 2;
+    m_taps.assign((length + WIDTH - 1) / WIDTH * WIDTH, 0);
+
+    // Cutoff in cycles per input sample
+    const double fc = settings.cutoff * 0.5 / settings.factor;
+    double sum = 0;
+    for (std::size_t n = 0; n < length; n++)
+    {
+        const double t = double(n) - double(m_delay);
+        const double sinc = t == 0 ? 2 * fc : std::sin(2 * PI * fc * t) / (PI * t);
+        const double x = 2 * PI * n / (length - 1);
+        const double window = 0.42 - 0.5 * std::cos(x) + 0.08 * std::cos(2 * x);
+        m_taps[n] = (float)(sinc * window);
+        sum += m_taps[n];
+    }
+
+    // Unity gain at DC, a constant code stays the same code
+    for (float &tap : m_taps)
+        tap = (float)(tap / sum);
+}
+
+void fir_decimator::reset()
+{
+    m_pending.clear();
+    m_received = 0;
+    m_emitted = 0;
+}
+
+std::size_t fir_decimator::emit(float *out)
+{
+    std::size_t written = 0;
+    std::size_t pos = 0;
+    while (pos + m_taps.size() <= m_pending.size())
+    {
+        out[written++] = dot(m_pending.data() + pos, m_taps.data(), m_taps.size());
+        pos += m_factor;
+    }
+
+    m_pending.erase(m_pending.begin(), m_pending.begin() + std::min(pos, m_pending.size()));
+    m_emitted += written;
+    return written;
+}
+
+std::size_t fir_decimator::push(const uint8_t *codes, std::size_t count, float *out)
+{
+    if (count == 0)
+        return 0;
+    if (m_received == 0)
+        m_pending.assign(m_delay, codes[0]);
+
+    m_pending.insert(m_pending.end(), codes, codes + count);
+    m_received += count;
+    m_last = codes[count - 1];
+    return emit(out);
+}
+
+std::size_t fir_decimator::finish(float *out)
+{
+    if (m_received == 0)
+        return 0;
+
+    // Enough copies of the last sample for the window of the last output
+    m_pending.insert(m_pending.end(), m_taps.size() - 1 - m_delay, m_last);
+    const std::size_t written = emit(out);
+    if (m_emitted != decimated_points(m_received, m_factor))
+        throw std::logic_error(fmt::format("Decimated {} samples into {} outputs, expected {}", m_received,
+                                           m_emitted, decimated_points(m_received, m_factor)));
+    return written;
+}
+
+void decimation_worker::run()
+{
+    realtime::worker_thread();
+    try
+    {
+        rigol::trace::span span{"decimation", "convert"};
+        std::size_t done = 0;
+        std::size_t written = 0;
+        while (done < m_count)
+        {
+            std::size_t available = 0;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_arrived.wait(lock, [&] { return m_cancel || m_available > done; });
+                if (m_cancel)
+                    return;
+                available = m_available;
+            }
+
+            written += m_filter.push(m_input + done, available - done, m_output + written);
+            done = available;
+        }
+        m_filter.finish(m_output + written);
+    }
+    catch (...)
+    {
+        m_error = std::current_exception();
+    }
+}
+
+decimation_worker::~decimation_worker()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancel = true;
+    }
+    m_arrived.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void decimation_worker::start(const uint8_t *input, std::size_t count, float *output)
+{
+    wait();
+    m_filter.reset();
+    m_input = input;
+    m_count = count;
+    m_available = 0;
+    m_output = output;
+    m_thread = std::thread(&decimation_worker::run, this);
+}
+
+void decimation_worker::arrived(std::size_t available)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_available = std::min(available, m_count);
+    }
+    m_arrived.notify_all();
+}
+
+void decimation_worker::wait()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+    if (m_error)
+        std::rethrow_exception(std::exchange(m_error, nullptr));
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "scope.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct decimation_settings
+{
+    // Only every factor-th filtered sample is kept
+    std::size_t factor = 1;
+    // Taps per polyphase branch, the whole filter has factor * taps + 1
+    std::size_t taps = 32;
+    // Edge of the passband (the filter's -6 dB point) as a fraction of the decimated Nyquist frequency
+    double cutoff = 0.8;
+};
+
+// Throws std::invalid_argument for settings fir_decimator cannot use
+void check_decimation_settings(const decimation_settings &settings);
+// Samples left of a waveform of `points` samples, the first one and every factor-th after it
+inline std::size_t decimated_points(std::size_t points, std::size_t factor) { return (points + factor - 1) / factor; }
+// Preamble describing the decimated samples of a waveform `pre` describes
+rigol::preamble decimated_preamble(const rigol::preamble &pre, std::size_t factor);
+
+// Anti-aliasing low pass (Blackman windowed sinc) and decimation of a waveform that arrives in
+// pieces. Only the kept outputs are computed, which is the work of the polyphase decomposition, each
+// as one dot product over contiguous samples so it vectorises. The filter is centred on the kept
+// sample, so no delay shows in the time axis, and both ends of the waveform are extended with their
+// first and last sample. Outputs are codes, scaled like the raw ones.
+class fir_decimator
+{
+    std::size_t m_factor;
+    std::size_t m_delay;
+    // Padded with zeros to a multiple of the vector width
+    std::vector<float> m_taps;
+    // Input from the start of the next output's window on
+    std::vector<float> m_pending;
+    std::size_t m_received = 0;
+    std::size_t m_emitted = 0;
+    float m_last = 0;
+
+    std::size_t emit(float *out);
+
+  public:
+    explicit fir_decimator(const decimation_settings &settings);
+
+    // Starts a new waveform
+    void reset();
+    // Filters the next `count` codes, writes the outputs they complete to `out` and returns how many
+    std::size_t push(const uint8_t *codes, std::size_t count, float *out);
+    // Ends the waveform, writes the remaining outputs
+    std::size_t finish(float *out);
+
+    std::size_t factor() const { return m_factor; }
+    std::size_t taps() const { return 2 * m_delay + 1; }
+};
+
+// Decimates a download on a helper thread while it is still arriving, so filtering one channel
+// overlaps the download of the next. One download at a time, start() waits for the previous one.
+class decimation_worker
+{
+    fir_decimator m_filter;
+    std::mutex m_mutex;
+    std::condition_variable m_arrived;
+    const uint8_t *m_input = nullptr;
+    std::size_t m_count = 0;
+    std::size_t m_available = 0;
+    float *m_output = nullptr;
+    bool m_cancel = false;
+    std::exception_ptr m_error;
+    std::thread m_thread;
+
+    void run();
+
+  public:
+    explicit decimation_worker(const decimation_settings &settings) : m_filter(settings) {}
+    decimation_worker(const decimation_worker &) = delete;
+    decimation_worker &operator=(const decimation_worker &) = delete;
+    // Abandons a download that never completed
+    ~decimation_worker();
+
+    // Filters the `count` codes that are going to arrive at `input` into decimated_points(count)
+    // floats at `output`
+    void start(const uint8_t *input, std::size_t count, float *output);
+    // The first `available` codes are in place
+    void arrived(std::size_t available);
+    // Waits until the last download is filtered, rethrows what filtering threw
+    void wait();
+
+    std::size_t factor() const { return m_filter.factor(); }
+    std::size_t taps() const { return m_filter.taps(); }
+};
@@ -0,0 +1,117 @@
+#include "events.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <spdlog/fmt/fmt.h>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    int trailing_zeros(unsigned mask)
+    {
+#if defined(__GNUC__)
+        return __builtin_ctz(mask);
+#else
+        int n = 0;
+        while (!(mask & 1))
+        {
+            mask >>= 1;
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    // Index of the first sample >= `value` (or <= `value` when `below`) at or after `from`, `count` if none
+    template <bool below>
+    std::size_t find_crossing(const uint8_t *data, std::size_t from, std::size_t count, uint8_t value)
+    {
+        std::size_t i = from;
+
+#ifdef __SSE2__
+        const __m128i limit = _mm_set1_epi8((char)value);
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+            const __m128i clamped = below ? _mm_min_epu8(v, limit) : _mm_max_epu8(v, limit);
+            const unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(clamped, v));
+            if (mask)
+                return i + trailing_zeros(mask);
+        }
+#endif
+
+        for (; i < count; i++)
+        {
+            if (below ? data[i] <= value : data[i] >= value)
+                return i;
+        }
+        return count;
+    }
+
+    int to_code(double volts, const rigol::preamble &pre)
+    {
+        return (int)std::floor(std::clamp(volts / pre.y_increment + pre.y_origin + pre.y_reference, 0.0, 255.0));
+    }
+} // namespace
+
+std::vector<std::size_t> find_events(const uint8_t *data, std::size_t count, const rigol::preamble &pre,
+                                     const event_settings &settings)
+{
+    // Keep the band at least one code wide so noise sitting exactly on the threshold is not an edge
+    const int high = std::clamp(to_code(settings.threshold + settings.hysteresis, pre) + 1, 1, 255);
+    const int low = std::min(high - 1, to_code(settings.threshold - settings.hysteresis, pre));
+
+    std::vector<std::size_t> events;
+    const std::size_t first_high = find_crossing<false>(data, 0, count, (uint8_t)high);
+    const std::size_t first_low = find_crossing<true>(data, 0, count, (uint8_t)low);
+    bool above = first_high < first_low;
+    std::size_t i = std::min(first_high, first_low);
+
+    while (i < count)
+    {
+        i = above ? find_crossing<true>(data, i, count, (uint8_t)low)
+                  : find_crossing<false>(data, i, count, (uint8_t)high);
+        if (i == count)
+            break;
+
+        above = !above;
+        if (settings.edge == event_edge::BOTH || (settings.edge == event_edge::RISING) == above)
+            events.push_back(i);
+    }
+
+    return events;
+}
+
+event_edge parse_edge(const std::string &value)
+{
+    if (value == "rising")
+        return event_edge::RISING;
+    if (value == "falling")
+        return event_edge::FALLING;
+    if (value == "both")
+        return event_edge::BOTH;
+
+    throw std::invalid_argument(fmt::format("'{}' is not a valid edge, expected rising, falling or both", value));
+}
+
+void parse_event_window(const std::string &value, event_settings &settings)
+{
+    const std::size_t comma = value.find(',');
+    const std::string pre = value.substr(0, comma);
+    const std::string post = comma == std::string::npos ? std::string{} : value.substr(comma + 1);
+
+    char *pre_end = nullptr;
+    char *post_end = nullptr;
+    const unsigned long pre_samples = std::strtoul(pre.c_str(), &pre_end, 10);
+    const unsigned long post_samples = std::strtoul(post.c_str(), &post_end, 10);
+    if (pre.empty() || post.empty() || *pre_end != '\0' || *post_end != '\0' || pre_samples + post_samples == 0)
+        throw std::invalid_argument(fmt::format("'{}' is not a valid event window, expected pre,post", value));
+
+    settings.pre = pre_samples;
+    settings.post = post_samples;
+}
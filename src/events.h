@@ -0,0 +1,36 @@
+#pragma once
+
+#include "scope.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class event_edge
+{
+    RISING,
+    FALLING,
+    BOTH,
+};
+
+struct event_settings
+{
+    event_edge edge = event_edge::RISING;
+    // Both in volts, a rising event needs the signal to go from below threshold - hysteresis to above
+    // threshold + hysteresis and vice versa
+    double threshold = 0;
+    double hysteresis = 0;
+    // Samples kept before and after every event
+    std::size_t pre = 1000;
+    std::size_t post = 1000;
+};
+
+// Returns sample indices of all threshold crossings in `data`, the first excursion out of the
+// hysteresis band only establishes the initial state and is not an event
+std::vector<std::size_t> find_events(const uint8_t *data, std::size_t count, const rigol::preamble &preamble,
+                                     const event_settings &settings);
+
+event_edge parse_edge(const std::string &value);
+// "pre,post" in samples
+void parse_event_window(const std::string &value, event_settings &settings);
@@ -0,0 +1,191 @@
+#include "fft.h"
+
+#include <cmath>
+#include <spdlog/fmt/fmt.h>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    constexpr double PI = 3.14159265358979323846;
+
+    // Two radix-2 stages in one pass: a, b, c, d are `half` apart, the first stage combines a with b
+    // and c with d using W(2 * half)^j, the second the results a with c and b with d using
+    // W(4 * half)^j and -i W(4 * half)^j
+    inline void butterfly(double *re, double *im, std::size_t half, double w2r, double w2i, double w4r, double w4i)
+    {
+        double *r0 = re, *r1 = re + half, *r2 = re + 2 * half, *r3 = re + 3 * half;
+        double *i0 = im, *i1 = im + half, *i2 = im + 2 * half, *i3 = im + 3 * half;
+
+        const double br = *r1 * w2r - *i1 * w2i, bi = *r1 * w2i + *i1 * w2r;
+        const double dr = *r3 * w2r - *i3 * w2i, di = *r3 * w2i + *i3 * w2r;
+        const double a1r = *r0 + br, a1i = *i0 + bi, b1r = *r0 - br, b1i = *i0 - bi;
+        const double c1r = *r2 + dr, c1i = *i2 + di, d1r = *r2 - dr, d1i = *i2 - di;
+
+        const double cr = c1r * w4r - c1i * w4i, ci = c1r * w4i + c1i * w4r;
+        // -i * W * d
+        const double er = d1r * w4i + d1i * w4r, ei = -(d1r * w4r - d1i * w4i);
+
+        *r0 = a1r + cr, *i0 = a1i + ci;
+        *r2 = a1r - cr, *i2 = a1i - ci;
+        *r1 = b1r + er, *i1 = b1i + ei;
+        *r3 = b1r - er, *i3 = b1i - ei;
+    }
+
+#ifdef __SSE2__
+    // Same for two consecutive j
+    inline void butterfly2(double *re, double *im, std::size_t half, const double *w2r, const double *w2i,
+                           const double *w4r, const double *w4i)
+    {
+        const __m128d wr2 = _mm_loadu_pd(w2r), wi2 = _mm_loadu_pd(w2i);
+        const __m128d wr4 = _mm_loadu_pd(w4r), wi4 = _mm_loadu_pd(w4i);
+
+        const __m128d ar = _mm_loadu_pd(re), ai = _mm_loadu_pd(im);
+        const __m128d xr = _mm_loadu_pd(re + half), xi = _mm_loadu_pd(im + half);
+        const __m128d yr = _mm_loadu_pd(re + 2 * half), yi = _mm_loadu_pd(im + 2 * half);
+        const __m128d zr = _mm_loadu_pd(re + 3 * half), zi = _mm_loadu_pd(im + 3 * half);
+
+        const __m128d br = _mm_sub_pd(_mm_mul_pd(xr, wr2), _mm_mul_pd(xi, wi2));
+        const __m128d bi = _mm_add_pd(_mm_mul_pd(xr, wi2), _mm_mul_pd(xi, wr2));
+        const __m128d dr = _mm_sub_pd(_mm_mul_pd(zr, wr2), _mm_mul_pd(zi, wi2));
+        const __m128d di = _mm_add_pd(_mm_mul_pd(zr, wi2), _mm_mul_pd(zi, wr2));
+
+        const __m128d a1r = _mm_add_pd(ar, br), a1i = _mm_add_pd(ai, bi);
+        const __m128d b1r = _mm_sub_pd(ar, br), b1i = _mm_sub_pd(ai, bi);
+        const __m128d c1r = _mm_add_pd(yr, dr), c1i = _mm_add_pd(yi, di);
+        const __m128d d1r = _mm_sub_pd(yr, dr), d1i = _mm_sub_pd(yi, di);
+
+        const __m128d cr = _mm_sub_pd(_mm_mul_pd(c1r, wr4), _mm_mul_pd(c1i, wi4));
+        const __m128d ci = _mm_add_pd(_mm_mul_pd(c1r, wi4), _mm_mul_pd(c1i, wr4));
+        const __m128d er = _mm_add_pd(_mm_mul_pd(d1r, wi4), _mm_mul_pd(d1i, wr4));
+        const __m128d ei = _mm_sub_pd(_mm_mul_pd(d1i, wi4), _mm_mul_pd(d1r, wr4));
+
+        _mm_storeu_pd(re, _mm_add_pd(a1r, cr));
+        _mm_storeu_pd(im, _mm_add_pd(a1i, ci));
+        _mm_storeu_pd(re + 2 * half, _mm_sub_pd(a1r, cr));
+        _mm_storeu_pd(im + 2 * half, _mm_sub_pd(a1i, ci));
+        _mm_storeu_pd(re + half, _mm_add_pd(b1r, er));
+        _mm_storeu_pd(im + half, _mm_add_pd(b1i, ei));
+        _mm_storeu_pd(re + 3 * half, _mm_sub_pd(b1r, er));
+        _mm_storeu_pd(im + 3 * half, _mm_sub_pd(b1i, ei));
+    }
+#endif
+} // namespace
+
+fft::fft(std::size_t size) : m_size(size), m_half(size / 2)
+{
+    if (size < 4 || (size & (size - 1)))
+        throw std::invalid_argument(fmt::format("FFT size {} is not a power of two of at least 4", size));
+
+    unsigned bits = 0;
+    while ((std::size_t(1) << bits) < m_half)
+        bits++;
+
+    m_reverse.resize(m_half);
+    for (std::size_t n = 0; n < m_half; n++)
+    {
+        std::size_t r = 0;
+        for (unsigned b = 0; b < bits; b++)
+            r |= ((n >> b) & 1) << (bits - 1 - b);
+        m_reverse[n] = r;
+    }
+
+    m_radix2 = bits % 2 == 1;
+    for (std::size_t half = m_radix2 ? 2 : 1; 4 * half <= m_half; half *= 4)
+    {
+        stage s{half, {}, {}, {}, {}};
+        for (std::size_t j = 0; j < half; j++)
+        {
+            s.w4_re.push_back(std::cos(-2 * PI * j / (4 * half)));
+            s.w4_im.push_back(std::sin(-2 * PI * j / (4 * half)));
+            s.w2_re.push_back(std::cos(-2 * PI * j / (2 * half)));
+            s.w2_im.push_back(std::sin(-2 * PI * j / (2 * half)));
+        }
+        m_stages.push_back(std::move(s));
+    }
+
+    for (std::size_t k = 0; k <= m_half; k++)
+    {
+        m_unpack_re.push_back(std::cos(-2 * PI * k / m_size));
+        m_unpack_im.push_back(std::sin(-2 * PI * k / m_size));
+    }
+}
+
+void fft::forward(const double *in, workspace &work) const
+{
+    work.re.resize(m_half);
+    work.im.resize(m_half);
+    double *re = work.re.data();
+    double *im = work.im.data();
+
+    // Even samples are the real, odd ones the imaginary part
+    for (std::size_t n = 0; n < m_half; n++)
+    {
+        re[m_reverse[n]] = in[2 * n];
+        im[m_reverse[n]] = in[2 * n + 1];
+    }
+
+    if (m_radix2)
+    {
+        for (std::size_t i = 0; i < m_half; i += 2)
+        {
+            const double ar = re[i], ai = im[i];
+            re[i] = ar + re[i + 1], im[i] = ai + im[i + 1];
+            re[i + 1] = ar - re[i + 1], im[i + 1] = ai - im[i + 1];
+        }
+    }
+
+    for (const stage &s : m_stages)
+    {
+        const std::size_t h = s.half;
+        for (std::size_t g = 0; g < m_half; g += 4 * h)
+        {
+            std::size_t j = 0;
+#ifdef __SSE2__
+            for (; j + 2 <= h; j += 2)
+                butterfly2(re + g + j, im + g + j, h, &s.w2_re[j], &s.w2_im[j], &s.w4_re[j], &s.w4_im[j]);
+#endif
+            for (; j < h; j++)
+                butterfly(re + g + j, im + g + j, h, s.w2_re[j], s.w2_im[j], s.w4_re[j], s.w4_im[j]);
+        }
+    }
+}
+
+template <typename Sink> void fft::unpack(const workspace &work, Sink &&sink) const
+{
+    const double *re = work.re.data();
+    const double *im = work.im.data();
+
+    // X[k] = E[k] + W^k O[k] with E and O the spectra of the even and odd samples, recovered from
+    // Z[k] and conj(Z[half - k])
+    for (std::size_t k = 0; k <= m_half; k++)
+    {
+        const std::size_t a = k == m_half ? 0 : k;
+        const std::size_t b = k == 0 ? 0 : m_half - k;
+        const double zr = re[a], zi = im[a];
+        const double yr = re[b], yi = -im[b];
+
+        const double er = 0.5 * (zr + yr), ei = 0.5 * (zi + yi);
+        const double or_ = 0.5 * (zi - yi), oi = -0.5 * (zr - yr);
+        const double wr = m_unpack_re[k], wi = m_unpack_im[k];
+        sink(k, er + wr * or_ - wi * oi, ei + wr * oi + wi * or_);
+    }
+}
+
+void fft::transform(const double *in, double *re, double *im, workspace &work) const
+{
+    forward(in, work);
+    unpack(work, [&](std::size_t k, double xr, double xi) {
+        re[k] = xr;
+        im[k] = xi;
+    });
+}
+
+void fft::add_power(const double *in, double *power, workspace &work) const
+{
+    forward(in, work);
+    unpack(work, [&](std::size_t k, double xr, double xi) { power[k] += xr * xr + xi * xi; });
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Real input FFT of a fixed power of two size. The real signal is packed into a complex one of half
+// the size, transformed with radix-4 stages (plus one radix-2 stage for odd powers) on split real
+// and imaginary arrays and unpacked into the one-sided spectrum.
+class fft
+{
+    struct stage
+    {
+        std::size_t half;
+        // W(4 * half)^j and W(2 * half)^j for j < half
+        std::vector<double> w4_re, w4_im, w2_re, w2_im;
+    };
+
+    std::size_t m_size;
+    std::size_t m_half;
+    std::vector<std::size_t> m_reverse;
+    std::vector<stage> m_stages;
+    bool m_radix2;
+    // W(size)^k for the real unpacking, k <= size / 2
+    std::vector<double> m_unpack_re, m_unpack_im;
+
+  public:
+    // Scratch space of one transform, one per thread
+    struct workspace
+    {
+        std::vector<double> re, im;
+    };
+
+  private:
+    // Complex transform of the packed signal into `work`
+    void forward(const double *in, workspace &work) const;
+    template <typename Sink> void unpack(const workspace &work, Sink &&sink) const;
+
+  public:
+    explicit fft(std::size_t size);
+
+    std::size_t size() const { return m_size; }
+    std::size_t bins() const { return m_size / 2 + 1; }
+
+    // One-sided spectrum of `size()` real samples, `bins()` values written to `re` and `im`
+    void transform(const double *in, double *re, double *im, workspace &work) const;
+    // Adds |X[k]|^2 of `size()` real samples to `power`
+    void add_power(const double *in, double *power, workspace &work) const;
+};
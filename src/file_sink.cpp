@@ -0,0 +1,573 @@
+#include "file_sink.h"
+#include "realtime.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING
+#endif
+#endif
+
+namespace
+{
+    // O_DIRECT needs block aligned sizes and offsets, 4096 covers every common block size
+    constexpr std::size_t DIRECT_ALIGNMENT = 4096;
+
+#ifdef __unix__
+    int open_file(const std::string &path, bool direct)
+    {
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef O_DIRECT
+        if (direct)
+            flags |= O_DIRECT;
+#else
+        (void)direct;
+#endif
+        return ::open(path.c_str(), flags, 0644);
+    }
+
+    int write_at(int fd, const char *data, std::size_t size, std::uint64_t offset)
+    {
+        while (size > 0)
+        {
+            const ssize_t ret = pwrite(fd, data, size, offset);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            if (ret == -1)
+                return errno;
+            data += ret;
+            size -= ret;
+            offset += ret;
+        }
+        return 0;
+    }
+
+    int truncate_file(int fd, std::uint64_t size) { return ftruncate(fd, size) == -1 ? errno : 0; }
+    int close_file(int fd) { return ::close(fd) == -1 ? errno : 0; }
+#else
+    int open_file(const std::string &path, bool)
+    {
+        return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+    }
+
+    // Only ever called from the single writer thread, so seeking first is safe
+    int write_at(int fd, const char *data, std::size_t size, std::uint64_t offset)
+    {
+        if (_lseeki64(fd, offset, SEEK_SET) == -1)
+            return errno;
+        while (size > 0)
+        {
+            const int ret = _write(fd, data, (unsigned)std::min<std::size_t>(size, 1 << 30));
+            if (ret == -1)
+                return errno;
+            data += ret;
+            size -= ret;
+        }
+        return 0;
+    }
+
+    int truncate_file(int fd, std::uint64_t size) { return _chsize_s(fd, size); }
+    int close_file(int fd) { return _close(fd) == -1 ? errno : 0; }
+#endif
+} // namespace
+
+struct write_completion
+{
+    std::size_t slot;
+    // errno value, 0 on success
+    int error;
+    std::chrono::steady_clock::time_point finished;
+};
+
+class write_queue
+{
+  public:
+    using completion = write_completion;
+
+    virtual ~write_queue() = default;
+
+    // At most file_sink::QUEUE_DEPTH writes are submitted at any time
+    virtual void submit(std::size_t slot, const char *data, std::size_t size, std::uint64_t offset) = 0;
+    // Blocks until one submitted write has completely finished
+    virtual completion wait() = 0;
+    // Returns a finished write if there is one, without blocking
+    virtual bool poll(completion &c) = 0;
+};
+
+namespace
+{
+    class thread_queue : public write_queue
+    {
+        struct request
+        {
+            std::size_t slot;
+            const char *data;
+            std::size_t size;
+            std::uint64_t offset;
+        };
+
+        int m_fd;
+        std::mutex m_mutex;
+        std::condition_variable m_changed;
+        std::deque<request> m_requests;
+        std::deque<completion> m_completions;
+        bool m_stop = false;
+        std::thread m_thread;
+
+        void run()
+        {
+            realtime::worker_thread();
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true)
+            {
+                m_changed.wait(lock, [this] { return m_stop || !m_requests.empty(); });
+                if (m_requests.empty())
+                    return;
+
+                const request r = m_requests.front();
+                m_requests.pop_front();
+                lock.unlock();
+                const int error = write_at(m_fd, r.data, r.size, r.offset);
+                lock.lock();
+                m_completions.push_back({r.slot, error, std::chrono::steady_clock::now()});
+                m_changed.notify_all();
+            }
+        }
+
+      public:
+        explicit thread_queue(int fd) : m_fd(fd), m_thread(&thread_queue::run, this) {}
+
+        ~thread_queue()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_changed.notify_all();
+            m_thread.join();
+        }
+
+        void submit(std::size_t slot, const char *data, std::size_t size, std::uint64_t offset) override
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_requests.push_back({slot, data, size, offset});
+            }
+            m_changed.notify_all();
+        }
+
+        completion wait() override
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_changed.wait(lock, [this] { return !m_completions.empty(); });
+            const completion c = m_completions.front();
+            m_completions.pop_front();
+            return c;
+        }
+
+        bool poll(completion &c) override
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_completions.empty())
+                return false;
+            c = m_completions.front();
+            m_completions.pop_front();
+            return true;
+        }
+    };
+
+#ifdef HAVE_IO_URING
+    // Talks to the kernel through the raw system calls and the shared rings, so there is no
+    // dependency on liburing
+    class uring_queue : public write_queue
+    {
+        struct pending
+        {
+            const char *data;
+            std::size_t size;
+            std::uint64_t offset;
+        };
+
+        int m_fd;
+        int m_ring = -1;
+        void *m_sq_ring = MAP_FAILED;
+        void *m_cq_ring = MAP_FAILED;
+        std::size_t m_sq_ring_size = 0;
+        std::size_t m_cq_ring_size = 0;
+        io_uring_sqe *m_sqes = (io_uring_sqe *)MAP_FAILED;
+        std::size_t m_sqes_size = 0;
+
+        unsigned *m_sq_tail;
+        unsigned *m_sq_mask;
+        unsigned *m_sq_array;
+        unsigned *m_cq_head;
+        unsigned *m_cq_tail;
+        unsigned *m_cq_mask;
+        io_uring_cqe *m_cqes;
+
+        std::vector<pending> m_pending;
+
+        void release()
+        {
+            if (m_sqes != MAP_FAILED)
+                munmap(m_sqes, m_sqes_size);
+            if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+                munmap(m_cq_ring, m_cq_ring_size);
+            if (m_sq_ring != MAP_FAILED)
+                munmap(m_sq_ring, m_sq_ring_size);
+            if (m_ring != -1)
+                close(m_ring);
+        }
+
+        void *map(std::size_t size, off_t offset)
+        {
+            void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, offset);
+            if (p == MAP_FAILED)
+            {
+                const int error = errno;
+                release();
+                throw std::system_error(error, std::system_category(), "Cannot map io_uring");
+            }
+            return p;
+        }
+
+        int enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+        {
+            return (int)syscall(__NR_io_uring_enter, m_ring, to_submit, min_complete, flags, nullptr, 0);
+        }
+
+        void push(std::size_t slot)
+        {
+            const pending &p = m_pending[slot];
+            const unsigned tail = *m_sq_tail;
+            const unsigned index = tail & *m_sq_mask;
+
+            io_uring_sqe &sqe = m_sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_WRITE;
+            sqe.fd = m_fd;
+            sqe.addr = (std::uint64_t)(uintptr_t)p.data;
+            sqe.len = (std::uint32_t)p.size;
+            sqe.off = p.offset;
+            sqe.user_data = slot;
+            m_sq_array[index] = index;
+            __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+            while (enter(1, 0, 0) == -1)
+            {
+                if (errno != EINTR)
+                    throw std::system_error(errno, std::system_category(), "Cannot submit to io_uring");
+            }
+        }
+
+      public:
+        uring_queue(int fd, unsigned entries) : m_fd(fd), m_pending(entries)
+        {
+            io_uring_params params = {};
+            m_ring = (int)syscall(__NR_io_uring_setup, entries, &params);
+            if (m_ring == -1)
+                throw std::system_error(errno, std::system_category(), "Cannot set up io_uring");
+
+            m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+                m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+
+            m_sq_ring = map(m_sq_ring_size, IORING_OFF_SQ_RING);
+            m_cq_ring =
+                (params.features & IORING_FEAT_SINGLE_MMAP) ? m_sq_ring : map(m_cq_ring_size, IORING_OFF_CQ_RING);
+            m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            m_sqes = (io_uring_sqe *)map(m_sqes_size, IORING_OFF_SQES);
+
+            char *sq = (char *)m_sq_ring;
+            m_sq_tail = (unsigned *)(sq + params.sq_off.tail);
+            m_sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+            m_sq_array = (unsigned *)(sq + params.sq_off.array);
+
+            char *cq = (char *)m_cq_ring;
+            m_cq_head = (unsigned *)(cq + params.cq_off.head);
+            m_cq_tail = (unsigned *)(cq + params.cq_off.tail);
+            m_cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+            m_cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        }
+
+        ~uring_queue() { release(); }
+
+        void submit(std::size_t slot, const char *data, std::size_t size, std::uint64_t offset) override
+        {
+            m_pending[slot] = {data, size, offset};
+            push(slot);
+        }
+
+        completion wait() override
+        {
+            completion c;
+            while (!poll(c))
+            {
+                if (enter(0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+                    throw std::system_error(errno, std::system_category(), "Cannot wait for io_uring");
+            }
+            return c;
+        }
+
+        // The ring carries no timestamps, a write counts as finished when its completion is seen
+        bool poll(completion &c) override
+        {
+            while (true)
+            {
+                const unsigned head = *m_cq_head;
+                if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+                    return false;
+
+                const io_uring_cqe cqe = m_cqes[head & *m_cq_mask];
+                __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+
+                const std::size_t slot = cqe.user_data;
+                c = {slot, cqe.res < 0 ? -cqe.res : 0, std::chrono::steady_clock::now()};
+                if (cqe.res < 0)
+                    return true;
+
+                // Short writes are continued until the whole buffer is on disk
+                pending &p = m_pending[slot];
+                if ((std::size_t)cqe.res < p.size)
+                {
+                    if (cqe.res == 0)
+                    {
+                        c.error = EIO;
+                        return true;
+                    }
+                    p.data += cqe.res;
+                    p.size -= cqe.res;
+                    p.offset += cqe.res;
+                    push(slot);
+                    continue;
+                }
+
+                return true;
+            }
+        }
+    };
+#endif
+
+} // namespace
+
+sink_statistics &sink_statistics::operator+=(const sink_statistics &other)
+{
+    writes += other.writes;
+    bytes += other.bytes;
+    max_queue_depth = std::max(max_queue_depth, other.max_queue_depth);
+    total_latency_ms += other.total_latency_ms;
+    max_latency_ms = std::max(max_latency_ms, other.max_latency_ms);
+    return *this;
+}
+
+sink_backend parse_sink_backend(std::string_view value)
+{
+    if (value == "uring")
+        return sink_backend::URING;
+    if (value == "thread")
+        return sink_backend::THREAD;
+    throw std::invalid_argument(fmt::format("'{}' is not a valid output backend, expected uring or thread", value));
+}
+
+file_sink::file_sink(const std::string &path, const sink_settings &settings)
+    : std::ostream(this), m_path(path), m_direct(settings.direct)
+{
+    // Errors thrown by the buffer reach the writer instead of only setting badbit
+    exceptions(std::ios::badbit);
+
+    m_fd = open_file(path, m_direct);
+    if (m_fd == -1 && m_direct && errno == EINVAL)
+    {
+        spdlog::warn("O_DIRECT is not supported for '{}', writing through the page cache", path);
+        m_direct = false;
+        m_fd = open_file(path, false);
+    }
+    if (m_fd == -1)
+        throw std::system_error(errno, std::system_category(), fmt::format("Cannot open output file '{}'", path));
+
+#ifdef HAVE_IO_URING
+    if (settings.backend == sink_backend::URING)
+    {
+        try
+        {
+            m_queue = std::make_unique<uring_queue>(m_fd, QUEUE_DEPTH);
+        }
+        catch (const std::system_error &ex)
+        {
+            spdlog::debug("{}, using a writer thread", ex.what());
+        }
+    }
+#endif
+    if (!m_queue)
+        m_queue = std::make_unique<thread_queue>(m_fd);
+
+    m_slots.resize(QUEUE_DEPTH);
+    for (std::size_t i = 0; i < QUEUE_DEPTH; i++)
+    {
+        m_slots[i].buffer.resize(BUFFER_SIZE);
+        m_free.push_back(QUEUE_DEPTH - 1 - i);
+    }
+    next_buffer();
+}
+
+file_sink::~file_sink()
+{
+    if (m_fd == -1)
+        return;
+
+    // Nothing may still be writing from the buffers once they are released
+    for (std::size_t n = m_in_flight; n > 0; n--)
+    {
+        try
+        {
+            reap();
+        }
+        catch (const std::exception &ex)
+        {
+            spdlog::error("{}", ex.what());
+        }
+    }
+    close_file(m_fd);
+}
+
+void file_sink::submit(std::size_t size)
+{
+    write_completion c;
+    while (m_queue->poll(c))
+        complete(c);
+
+    slot &s = m_slots[m_current];
+    s.submitted = std::chrono::steady_clock::now();
+    m_queue->submit(m_current, s.buffer.data(), size, m_offset);
+    m_offset += size;
+    m_in_flight++;
+    m_statistics.max_queue_depth = std::max(m_statistics.max_queue_depth, m_in_flight);
+}
+
+void file_sink::reap() { complete(m_queue->wait()); }
+
+void file_sink::complete(const write_completion &c)
+{
+    m_in_flight--;
+    m_free.push_back(c.slot);
+
+    if (c.error != 0)
+        throw std::system_error(c.error, std::system_category(),
+                                fmt::format("Cannot write output file '{}'", m_path));
+
+    const double latency = std::chrono::duration<double, std::milli>(c.finished - m_slots[c.slot].submitted).count();
+    m_statistics.writes++;
+    m_statistics.total_latency_ms += latency;
+    m_statistics.max_latency_ms = std::max(m_statistics.max_latency_ms, latency);
+}
+
+void file_sink::next_buffer()
+{
+    if (m_free.empty())
+    {
+        rigol::trace::span span{"write wait", "output"};
+        reap();
+    }
+
+    m_current = m_free.back();
+    m_free.pop_back();
+    char *data = m_slots[m_current].buffer.data();
+    setp(data, data + BUFFER_SIZE);
+}
+
+void file_sink::drain()
+{
+    while (m_in_flight > 0)
+        reap();
+}
+
+int file_sink::overflow(int c)
+{
+    if (m_fd == -1)
+        throw std::logic_error(fmt::format("Tried to write to closed output file '{}'", m_path));
+
+    if (pptr() != pbase())
+    {
+        submit(pptr() - pbase());
+        m_statistics.bytes += pptr() - pbase();
+        next_buffer();
+    }
+
+    if (c != std::streambuf::traits_type::eof())
+    {
+        *pptr() = (char)c;
+        pbump(1);
+    }
+    return std::streambuf::traits_type::not_eof(c);
+}
+
+std::streamsize file_sink::xsputn(const char *s, std::streamsize n)
+{
+    std::streamsize left = n;
+    while (left > 0)
+    {
+        if (pptr() == epptr())
+            overflow(std::streambuf::traits_type::eof());
+
+        const std::streamsize count = std::min<std::streamsize>(left, epptr() - pptr());
+        std::memcpy(pptr(), s, count);
+        pbump((int)count);
+        s += count;
+        left -= count;
+    }
+    return n;
+}
+
+void file_sink::close()
+{
+    if (m_fd == -1)
+        return;
+
+    rigol::trace::span span{"file close", "output"};
+    std::size_t size = pptr() - pbase();
+    const std::uint64_t end = m_offset + size;
+    m_statistics.bytes += size;
+    if (m_direct && size % DIRECT_ALIGNMENT)
+    {
+        const std::size_t padded = (size + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        std::memset(pptr(), 0, padded - size);
+        size = padded;
+    }
+    if (size > 0)
+        submit(size);
+    setp(nullptr, nullptr);
+
+    drain();
+
+    const int fd = m_fd;
+    m_fd = -1;
+    int error = end != m_offset ? truncate_file(fd, end) : 0;
+    const int close_error = close_file(fd);
+    if (!error)
+        error = close_error;
+    if (error)
+        throw std::system_error(error, std::system_category(), fmt::format("Cannot write output file '{}'", m_path));
+}
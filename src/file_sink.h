@@ -0,0 +1,96 @@
+#pragma once
+
+#include "page_buffer.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class sink_backend
+{
+    // io_uring, falling back to THREAD where the kernel does not offer it
+    URING,
+    // A writer thread issuing pwrite
+    THREAD,
+};
+
+struct sink_settings
+{
+    sink_backend backend = sink_backend::URING;
+    // Bypass the page cache, ignored where the file system does not support O_DIRECT
+    bool direct = false;
+};
+
+// Latency runs from submitting a buffer to its write finishing. io_uring completions carry no
+// timestamp, so there it is taken when the sink next looks at the ring, an upper bound.
+struct sink_statistics
+{
+    std::size_t writes = 0;
+    std::uint64_t bytes = 0;
+    std::size_t max_queue_depth = 0;
+    double total_latency_ms = 0;
+    double max_latency_ms = 0;
+
+    double mean_latency_ms() const { return writes ? total_latency_ms / writes : 0; }
+    sink_statistics &operator+=(const sink_statistics &other);
+};
+
+sink_backend parse_sink_backend(std::string_view value);
+
+class write_queue;
+struct write_completion;
+
+// Output file that collects the stream in page aligned buffers and queues every full buffer for
+// writing in the background, a writer only waits when all buffers are in flight. Write errors are
+// thrown from the write that finds them or from close().
+class file_sink : public std::streambuf, public std::ostream
+{
+    struct slot
+    {
+        page_buffer<char> buffer;
+        std::chrono::steady_clock::time_point submitted;
+    };
+
+    std::string m_path;
+    int m_fd = -1;
+    bool m_direct = false;
+    std::vector<slot> m_slots;
+    std::vector<std::size_t> m_free;
+    std::size_t m_current = 0;
+    std::size_t m_in_flight = 0;
+    std::uint64_t m_offset = 0;
+    sink_statistics m_statistics;
+    // Declared last, destroyed before the buffers it may still be writing from
+    std::unique_ptr<write_queue> m_queue;
+
+    void submit(std::size_t size);
+    void reap();
+    void complete(const write_completion &c);
+    void next_buffer();
+    void drain();
+
+  protected:
+    int overflow(int c) override;
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+
+  public:
+    static constexpr std::size_t BUFFER_SIZE = 1 << 20;
+    static constexpr std::size_t QUEUE_DEPTH = 8;
+
+    explicit file_sink(const std::string &path, const sink_settings &settings = {});
+    file_sink(const file_sink &) = delete;
+    file_sink &operator=(const file_sink &) = delete;
+    ~file_sink();
+
+    // Writes the rest of the data and waits for all writes to finish
+    void close();
+
+    std::size_t queue_depth() const { return m_in_flight; }
+    const sink_statistics &statistics() const { return m_statistics; }
+};
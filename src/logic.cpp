@@ -0,0 +1,69 @@
+#include "logic.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    inline void record(uint16_t changed, std::size_t index, logic_transitions &transitions)
+    {
+        for (unsigned line = 0; changed; line++, changed >>= 1)
+        {
+            if (changed & 1)
+                transitions[line].push_back(index);
+        }
+    }
+} // namespace
+
+void interleave_pods(const uint8_t *low, const uint8_t *high, std::size_t count, uint16_t *out)
+{
+    std::size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i l = _mm_loadu_si128((const __m128i *)(low + i));
+        const __m128i h = _mm_loadu_si128((const __m128i *)(high + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi8(l, h));
+        _mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpackhi_epi8(l, h));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = (uint16_t)(low[i] | high[i] << 8);
+}
+
+void unpack_line(const uint16_t *packed, std::size_t count, unsigned line, uint8_t *out)
+{
+    std::size_t i = 0;
+#ifdef __SSE2__
+    const __m128i shift = _mm_cvtsi32_si128((int)line);
+    const __m128i one = _mm_set1_epi16(1);
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i a = _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128((const __m128i *)(packed + i)), shift), one);
+        const __m128i b =
+            _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128((const __m128i *)(packed + i + 8)), shift), one);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = (uint8_t)((packed[i] >> line) & 1);
+}
+
+void find_transitions(const uint16_t *packed, std::size_t count, logic_transitions &transitions)
+{
+    std::size_t i = 1;
+#ifdef __SSE2__
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i now = _mm_loadu_si128((const __m128i *)(packed + i));
+        const __m128i before = _mm_loadu_si128((const __m128i *)(packed + i - 1));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(now, before)) == 0xFFFF)
+            continue;
+        for (std::size_t j = i; j < i + 8; j++)
+            record(packed[j] ^ packed[j - 1], j, transitions);
+    }
+#endif
+    for (; i < count; i++)
+        record(packed[i] ^ packed[i - 1], i, transitions);
+}
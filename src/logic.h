@@ -0,0 +1,29 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Digital lines D0-D15 of MSO models, kept packed as one uint16 per sample with bit n being Dn
+constexpr std::size_t LOGIC_LINES = 16;
+
+struct logic_settings
+{
+    // Also save every line as its own logical array
+    bool lines = false;
+    // Also save the transitions of every line
+    bool edges = false;
+};
+
+// Sample indices at which each line changes, per line in ascending order
+using logic_transitions = std::array<std::vector<std::size_t>, LOGIC_LINES>;
+
+// Packs the bytes of both pods, `low` holding D0-D7 and `high` D8-D15, into `count` samples
+void interleave_pods(const uint8_t *low, const uint8_t *high, std::size_t count, uint16_t *out);
+// One line of `count` packed samples as 0 and 1 bytes
+void unpack_line(const uint16_t *packed, std::size_t count, unsigned line, uint8_t *out);
+// Appends the index of every sample that differs from the one before it to the lists of the lines
+// that changed. Runs of unchanged samples are skipped eight at a time, so all 16 lines take one
+// pass over the packed samples.
+void find_transitions(const uint16_t *packed, std::size_t count, logic_transitions &transitions);
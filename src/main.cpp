@@ -1,70 +1,25 @@
 #include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <spdlog/spdlog.h>
-#include <thread>
 
+#include "capture.h"
 #include "connection.h"
-#include "mat_writer.h"
+#include "daemon.h"
+#include "memory_budget.h"
+#include "plan.h"
+#include "preview.h"
+#include "realtime.h"
 #include "scope.h"
+#include "trace.h"
 
 #include <cxxopts.hpp>
 #include <fstream>
 #include <spdlog/fmt/ostr.h>
 #include <sstream>
 
-void read_channel_data(rigol::scope &scope, rigol::channel ch, std::vector<std::pair<double, double>> &data)
-{
-    std::vector<uint8_t> buffer;
-    scope.select_channel(ch);
-    scope.read_buffer(buffer);
-
-    double x_origin = scope.x_origin();
-    double x_increment = scope.x_increment();
-    double x_reference = scope.x_reference();
-
-    double y_origin = scope.y_origin();
-    double y_increment = scope.y_increment();
-    double y_reference = scope.y_reference();
-
-    data.resize(buffer.size());
-
-    for (size_t i = 0; i < buffer.size(); i++)
-    {
-        data[i].first = x_origin + (i - x_reference) * x_increment;
-        data[i].second = (buffer[i] - y_reference - y_origin) * y_increment;
-    }
-    spdlog::info("Read {} items", data.size());
-}
-
-enum class trigger_mode
-{
-    STOP,
-    SINGLE,
-};
-
-void wait_for_trigger(rigol::scope &scope, trigger_mode trigger)
-{
-    switch (trigger)
-    {
-    case trigger_mode::STOP:
-        spdlog::info("Stopping the scope");
-        scope.stop();
-        break;
-
-    case trigger_mode::SINGLE:
-        spdlog::info("Arming the scope");
-        scope.single();
-        std::this_thread::sleep_for(std::chrono::milliseconds(400));
-        spdlog::info("Waiting for trigger");
-
-        break;
-    }
-
-    while (scope.get_trigger_state() != rigol::trigger_state::STOP)
-        ;
-}
-
 int main(int argc, char **argv)
 {
     cxxopts::Options options("scope_receiver",
@@ -80,6 +35,40 @@ int main(int argc, char **argv)
         ("c,channels", "Channels to read, list (not separated) of one or more of: 1, 2, 3, 4", cxxopts::value<std::string>()->default_value("1234"))
         ("t,trigger", "Trigger mode, one of: stop, single", cxxopts::value<std::string>())
         ("z,zlib", "use zlib compression, level 1-9", cxxopts::value<int>()->default_value("3"))
+        ("format", "Output format, one of: mat, mat73 (HDF5 based MAT file for captures beyond 2 GB per variable, waveforms only), npy (one file per channel), raw (single file), packed (raw with wavecodec compression), the last three with a JSON sidecar, container (append to a multi-capture file)", cxxopts::value<std::string>()->default_value("mat"))
+        ("layout", "MAT and MAT 7.3 layout, one of: separate (2xN matrix per channel), combined (one Nx(1+C) matrix with a shared time column)", cxxopts::value<std::string>()->default_value("separate"))
+        ("frames", "Record given number of frames with the scope's waveform recording and save them as 3-D arrays", cxxopts::value<std::size_t>()->default_value("1"))
+        ("preview", "Also save min/max previews decimated by given factors (multiples of 16)", cxxopts::value<std::string>()->implicit_value("16,256,4096"))
+        ("waveform-stats", "Also save min/max/mean/RMS/peak-to-peak and a code histogram per channel as CHANNEL_n_stats")
+        ("events", "Save only windows around threshold crossings, one of: rising, falling, both", cxxopts::value<std::string>())
+        ("threshold", "Event threshold in volts", cxxopts::value<double>()->default_value("0"))
+        ("hysteresis", "Event hysteresis in volts, the signal has to leave threshold +- hysteresis", cxxopts::value<double>()->default_value("0"))
+        ("window", "Samples kept before and after every event as pre,post", cxxopts::value<std::string>()->default_value("1000,1000"))
+        ("io", "Output writes, one of: uring (io_uring, falling back to a writer thread), thread", cxxopts::value<std::string>()->default_value("uring"))
+        ("direct", "Write output files with O_DIRECT, bypassing the page cache")
+        ("spectrum", "Save the Welch averaged power spectrum (2 x bins matrix of frequency and V^2/Hz) of every channel instead of the waveform, given samples per segment (power of two)", cxxopts::value<std::size_t>()->implicit_value("4096"))
+        ("spectrum-window", "Spectrum segment window, one of: hann, hamming, blackman, rect", cxxopts::value<std::string>()->default_value("hann"))
+        ("overlap", "Fraction of a spectrum segment shared with the next one", cxxopts::value<double>()->default_value("0.5"))
+        ("threads", "Threads computing spectra or compressing MAT 7.3 chunks, 0 uses all cores", cxxopts::value<unsigned>()->default_value("0"))
+        ("shuffle", "Shuffle the bytes of MAT 7.3 chunks before compressing them")
+        ("skip-unchanged", "Daemon captures skip channels whose codes all stay within given tolerance of the last stored capture, nothing is written when no channel changed", cxxopts::value<unsigned>()->implicit_value("0"))
+        ("delta", "With --skip-unchanged and the container format store changed channels as XOR against a keyframe, a new keyframe after given number of deltas", cxxopts::value<std::size_t>()->implicit_value("100"))
+        ("decimate", "Save MAT and MAT 7.3 waveforms anti-alias filtered and decimated by given factor, filtered while they download", cxxopts::value<std::size_t>())
+        ("decimate-taps", "Filter taps per decimation phase, the filter has factor * taps + 1", cxxopts::value<std::size_t>()->default_value("32"))
+        ("cutoff", "Decimation filter passband edge as a fraction of the decimated Nyquist frequency", cxxopts::value<double>()->default_value("0.8"))
+        ("logic", "Also save the digital lines D0-D15 of MSO models packed into the uint16 LOGIC array (bit n is Dn), with the time of the first sample and the sample interval in LOGIC_time")
+        ("logic-lines", "With --logic also save every line as logical array D0..D15")
+        ("logic-edges", "With --logic also save the transitions of every line as D0_edges..D15_edges, a column of time, new level (and frame) each")
+        ("memory-budget", "Run captures in the fastest way whose buffers fit given size (e.g. 512M, 2G): all channels at once, one at a time, scaled chunk by chunk into the file, fewer MAT 7.3 compressors. Fails before arming when nothing fits", cxxopts::value<std::string>())
+        ("huge-pages", "Back capture buffers with transparent huge pages where available")
+        ("realtime", "Low-jitter mode: pre-fault and lock capture buffers and print trigger detection and chunk latency histograms at the end, given CPUs (e.g. 2,3-5) pin the capture thread to the first and compression and writer threads to the rest", cxxopts::value<std::string>()->implicit_value(""))
+        ("fifo", "With --realtime run the capture thread with given SCHED_FIFO priority (1-99) where permitted", cxxopts::value<int>())
+        ("daemon", "Keep the scope connected and serve capture requests on given unix socket", cxxopts::value<std::string>())
+        ("plan", "Run the captures of given JSON plan file over one connection, reordered to need the fewest memory depth, channel and recording mode changes, the other options are their defaults", cxxopts::value<std::string>())
+        ("trace", "Write Chrome/Perfetto trace JSON of the capture to file, with --daemon of all requests on quit", cxxopts::value<std::string>())
+        ("stats", "Print per-command latency and transfer statistics at exit")
+        ("prometheus", "Write connection statistics as Prometheus textfile, with --daemon after every capture", cxxopts::value<std::string>())
+        ("instance", "Instance label used in Prometheus output", cxxopts::value<std::string>()->default_value(""))
         ("h,help", "Print usage")
     ;
     // clang-format on
@@ -88,7 +77,6 @@ int main(int argc, char **argv)
 
     try
     {
-        int compression = 0;
         auto parsed_options = options.parse(argc, argv);
 
         if (parsed_options.count("help"))
@@ -106,86 +94,218 @@ int main(int argc, char **argv)
         if (!parsed_options.count("scopeip"))
             throw cxxopts::OptionParseException("argument --scopeip is required");
 
-        if (!parsed_options.count("outfile"))
+        const bool daemon_mode = parsed_options.count("daemon") > 0;
+        const bool plan_mode = parsed_options.count("plan") > 0;
+        if (daemon_mode && plan_mode)
+            throw cxxopts::OptionParseException("--daemon and --plan cannot be used together");
+
+        if (!daemon_mode && !plan_mode && !parsed_options.count("outfile"))
             throw cxxopts::OptionParseException("argument --outfile is required");
 
+        capture_request request;
+
         if (parsed_options.count("zlib"))
         {
-            compression = parsed_options["zlib"].as<int>();
-            if (compression < 1 || compression > 9)
+            request.compression = parsed_options["zlib"].as<int>();
+            if (request.compression < 1 || request.compression > 9)
                 throw cxxopts::OptionParseException("compression level hhas to be between 1 and 9");
         }
 
-        trigger_mode trigger;
-
-        if (!parsed_options.count("trigger"))
-            throw cxxopts::OptionParseException("argument --trigger is required");
-        else if (auto trigger_val = parsed_options["trigger"].as<std::string>(); trigger_val == "stop")
-            trigger = trigger_mode::STOP;
-        else if (trigger_val == "single")
-            trigger = trigger_mode::SINGLE;
-        else
-            throw cxxopts::OptionParseException(
-                fmt::format("'{}' is not a valid trigger mode, expected stop or single", trigger_val));
+        if (parsed_options.count("trace"))
+            rigol::trace::enable();
 
-        std::vector<rigol::channel> channels;
+        request.frames = parsed_options["frames"].as<std::size_t>();
+        if (request.frames == 0)
+            throw cxxopts::OptionParseException("number of frames has to be at least 1");
 
+        try
         {
-            std::string value = parsed_options["channels"].as<std::string>();
-            for (char ch : value)
+            if (parsed_options.count("trigger"))
+                request.trigger = parse_trigger(parsed_options["trigger"].as<std::string>());
+            else if (!daemon_mode && !plan_mode && request.frames == 1)
+                throw cxxopts::OptionParseException("argument --trigger is required");
+
+            request.channels = parse_channels(parsed_options["channels"].as<std::string>());
+            request.format = parse_format(parsed_options["format"].as<std::string>());
+            request.layout = parse_layout(parsed_options["layout"].as<std::string>());
+            request.mat73.shuffle = parsed_options.count("shuffle") > 0;
+            request.mat73.threads = parsed_options["threads"].as<unsigned>();
+            request.output.backend = parse_sink_backend(parsed_options["io"].as<std::string>());
+            request.output.direct = parsed_options.count("direct") > 0;
+            if (parsed_options.count("preview"))
+                request.preview_factors = parse_preview_factors(parsed_options["preview"].as<std::string>());
+            request.statistics = parsed_options.count("waveform-stats") > 0;
+            if (parsed_options.count("events"))
+            {
+                event_settings events;
+                events.edge = parse_edge(parsed_options["events"].as<std::string>());
+                events.threshold = parsed_options["threshold"].as<double>();
+                events.hysteresis = parsed_options["hysteresis"].as<double>();
+                parse_event_window(parsed_options["window"].as<std::string>(), events);
+                request.events = events;
+            }
+            if (parsed_options.count("spectrum"))
+            {
+                spectrum_settings spectrum;
+                spectrum.segment = parsed_options["spectrum"].as<std::size_t>();
+                spectrum.window = parse_spectrum_window(parsed_options["spectrum-window"].as<std::string>());
+                spectrum.overlap = parsed_options["overlap"].as<double>();
+                spectrum.threads = parsed_options["threads"].as<unsigned>();
+                check_spectrum_settings(spectrum);
+                request.spectrum = spectrum;
+            }
+            if (parsed_options.count("skip-unchanged"))
+            {
+                change_settings changes;
+                changes.tolerance = parsed_options["skip-unchanged"].as<unsigned>();
+                if (parsed_options.count("delta"))
+                    changes.keyframe_interval = parsed_options["delta"].as<std::size_t>();
+                request.changes = changes;
+            }
+            else if (parsed_options.count("delta"))
+            {
+                throw std::invalid_argument("--delta needs --skip-unchanged");
+            }
+
+            request.decimation_filter.taps = parsed_options["decimate-taps"].as<std::size_t>();
+            request.decimation_filter.cutoff = parsed_options["cutoff"].as<double>();
+            if (parsed_options.count("decimate"))
+            {
+                decimation_settings decimation = request.decimation_filter;
+                decimation.factor = parsed_options["decimate"].as<std::size_t>();
+                check_decimation_settings(decimation);
+                request.decimation = decimation;
+            }
+
+            if (parsed_options.count("logic"))
+            {
+                logic_settings logic;
+                logic.lines = parsed_options.count("logic-lines") > 0;
+                logic.edges = parsed_options.count("logic-edges") > 0;
+                request.logic = logic;
+            }
+            else if (parsed_options.count("logic-lines") || parsed_options.count("logic-edges"))
+            {
+                throw std::invalid_argument("--logic-lines and --logic-edges need --logic");
+            }
+
+            if (parsed_options.count("memory-budget"))
+                request.memory_budget = parse_memory_size(parsed_options["memory-budget"].as<std::string>());
+
+            if (parsed_options.count("realtime"))
             {
-                switch (ch)
-                {
-                case '1':
-                    channels.push_back(rigol::channel::CHANNEL_1);
-                    break;
-                case '2':
-                    channels.push_back(rigol::channel::CHANNEL_2);
-                    break;
-                case '3':
-                    channels.push_back(rigol::channel::CHANNEL_3);
-                    break;
-                case '4':
-                    channels.push_back(rigol::channel::CHANNEL_4);
-                    break;
-                default:
-                    throw cxxopts::OptionParseException(
-                        fmt::format("'{}' is not a valid channel specifier, expected on of: 1,2,3,4", ch));
-                }
+                realtime_settings settings = realtime::parse_cpus(parsed_options["realtime"].as<std::string>());
+                if (parsed_options.count("fifo"))
+                    settings.fifo_priority = parsed_options["fifo"].as<int>();
+                realtime::enable(settings);
             }
+            else if (parsed_options.count("fifo"))
+            {
+                throw std::invalid_argument("--fifo needs --realtime");
+            }
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw cxxopts::OptionParseException(ex.what());
         }
 
-        rigol::scope scope(std::make_unique<rigol::tcp_connection>(parsed_options["scopeip"].as<std::string>(),
-                                                                   parsed_options["scopeport"].as<uint16_t>()));
+        const std::string scope_ip = parsed_options["scopeip"].as<std::string>();
+        const uint16_t scope_port = parsed_options["scopeport"].as<uint16_t>();
 
-        wait_for_trigger(scope, trigger);
+        const bool huge_pages = parsed_options.count("huge-pages") > 0;
 
-        std::ofstream file(parsed_options["outfile"].as<std::string>(),
-                           std::ios::binary | std::ios::trunc | std::ios::out);
-        file << mat::header{};
+        const auto write_trace = [&] {
+            rigol::trace::disable();
+            std::ofstream trace_file(parsed_options["trace"].as<std::string>(), std::ios::trunc | std::ios::out);
+            rigol::trace::write_chrome_json(trace_file);
+            spdlog::info("Trace written to {}", parsed_options["trace"].as<std::string>());
+        };
 
-        std::vector<std::pair<double, double>> buffer;
-        for (auto ch : channels)
+        if (daemon_mode)
         {
-            spdlog::info("Reading data for {}", ch);
-            read_channel_data(scope, ch, buffer);
+            daemon_options daemon;
+            daemon.huge_pages = huge_pages;
+            daemon.realtime = realtime::enabled();
+            daemon.stats = parsed_options.count("stats") > 0;
+            if (parsed_options.count("prometheus"))
+                daemon.prometheus = parsed_options["prometheus"].as<std::string>();
+            daemon.instance = parsed_options["instance"].as<std::string>();
+            run_daemon([&]() { return std::make_unique<rigol::tcp_connection>(scope_ip, scope_port); },
+                       parsed_options["daemon"].as<std::string>(), request, daemon);
+
+            // The trace covers every request until quit
+            if (parsed_options.count("trace"))
+                write_trace();
+            return 0;
+        }
 
-            if (compression != 0)
+        // A broken plan is reported before connecting
+        std::optional<capture_plan> plan;
+        if (plan_mode)
+            plan = read_plan(parsed_options["plan"].as<std::string>(), request);
+        else
+            request.outfile = parsed_options["outfile"].as<std::string>();
+        rigol::scope scope(std::make_unique<rigol::tcp_connection>(scope_ip, scope_port));
+
+        capture_timings timings;
+        if (plan)
+        {
+            timings = run_plan(scope, *plan, huge_pages);
+        }
+        else
+        {
+            capture_arena arena{huge_pages};
+            scope_setup setup;
+            if (realtime::enabled())
             {
-                spdlog::info("Compressing data for {}", ch);
-                mat::compressed_section cmp{compression};
-                cmp << mat::matrix{fmt::format("{}", ch), buffer};
-                cmp.finish();
-                spdlog::info("Saving data for {}", ch);
-                file << cmp;
+                // Everything the capture touches is allocated, faulted in and locked before arming
+                setup.learn(scope, request.channels, request.logic.has_value());
+                arena.reserve(setup.memory_depth, request);
+                realtime::lock_memory();
             }
-            else
+            timings = capture(scope, request, realtime::enabled() ? &setup : nullptr, &arena);
+
+            if (realtime::enabled())
             {
-                spdlog::info("Saving data for {}", ch);
-                file << mat::matrix{fmt::format("{}", ch), buffer};
+                cycle_statistics cycles;
+                cycles.add(timings.detect_ms, timings.total_ms);
+                cycles.write(std::cout, scope.statistics());
             }
         }
 
+        if (request.memory_budget && timings.peak_rss)
+            spdlog::info("Estimated {:.1f} MiB, process-wide peak RSS {:.1f} MiB", timings.estimated_bytes / 1048576.0,
+                         timings.peak_rss / 1048576.0);
+        else if (request.memory_budget)
+            spdlog::info("Estimated {:.1f} MiB, peak RSS {:.1f} MiB downloading and {:.1f} MiB writing",
+                         timings.estimated_bytes / 1048576.0, timings.transfer_peak_rss / 1048576.0,
+                         timings.write_peak_rss / 1048576.0);
+
+        if (parsed_options.count("stats"))
+        {
+            rigol::write_summary(std::cout, scope.statistics());
+            const sink_statistics &output = timings.output;
+            std::cout << fmt::format("wrote {} bytes in {} writes, queue depth up to {}, write latency {:.2f} ms mean, "
+                                     "{:.2f} ms max\n",
+                                     output.bytes, output.writes, output.max_queue_depth, output.mean_latency_ms(),
+                                     output.max_latency_ms);
+            if (request.memory_budget && timings.peak_rss)
+                std::cout << fmt::format("estimated {} bytes, process-wide peak RSS {} bytes\n", timings.estimated_bytes,
+                                         timings.peak_rss);
+            else if (request.memory_budget)
+                std::cout << fmt::format("estimated {} bytes, peak RSS {} bytes downloading, {} bytes writing\n",
+                                         timings.estimated_bytes, timings.transfer_peak_rss, timings.write_peak_rss);
+        }
+
+        if (parsed_options.count("prometheus"))
+        {
+            rigol::write_prometheus_file(parsed_options["prometheus"].as<std::string>(), scope.statistics(),
+                                         parsed_options["instance"].as<std::string>());
+        }
+
+        if (parsed_options.count("trace"))
+            write_trace();
+
         spdlog::info("Done");
     }
     catch (const cxxopts::OptionParseException &ex)
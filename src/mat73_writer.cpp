@@ -0,0 +1,576 @@
+#include "mat73_writer.h"
+#include "realtime.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <spdlog/fmt/fmt.h>
+#include <stdexcept>
+#include <thread>
+#include <zlib.h>
+
+namespace
+{
+    constexpr uint64_t USER_BLOCK = 512;
+    constexpr uint64_t SUPERBLOCK_SIZE = 96;
+    constexpr uint64_t UNDEFINED = ~uint64_t(0);
+    // End of a local heap's free list
+    constexpr uint64_t HEAP_FREE_NULL = 1;
+
+    // A symbol table node holds up to twice this many variables
+    constexpr uint16_t GROUP_LEAF_K = 64;
+    constexpr uint16_t GROUP_INTERNAL_K = 16;
+    // Not stored in a version 0 superblock, readers assume the default
+    constexpr std::size_t CHUNK_K = 32;
+
+    constexpr uint16_t MSG_DATASPACE = 0x1;
+    constexpr uint16_t MSG_DATATYPE = 0x3;
+    constexpr uint16_t MSG_FILL_VALUE = 0x5;
+    constexpr uint16_t MSG_LAYOUT = 0x8;
+    constexpr uint16_t MSG_FILTER_PIPELINE = 0xb;
+    constexpr uint16_t MSG_ATTRIBUTE = 0xc;
+    constexpr uint16_t MSG_SYMBOL_TABLE = 0x11;
+    constexpr uint8_t MSG_FLAG_CONSTANT = 0x1;
+
+    constexpr uint16_t FILTER_DEFLATE = 1;
+    constexpr uint16_t FILTER_SHUFFLE = 2;
+    constexpr uint16_t FILTER_OPTIONAL = 0x1;
+
+    // Little endian serialisation of HDF5 structures
+    class encoder
+    {
+        std::vector<uint8_t> m_bytes;
+
+      public:
+        encoder &u8(uint8_t v)
+        {
+            m_bytes.push_back(v);
+            return *this;
+        }
+        encoder &u16(uint16_t v) { return u8(v & 0xff).u8(v >> 8); }
+        encoder &u32(uint32_t v) { return u16(v & 0xffff).u16(v >> 16); }
+        encoder &u64(uint64_t v) { return u32(v & 0xffffffff).u32(v >> 32); }
+        encoder &raw(const void *data, std::size_t size)
+        {
+            // Empty encoders and values may come with a null pointer
+            if (size == 0)
+                return *this;
+            m_bytes.insert(m_bytes.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+            return *this;
+        }
+        encoder &raw(const encoder &other) { return raw(other.m_bytes.data(), other.size()); }
+        encoder &zeros(std::size_t count)
+        {
+            m_bytes.resize(m_bytes.size() + count);
+            return *this;
+        }
+        encoder &align(std::size_t to) { return zeros((to - m_bytes.size() % to) % to); }
+
+        std::size_t size() const { return m_bytes.size(); }
+        const std::vector<uint8_t> &bytes() const { return m_bytes; }
+    };
+
+    std::size_t element_size(mat73::element_type type)
+    {
+        switch (type)
+        {
+        case mat73::element_type::UINT8:
+        case mat73::element_type::LOGICAL:
+            return 1;
+        case mat73::element_type::UINT16:
+            return 2;
+        case mat73::element_type::UINT64:
+        case mat73::element_type::DOUBLE:
+            return 8;
+        }
+        throw std::logic_error("Unknown element type");
+    }
+
+    const char *class_name(mat73::element_type type)
+    {
+        switch (type)
+        {
+        case mat73::element_type::UINT8:
+            return "uint8";
+        case mat73::element_type::UINT16:
+            return "uint16";
+        case mat73::element_type::LOGICAL:
+            return "logical";
+        case mat73::element_type::UINT64:
+            return "uint64";
+        case mat73::element_type::DOUBLE:
+            return "double";
+        }
+        throw std::logic_error("Unknown element type");
+    }
+
+    encoder datatype(mat73::element_type type)
+    {
+        encoder e;
+        if (type == mat73::element_type::DOUBLE)
+        {
+            // IEEE 754 little endian: sign at bit 63, 11 bit exponent at 52 with bias 1023, 52 bit mantissa
+            e.u8(0x11).u8(0x20).u8(63).u8(0).u32(8);
+            e.u16(0).u16(64).u8(52).u8(11).u8(0).u8(52).u32(1023);
+        }
+        else
+        {
+            // Unsigned little endian integer
+            const std::size_t size = element_size(type);
+            e.u8(0x10).u8(0).u8(0).u8(0).u32((uint32_t)size);
+            e.u16(0).u16((uint16_t)(size * 8));
+        }
+        return e;
+    }
+
+    // ASCII, null terminated when shorter than `length`
+    encoder string_type(std::size_t length)
+    {
+        encoder e;
+        e.u8(0x13).u8(0).u8(0).u8(0).u32((uint32_t)length);
+        return e;
+    }
+
+    // No dimensions is a scalar
+    encoder dataspace(const std::vector<uint64_t> &dimensions)
+    {
+        encoder e;
+        e.u8(1).u8((uint8_t)dimensions.size()).u8(0).u8(0).u32(0);
+        for (uint64_t d : dimensions)
+            e.u64(d);
+        return e;
+    }
+
+    encoder attribute(const std::string &name, const encoder &type, const void *value, std::size_t size)
+    {
+        const encoder space = dataspace({});
+        encoder e;
+        e.u8(1).u8(0).u16((uint16_t)(name.size() + 1)).u16((uint16_t)type.size()).u16((uint16_t)space.size());
+        e.raw(name.c_str(), name.size() + 1).align(8);
+        e.raw(type).align(8);
+        e.raw(space).align(8);
+        e.raw(value, size);
+        return e;
+    }
+
+    // Version 1 object header, messages are 8 byte aligned
+    class object_header
+    {
+        encoder m_messages;
+        uint16_t m_count = 0;
+
+      public:
+        object_header &add(uint16_t type, encoder body, uint8_t flags = 0)
+        {
+            body.align(8);
+            m_messages.u16(type).u16((uint16_t)body.size()).u8(flags).zeros(3).raw(body);
+            m_count++;
+            return *this;
+        }
+
+        encoder encode() const
+        {
+            encoder e;
+            e.u8(1).u8(0).u16(m_count).u32(1).u32((uint32_t)m_messages.size()).zeros(4).raw(m_messages);
+            return e;
+        }
+    };
+
+    struct chunk_key
+    {
+        uint32_t size = 0;
+        std::vector<uint64_t> offsets;
+    };
+
+    void compress_chunk(const uint8_t *data, std::size_t valid, std::size_t chunk_bytes, std::size_t element,
+                        const mat73::settings &settings, std::vector<uint8_t> &scratch, std::vector<uint8_t> &out)
+    {
+        // Edge chunks are stored at full size, padded with zeros
+        scratch.resize(chunk_bytes);
+        if (settings.compression && settings.shuffle && element > 1)
+        {
+            const std::size_t count = chunk_bytes / element;
+            const std::size_t valid_count = valid / element;
+            for (std::size_t b = 0; b < element; b++)
+            {
+                uint8_t *plane = scratch.data() + b * count;
+                for (std::size_t i = 0; i < valid_count; i++)
+                    plane[i] = data[i * element + b];
+                std::fill(plane + valid_count, plane + count, 0);
+            }
+        }
+        else
+        {
+            std::memcpy(scratch.data(), data, valid);
+            std::fill(scratch.begin() + valid, scratch.end(), 0);
+        }
+
+        if (!settings.compression)
+        {
+            out.swap(scratch);
+            return;
+        }
+
+        uLongf size = compressBound((uLong)chunk_bytes);
+        out.resize(size);
+        const int ret = compress2(out.data(), &size, scratch.data(), (uLong)chunk_bytes, settings.compression);
+        if (ret != Z_OK)
+            throw std::runtime_error(fmt::format("Cannot compress MAT 7.3 chunk: zlib error {}", ret));
+        out.resize(size);
+    }
+} // namespace
+
+namespace mat73
+{
+    writer::writer(const std::string &path, const settings &settings)
+        : m_path(path), m_file(path, std::ios::binary | std::ios::trunc | std::ios::in | std::ios::out),
+          m_settings(settings)
+    {
+        if (!m_file)
+            throw std::runtime_error(fmt::format("Cannot open {}", path));
+        if (m_settings.compression < 0 || m_settings.compression > 9)
+            throw std::invalid_argument("compression level has to be between 0 and 9");
+
+        std::string text = "MATLAB 7.3 MAT-file, HDF5 schema 1.00 . Generated by scope_receiver";
+        text.resize(116);
+        encoder header;
+        header.raw(text.data(), text.size()).zeros(8).u16(0x0200).u8('I').u8('M').zeros(USER_BLOCK - 128);
+        // The superblock is written last, once the root group's address is known
+        header.zeros(SUPERBLOCK_SIZE);
+        m_file.write((const char *)header.bytes().data(), header.size());
+    }
+
+    uint64_t writer::position() { return (uint64_t)m_file.tellp() - USER_BLOCK; }
+
+    void writer::write_array(const std::string &name, const void *data, element_type type,
+                             const std::vector<std::size_t> &dimensions, const generator *fill)
+    {
+        if (m_closed)
+            throw std::logic_error("MAT 7.3 file is already closed");
+        if (dimensions.empty())
+            throw std::invalid_argument(fmt::format("{} has no dimensions", name));
+        if (std::any_of(m_variables.begin(), m_variables.end(), [&](const variable &v) { return v.name == name; }))
+            throw std::invalid_argument(fmt::format("Variable {} is written twice", name));
+        if (m_variables.size() == 2 * GROUP_LEAF_K)
+            throw std::length_error(fmt::format("A MAT 7.3 file holds at most {} variables", 2 * GROUP_LEAF_K));
+
+        variable var{name, class_name(type), type, false, {dimensions.rbegin(), dimensions.rend()}, {}, {}};
+        std::vector<uint64_t> empty_dimensions;
+        if (std::find(dimensions.begin(), dimensions.end(), 0) != dimensions.end())
+        {
+            // MATLAB stores empty arrays as their dimensions
+            empty_dimensions.assign(dimensions.begin(), dimensions.end());
+            var.empty = true;
+            var.type = element_type::UINT64;
+            var.dimensions = {empty_dimensions.size()};
+            data = empty_dimensions.data();
+            fill = nullptr;
+        }
+
+        write_chunks(var, (const uint8_t *)data, fill);
+        m_variables.push_back(std::move(var));
+    }
+
+    void writer::write_chunks(variable &var, const uint8_t *data, const generator *fill)
+    {
+        rigol::trace::span span{"MAT 7.3 chunks", "output"};
+        const std::size_t element = element_size(var.type);
+        const std::size_t rank = var.dimensions.size();
+
+        // Whole trailing dimensions and a slab of the one before, a chunk is a contiguous range of the data
+        var.chunk_dimensions = var.dimensions;
+        std::size_t split = 0;
+        std::size_t inner = element;
+        for (std::size_t i = rank; i-- > 0;)
+        {
+            if (inner * var.dimensions[i] <= m_settings.chunk_bytes)
+            {
+                inner *= var.dimensions[i];
+                continue;
+            }
+
+            var.chunk_dimensions[i] = std::max<uint64_t>(1, m_settings.chunk_bytes / inner);
+            std::fill(var.chunk_dimensions.begin(), var.chunk_dimensions.begin() + i, 1);
+            split = i;
+            break;
+        }
+
+        // Bytes per step along the split dimension and of a whole chunk
+        const std::size_t step = std::accumulate(var.dimensions.begin() + split + 1, var.dimensions.end(),
+                                                 element, std::multiplies<std::size_t>());
+        const std::size_t chunk_bytes = step * var.chunk_dimensions[split];
+
+        std::vector<uint64_t> grid(split + 1);
+        std::size_t count = 1;
+        for (std::size_t i = 0; i <= split; i++)
+        {
+            grid[i] = (var.dimensions[i] + var.chunk_dimensions[i] - 1) / var.chunk_dimensions[i];
+            count *= grid[i];
+        }
+
+        // Offsets, data start and valid bytes of chunk `n`, in row-major chunk order
+        auto locate = [&](std::size_t n, std::vector<uint64_t> &offsets, std::size_t &start, std::size_t &valid) {
+            offsets.assign(rank, 0);
+            start = 0;
+            std::size_t stride = step;
+            for (std::size_t i = split + 1; i-- > 0;)
+            {
+                offsets[i] = n % grid[i] * var.chunk_dimensions[i];
+                n /= grid[i];
+                start += offsets[i] * stride;
+                stride *= var.dimensions[i];
+            }
+            valid = std::min(var.chunk_dimensions[split], var.dimensions[split] - offsets[split]) * step;
+        };
+
+        const unsigned threads = m_settings.threads ? m_settings.threads : realtime::hardware_threads();
+        const std::size_t batch = std::min<std::size_t>(count, threads * 2);
+        std::vector<std::vector<uint8_t>> scratch(threads), out(batch), generated(fill ? threads : 0);
+
+        for (std::size_t first = 0; first < count; first += batch)
+        {
+            const std::size_t n = std::min(batch, count - first);
+            std::vector<chunk> chunks(n);
+
+            const unsigned used = (unsigned)std::min<std::size_t>(threads, n);
+            std::vector<std::exception_ptr> errors(used);
+            auto worker = [&](unsigned t) {
+                try
+                {
+                    for (std::size_t i = t; i < n; i += used)
+                    {
+                        std::size_t start, valid;
+                        locate(first + i, chunks[i].offsets, start, valid);
+                        const uint8_t *source = nullptr;
+                        if (fill)
+                        {
+                            generated[t].resize(valid);
+                            (*fill)(start / element, valid / element, (double *)generated[t].data());
+                            source = generated[t].data();
+                        }
+                        else
+                        {
+                            source = data + start;
+                        }
+                        compress_chunk(source, valid, chunk_bytes, element, m_settings, scratch[t], out[i]);
+                    }
+                }
+                catch (...)
+                {
+                    errors[t] = std::current_exception();
+                }
+            };
+
+            std::vector<std::thread> pool;
+            for (unsigned t = 1; t < used; t++)
+                pool.emplace_back([&worker, t] {
+                    realtime::worker_thread();
+                    worker(t);
+                });
+            worker(0);
+            for (std::thread &thread : pool)
+                thread.join();
+            for (const std::exception_ptr &error : errors)
+            {
+                if (error)
+                    std::rethrow_exception(error);
+            }
+
+            for (std::size_t i = 0; i < n; i++)
+            {
+                chunks[i].address = position();
+                chunks[i].size = (uint32_t)out[i].size();
+                m_file.write((const char *)out[i].data(), out[i].size());
+                var.chunks.push_back(std::move(chunks[i]));
+            }
+        }
+
+        if (!m_file)
+            throw std::runtime_error(fmt::format("Cannot write {}", m_path));
+    }
+
+    uint64_t writer::append(const std::vector<uint8_t> &bytes)
+    {
+        const uint64_t address = position();
+        m_file.write((const char *)bytes.data(), bytes.size());
+        return address;
+    }
+
+    uint64_t writer::write_chunk_index(const variable &var)
+    {
+        const std::size_t rank = var.dimensions.size();
+        const std::size_t key_size = 8 + (rank + 1) * 8;
+        const std::size_t node_size = 24 + 2 * CHUNK_K * 8 + (2 * CHUNK_K + 1) * key_size;
+
+        struct entry
+        {
+            chunk_key left;
+            chunk_key right;
+            uint64_t address;
+        };
+
+        // Keys hold the element offsets of a chunk plus a trailing 0 for the element's bytes, the key
+        // after the last child is where the next chunk would start
+        std::vector<entry> entries;
+        for (const chunk &c : var.chunks)
+        {
+            entry e{{c.size, c.offsets}, {0, c.offsets}, c.address};
+            for (std::size_t i = 0; i < rank; i++)
+                e.right.offsets[i] += var.chunk_dimensions[i];
+            e.left.offsets.push_back(0);
+            e.right.offsets.push_back(0);
+            entries.push_back(std::move(e));
+        }
+
+        auto encode_key = [](encoder &node, const chunk_key &key) {
+            node.u32(key.size).u32(0);
+            for (uint64_t offset : key.offsets)
+                node.u64(offset);
+        };
+
+        for (uint8_t level = 0;; level++)
+        {
+            const std::size_t nodes = (entries.size() + 2 * CHUNK_K - 1) / (2 * CHUNK_K);
+            const uint64_t base = position();
+            std::vector<entry> parents;
+            encoder level_nodes;
+            for (std::size_t n = 0; n < nodes; n++)
+            {
+                const uint64_t address = base + n * node_size;
+                const std::size_t from = n * 2 * CHUNK_K;
+                const std::size_t to = std::min(entries.size(), from + 2 * CHUNK_K);
+
+                encoder node;
+                node.raw("TREE", 4).u8(1).u8(level).u16((uint16_t)(to - from));
+                node.u64(n > 0 ? address - node_size : UNDEFINED).u64(n + 1 < nodes ? address + node_size : UNDEFINED);
+                for (std::size_t i = from; i < to; i++)
+                {
+                    encode_key(node, entries[i].left);
+                    node.u64(entries[i].address);
+                }
+                encode_key(node, entries[to - 1].right);
+                node.zeros(node_size - node.size());
+                level_nodes.raw(node);
+
+                parents.push_back({entries[from].left, entries[to - 1].right, address});
+            }
+
+            append(level_nodes.bytes());
+            if (nodes == 1)
+                return base;
+            entries = std::move(parents);
+        }
+    }
+
+    void writer::close()
+    {
+        if (m_closed)
+            return;
+        m_closed = true;
+
+        // Symbol table nodes list their entries sorted by name
+        std::vector<const variable *> sorted;
+        for (const variable &var : m_variables)
+            sorted.push_back(&var);
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const variable *a, const variable *b) { return a->name < b->name; });
+
+        std::vector<uint64_t> headers;
+        for (const variable *var : sorted)
+        {
+            const uint64_t index = write_chunk_index(*var);
+            const std::size_t element = element_size(var->type);
+
+            encoder layout;
+            layout.u8(3).u8(2).u8((uint8_t)(var->dimensions.size() + 1)).u64(index);
+            for (uint64_t d : var->chunk_dimensions)
+                layout.u32((uint32_t)d);
+            layout.u32((uint32_t)element);
+
+            // Space allocated incrementally, fill value written if set, and none is set
+            encoder fill;
+            fill.u8(2).u8(3).u8(2).u8(0);
+
+            object_header header;
+            header.add(MSG_DATASPACE, dataspace(var->dimensions))
+                .add(MSG_DATATYPE, datatype(var->type), MSG_FLAG_CONSTANT)
+                .add(MSG_FILL_VALUE, fill, MSG_FLAG_CONSTANT)
+                .add(MSG_LAYOUT, layout);
+
+            if (m_settings.compression)
+            {
+                encoder filters;
+                filters.u8(1).u8(m_settings.shuffle ? 2 : 1).zeros(6);
+                // No names, one parameter each padded to an even count
+                if (m_settings.shuffle)
+                    filters.u16(FILTER_SHUFFLE).u16(0).u16(FILTER_OPTIONAL).u16(1).u32((uint32_t)element).u32(0);
+                filters.u16(FILTER_DEFLATE).u16(0).u16(FILTER_OPTIONAL).u16(1).u32(m_settings.compression).u32(0);
+                header.add(MSG_FILTER_PIPELINE, filters);
+            }
+
+            header.add(MSG_ATTRIBUTE, attribute("MATLAB_class", string_type(var->matlab_class.size()),
+                                                var->matlab_class.data(), var->matlab_class.size()));
+            if (var->empty)
+            {
+                const uint8_t one = 1;
+                header.add(MSG_ATTRIBUTE, attribute("MATLAB_empty", datatype(element_type::UINT8), &one, 1));
+            }
+            else if (var->type == element_type::LOGICAL)
+            {
+                const uint8_t one = 1;
+                header.add(MSG_ATTRIBUTE, attribute("MATLAB_int_decode", datatype(element_type::UINT8), &one, 1));
+            }
+
+            headers.push_back(append(header.encode().bytes()));
+        }
+
+        // Root group: names in a local heap (offset 0 is the empty name), one symbol table node and
+        // a B-tree with that node as its only child
+        encoder names;
+        names.zeros(8);
+        std::vector<uint64_t> name_offsets;
+        for (const variable *var : sorted)
+        {
+            name_offsets.push_back(names.size());
+            names.raw(var->name.c_str(), var->name.size() + 1).align(8);
+        }
+
+        const uint64_t heap = position();
+        encoder heap_bytes;
+        heap_bytes.raw("HEAP", 4).u8(0).zeros(3).u64(names.size()).u64(HEAP_FREE_NULL).u64(heap + 32).raw(names);
+        append(heap_bytes.bytes());
+
+        encoder symbols;
+        symbols.raw("SNOD", 4).u8(1).u8(0).u16((uint16_t)sorted.size());
+        for (std::size_t i = 0; i < sorted.size(); i++)
+            symbols.u64(name_offsets[i]).u64(headers[i]).u32(0).u32(0).zeros(16);
+        symbols.zeros(8 + 2 * GROUP_LEAF_K * 40 - symbols.size());
+        const uint64_t symbol_node = append(symbols.bytes());
+
+        encoder btree;
+        btree.raw("TREE", 4).u8(0).u8(0).u16(1).u64(UNDEFINED).u64(UNDEFINED);
+        btree.u64(0).u64(symbol_node).u64(name_offsets.empty() ? 0 : name_offsets.back());
+        btree.zeros(24 + 2 * GROUP_INTERNAL_K * 8 + (2 * GROUP_INTERNAL_K + 1) * 8 - btree.size());
+        const uint64_t group_index = append(btree.bytes());
+
+        encoder symbol_table;
+        symbol_table.u64(group_index).u64(heap);
+        const uint64_t root = append(object_header{}.add(MSG_SYMBOL_TABLE, symbol_table).encode().bytes());
+
+        // Unlike every other address the end of file counts the user block
+        const uint64_t end = USER_BLOCK + position();
+        encoder superblock;
+        superblock.raw("\x89HDF\r\n\x1a\n", 8).u8(0).u8(0).u8(0).u8(0).u8(0).u8(8).u8(8).u8(0);
+        superblock.u16(GROUP_LEAF_K).u16(GROUP_INTERNAL_K).u32(0);
+        superblock.u64(USER_BLOCK).u64(UNDEFINED).u64(end).u64(UNDEFINED);
+        // Root group symbol table entry, caching the group's B-tree and heap
+        superblock.u64(0).u64(root).u32(1).u32(0).u64(group_index).u64(heap);
+
+        m_file.seekp(USER_BLOCK);
+        m_file.write((const char *)superblock.bytes().data(), superblock.size());
+        m_file.close();
+        if (!m_file)
+            throw std::runtime_error(fmt::format("Cannot write {}", m_path));
+    }
+} // namespace mat73
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+// MAT 7.3 files are HDF5 files with a MAT header in their 512 byte user block. This writer needs no
+// HDF5 library, it produces the subset of the format that MATLAB reads:
+//
+//   user block | superblock | chunk data ... | per variable: chunk B-tree, object header |
+//   root group: local heap, symbol table node, B-tree, object header
+//
+// All structures are the original (version 0 superblock, version 1 object header and B-tree)
+// ones, sizes and addresses are 64 bit. Every variable is a chunked dataset in the root group with
+// a MATLAB_class attribute, chunks are split along the last MATLAB dimension so matfile() loads
+// column ranges without reading the whole variable. Chunks are deflated (and optionally shuffled)
+// on all cores and written in order as they are done.
+namespace mat73
+{
+    struct settings
+    {
+        // zlib level of every chunk, 0 stores them as they are
+        int compression = 0;
+        // Group the n-th bytes of all elements of a chunk before deflating it
+        bool shuffle = false;
+        // Threads compressing chunks, 0 uses every hardware thread
+        unsigned threads = 0;
+        // Uncompressed size a chunk is aimed at
+        std::size_t chunk_bytes = 1 << 20;
+    };
+
+    enum class element_type
+    {
+        UINT8,
+        UINT16,
+        UINT64,
+        // uint8 zeros and ones that MATLAB loads as logical
+        LOGICAL,
+        DOUBLE,
+    };
+
+    class writer
+    {
+      public:
+        // Writes elements [first, first + count) of a variable in column-major order to `out`
+        using generator = std::function<void(std::size_t first, std::size_t count, double *out)>;
+
+      private:
+        struct chunk
+        {
+            // Element offsets in HDF5 (row-major) dimension order
+            std::vector<uint64_t> offsets;
+            uint64_t address;
+            uint32_t size;
+        };
+
+        struct variable
+        {
+            std::string name;
+            std::string matlab_class;
+            element_type type;
+            bool empty;
+            // HDF5 order, the reverse of MATLAB's
+            std::vector<uint64_t> dimensions;
+            std::vector<uint64_t> chunk_dimensions;
+            std::vector<chunk> chunks;
+        };
+
+        std::string m_path;
+        std::fstream m_file;
+        settings m_settings;
+        std::vector<variable> m_variables;
+        bool m_closed = false;
+
+        // Addresses are relative to the superblock, which follows the user block
+        uint64_t position();
+        uint64_t append(const std::vector<uint8_t> &bytes);
+        void write_array(const std::string &name, const void *data, element_type type,
+                         const std::vector<std::size_t> &dimensions, const generator *fill = nullptr);
+        void write_chunks(variable &var, const uint8_t *data, const generator *fill);
+        // B-tree over the chunks, returns the root node's address
+        uint64_t write_chunk_index(const variable &var);
+
+      public:
+        writer(const std::string &path, const settings &settings);
+
+        // `dimensions` in MATLAB order, `data` column-major as for the MAT v5 writer. Variables
+        // appear in the file once close() succeeded.
+        void write(const std::string &name, const double *data, const std::vector<std::size_t> &dimensions)
+        {
+            write_array(name, data, element_type::DOUBLE, dimensions);
+        }
+        void write(const std::string &name, const uint8_t *data, const std::vector<std::size_t> &dimensions)
+        {
+            write_array(name, data, element_type::UINT8, dimensions);
+        }
+        void write(const std::string &name, const uint16_t *data, const std::vector<std::size_t> &dimensions)
+        {
+            write_array(name, data, element_type::UINT16, dimensions);
+        }
+        void write_logical(const std::string &name, const uint8_t *data, const std::vector<std::size_t> &dimensions)
+        {
+            write_array(name, data, element_type::LOGICAL, dimensions);
+        }
+        // The data is produced chunk by chunk on the compression threads (so `fill` is called
+        // concurrently) and never exists as a whole
+        void write(const std::string &name, const std::vector<std::size_t> &dimensions, const generator &fill)
+        {
+            write_array(name, nullptr, element_type::DOUBLE, dimensions, &fill);
+        }
+
+        void close();
+    };
+} // namespace mat73
@@ -0,0 +1,458 @@
+#include "mat_reader.h"
+#include "mat_writer_p.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <spdlog/fmt/ostr.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <system_error>
+#include <zlib.h>
+
+#ifdef __unix__
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace mat
+{
+    namespace
+    {
+        constexpr std::size_t HEADER_SIZE = 128;
+        constexpr std::size_t INFLATE_CHUNK = 64 * 1024;
+        constexpr uint32_t F_LOGICAL = (1 << 9);
+        constexpr uint32_t F_COMPLEX = (1 << 11);
+
+        std::size_t padding(std::size_t size) { return (8 - size % 8) % 8; }
+
+        class byte_source
+        {
+          public:
+            virtual ~byte_source() {}
+            virtual void read(void *out, std::size_t count) = 0;
+            virtual void skip(std::size_t count) = 0;
+            virtual std::size_t position() const = 0;
+        };
+
+        class memory_source : public byte_source
+        {
+            const uint8_t *m_begin;
+            const uint8_t *m_pos;
+            const uint8_t *m_end;
+
+            void check(std::size_t count) const
+            {
+                if (count > std::size_t(m_end - m_pos))
+                    throw std::runtime_error("MAT element is truncated");
+            }
+
+          public:
+            memory_source(const uint8_t *begin, std::size_t offset, std::size_t end)
+                : m_begin(begin), m_pos(begin + offset), m_end(begin + end)
+            {
+            }
+
+            void read(void *out, std::size_t count) override
+            {
+                check(count);
+                std::memcpy(out, m_pos, count);
+                m_pos += count;
+            }
+
+            void skip(std::size_t count) override
+            {
+                check(count);
+                m_pos += count;
+            }
+
+            std::size_t position() const override { return m_pos - m_begin; }
+        };
+
+        // Inflates a compressed element on demand, feeding the mapped input in INFLATE_CHUNK pieces
+        class inflate_source : public byte_source
+        {
+            z_stream m_stream = {};
+            const uint8_t *m_in;
+            std::size_t m_in_left;
+
+          public:
+            inflate_source(const uint8_t *data, std::size_t size) : m_in(data), m_in_left(size)
+            {
+                if (inflateInit(&m_stream) != Z_OK)
+                    throw std::runtime_error("Cannot initialize zlib inflate");
+            }
+
+            ~inflate_source() { inflateEnd(&m_stream); }
+
+            void read(void *out, std::size_t count) override
+            {
+                uint8_t *dst = (uint8_t *)out;
+                while (count > 0)
+                {
+                    const std::size_t step = std::min<std::size_t>(count, 1u << 30);
+                    m_stream.next_out = dst;
+                    m_stream.avail_out = (uInt)step;
+
+                    while (m_stream.avail_out > 0)
+                    {
+                        if (m_stream.avail_in == 0 && m_in_left > 0)
+                        {
+                            const std::size_t chunk = std::min(m_in_left, INFLATE_CHUNK);
+                            m_stream.next_in = const_cast<uint8_t *>(m_in);
+                            m_stream.avail_in = (uInt)chunk;
+                            m_in += chunk;
+                            m_in_left -= chunk;
+                        }
+
+                        const int ret = inflate(&m_stream, Z_NO_FLUSH);
+                        if (ret == Z_STREAM_END && m_stream.avail_out > 0)
+                            throw std::runtime_error("Compressed MAT element ended early");
+                        if (ret == Z_BUF_ERROR && m_in_left == 0)
+                            throw std::runtime_error("Compressed MAT element is truncated");
+                        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                            throw std::runtime_error(fmt::format("ZLIB inflate error {}", ret));
+                    }
+
+                    dst += step;
+                    count -= step;
+                }
+            }
+
+            void skip(std::size_t count) override
+            {
+                std::array<uint8_t, 4096> scratch;
+                while (count > 0)
+                {
+                    const std::size_t step = std::min(count, scratch.size());
+                    read(scratch.data(), step);
+                    count -= step;
+                }
+            }
+
+            std::size_t position() const override { return m_stream.total_out; }
+        };
+
+        struct tag
+        {
+            data_type type;
+            uint32_t size;
+            bool small;
+            std::array<uint8_t, 4> small_data;
+        };
+
+        tag read_tag(byte_source &src)
+        {
+            std::array<uint32_t, 2> raw;
+            src.read(raw.data(), sizeof(raw));
+
+            tag t{};
+            if (raw[0] >> 16)
+            {
+                // Small data element, up to 4 bytes of payload packed into the tag
+                t.type = (data_type)(raw[0] & 0xffff);
+                t.size = raw[0] >> 16;
+                t.small = true;
+                std::memcpy(t.small_data.data(), &raw[1], 4);
+            }
+            else
+            {
+                t.type = (data_type)raw[0];
+                t.size = raw[1];
+            }
+            return t;
+        }
+
+        std::string read_payload(byte_source &src, const tag &t)
+        {
+            if (t.small)
+                return std::string((const char *)t.small_data.data(), t.size);
+
+            std::string payload(t.size, '\0');
+            src.read(payload.data(), t.size);
+            src.skip(padding(t.size));
+            return payload;
+        }
+
+        // Parses flags, dimensions and name of a matrix and returns the tag of its real part
+        tag read_matrix_header(byte_source &src, variable &var)
+        {
+            const tag flags_tag = read_tag(src);
+            if (flags_tag.type != data_type::uint32 || flags_tag.size != 8)
+                throw std::runtime_error("Malformed MAT array flags");
+            const std::string flags = read_payload(src, flags_tag);
+            uint32_t flags0;
+            std::memcpy(&flags0, flags.data(), 4);
+            var.class_id = flags0 & 0xff;
+            var.logical = flags0 & F_LOGICAL;
+            var.complex = flags0 & F_COMPLEX;
+
+            const tag dimensions_tag = read_tag(src);
+            if (dimensions_tag.type != data_type::int32)
+                throw std::runtime_error("Malformed MAT array dimensions");
+            const std::string dimensions = read_payload(src, dimensions_tag);
+            var.dimensions.resize(dimensions.size() / sizeof(int32_t));
+            std::memcpy(var.dimensions.data(), dimensions.data(), dimensions.size());
+
+            var.name = read_payload(src, read_tag(src));
+
+            return var.numeric() ? read_tag(src) : tag{};
+        }
+
+        std::size_t storage_size(data_type type)
+        {
+            switch (type)
+            {
+            case data_type::int8:
+            case data_type::uint8:
+                return 1;
+            case data_type::int16:
+            case data_type::uint16:
+                return 2;
+            case data_type::int32:
+            case data_type::uint32:
+            case data_type::float_single:
+                return 4;
+            case data_type::float_double:
+            case data_type::int64:
+            case data_type::uint64:
+                return 8;
+            default:
+                throw std::runtime_error(fmt::format("Unsupported MAT storage type {}", (int)type));
+            }
+        }
+
+        template <typename S, typename T> void convert(byte_source &src, T *out, std::size_t count)
+        {
+            std::array<S, 4096> chunk;
+            while (count > 0)
+            {
+                const std::size_t step = std::min(count, chunk.size());
+                src.read(chunk.data(), step * sizeof(S));
+                std::copy(chunk.begin(), chunk.begin() + step, out);
+                out += step;
+                count -= step;
+            }
+        }
+
+        template <typename T> void read_real(byte_source &src, data_type type, T *out, std::size_t count)
+        {
+            if (type == type_tag<T>::Tag)
+                return src.read(out, count * sizeof(T));
+
+            switch (type)
+            {
+            case data_type::int8:
+                return convert<int8_t>(src, out, count);
+            case data_type::uint8:
+                return convert<uint8_t>(src, out, count);
+            case data_type::int16:
+                return convert<int16_t>(src, out, count);
+            case data_type::uint16:
+                return convert<uint16_t>(src, out, count);
+            case data_type::int32:
+                return convert<int32_t>(src, out, count);
+            case data_type::uint32:
+                return convert<uint32_t>(src, out, count);
+            case data_type::float_single:
+                return convert<float>(src, out, count);
+            case data_type::float_double:
+                return convert<double>(src, out, count);
+            case data_type::int64:
+                return convert<int64_t>(src, out, count);
+            case data_type::uint64:
+                return convert<uint64_t>(src, out, count);
+            default:
+                throw std::runtime_error(fmt::format("Unsupported MAT storage type {}", (int)type));
+            }
+        }
+    } // namespace
+
+    std::size_t variable::count() const
+    {
+        std::size_t count = 1;
+        for (int32_t dim : dimensions)
+            count *= dim;
+        return count;
+    }
+
+    reader::reader(const std::string &path)
+    {
+#ifdef __unix__
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            throw std::system_error(errno, std::system_category(), fmt::format("Cannot open '{}'", path));
+
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+        {
+            close(fd);
+            throw std::system_error(errno, std::system_category(), fmt::format("Cannot stat '{}'", path));
+        }
+
+        m_size = st.st_size;
+        if (m_size > 0)
+        {
+            void *mapping = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED)
+                throw std::system_error(errno, std::system_category(), fmt::format("Cannot map '{}'", path));
+            m_data = (const uint8_t *)mapping;
+            m_mapped = true;
+        }
+        else
+        {
+            close(fd);
+        }
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            throw std::runtime_error(fmt::format("Cannot open '{}'", path));
+        m_buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+#endif
+
+        if (m_size < HEADER_SIZE || m_data[126] != 'I' || m_data[127] != 'M')
+        {
+            unmap();
+            throw std::runtime_error(fmt::format("'{}' is not a little endian level 5 MAT file", path));
+        }
+
+        try
+        {
+            parse(HEADER_SIZE);
+        }
+        catch (...)
+        {
+            unmap();
+            throw;
+        }
+    }
+
+    reader::reader(const uint8_t *data, std::size_t size) : m_data(data), m_size(size) { parse(0); }
+
+    reader::~reader() { unmap(); }
+
+    void reader::unmap()
+    {
+#ifdef __unix__
+        if (m_mapped)
+            munmap((void *)m_data, m_size);
+        m_mapped = false;
+#endif
+    }
+
+    void reader::parse(std::size_t offset)
+    {
+        while (offset + 8 <= m_size)
+        {
+            uint32_t type;
+            uint32_t size;
+            std::memcpy(&type, m_data + offset, 4);
+            std::memcpy(&size, m_data + offset + 4, 4);
+            if (size > m_size - offset - 8)
+                throw std::runtime_error(fmt::format("MAT element at offset {} is truncated", offset));
+
+            variable var;
+            var.m_offset = offset;
+            var.m_size = size;
+
+            if ((data_type)type == data_type::matrix)
+            {
+                memory_source src{m_data, offset + 8, offset + 8 + size};
+                const tag real = read_matrix_header(src, var);
+                var.m_storage = real.type;
+                var.m_data_size = real.size;
+                var.m_data_offset = src.position() - (real.small ? 4 : 0);
+                m_variables.push_back(std::move(var));
+            }
+            else if ((data_type)type == data_type::compressed)
+            {
+                inflate_source src{m_data + offset + 8, size};
+                if (read_tag(src).type != data_type::matrix)
+                    throw std::runtime_error("Compressed MAT element does not hold a matrix");
+                var.m_compressed = true;
+                const tag real = read_matrix_header(src, var);
+                var.m_storage = real.type;
+                var.m_data_size = real.size;
+                m_variables.push_back(std::move(var));
+            }
+            else
+            {
+                spdlog::debug("Skipping MAT element of type {} at offset {}", type, offset);
+            }
+
+            offset += 8 + size;
+            if ((data_type)type != data_type::compressed)
+                offset += padding(size);
+        }
+    }
+
+    const variable &reader::find(std::string_view name) const
+    {
+        for (const auto &var : m_variables)
+        {
+            if (var.name == name)
+                return var;
+        }
+        throw std::out_of_range(fmt::format("No variable named '{}'", name));
+    }
+
+    template <typename T> array_view<T> reader::view(const variable &var) const
+    {
+        if (var.compressed())
+            throw std::logic_error(fmt::format("Variable '{}' is compressed and cannot be viewed", var.name));
+        if (!var.numeric() || var.m_storage != type_tag<T>::Tag)
+            throw std::logic_error(fmt::format("Variable '{}' is not stored as the requested type", var.name));
+        if (var.m_data_size != var.count() * sizeof(T))
+            throw std::runtime_error(fmt::format("Variable '{}' has inconsistent size", var.name));
+
+        return array_view<T>{(const T *)(m_data + var.m_data_offset), var.count()};
+    }
+
+    template <typename T> void reader::read(const variable &var, std::vector<T> &out) const
+    {
+        if (!var.numeric())
+            throw std::logic_error(fmt::format("Variable '{}' is not a numeric array", var.name));
+        if (var.m_data_size != var.count() * storage_size(var.m_storage))
+            throw std::runtime_error(fmt::format("Variable '{}' has inconsistent size", var.name));
+
+        out.resize(var.count());
+        if (!var.compressed())
+        {
+            memory_source src{m_data, var.m_data_offset, var.m_data_offset + var.m_data_size};
+            read_real(src, var.m_storage, out.data(), out.size());
+            return;
+        }
+
+        inflate_source src{m_data + var.m_offset + 8, var.m_size};
+        read_tag(src);
+        variable header;
+        const tag real = read_matrix_header(src, header);
+        if (real.small)
+        {
+            memory_source small{real.small_data.data(), 0, real.size};
+            read_real(small, real.type, out.data(), out.size());
+        }
+        else
+        {
+            read_real(src, real.type, out.data(), out.size());
+        }
+    }
+
+    template array_view<double> reader::view(const variable &) const;
+    template array_view<float> reader::view(const variable &) const;
+    template array_view<uint8_t> reader::view(const variable &) const;
+    template array_view<uint16_t> reader::view(const variable &) const;
+    template array_view<uint32_t> reader::view(const variable &) const;
+    template void reader::read(const variable &, std::vector<double> &) const;
+    template void reader::read(const variable &, std::vector<float> &) const;
+    template void reader::read(const variable &, std::vector<uint8_t> &) const;
+    template void reader::read(const variable &, std::vector<uint16_t> &) const;
+    template void reader::read(const variable &, std::vector<uint32_t> &) const;
+} // namespace mat
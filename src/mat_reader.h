@@ -0,0 +1,96 @@
+#pragma once
+
+#include "mat_writer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mat
+{
+    template <typename T> class array_view
+    {
+        const T *m_data = nullptr;
+        std::size_t m_size = 0;
+
+      public:
+        array_view() = default;
+        array_view(const T *data, std::size_t size) : m_data(data), m_size(size) {}
+
+        const T *data() const { return m_data; }
+        std::size_t size() const { return m_size; }
+        const T *begin() const { return m_data; }
+        const T *end() const { return m_data + m_size; }
+        const T &operator[](std::size_t i) const { return m_data[i]; }
+    };
+
+    // Top-level variable of a MAT file, only the header is parsed when the file is opened
+    class variable
+    {
+        friend class reader;
+
+        std::size_t m_offset = 0;
+        std::size_t m_size = 0;
+        bool m_compressed = false;
+        data_type m_storage = data_type::float_double;
+        std::size_t m_data_offset = 0;
+        std::size_t m_data_size = 0;
+
+      public:
+        static constexpr uint32_t CLASS_STRUCT = 2;
+
+        std::string name;
+        uint32_t class_id = 0;
+        bool logical = false;
+        bool complex = false;
+        std::vector<int32_t> dimensions;
+
+        bool compressed() const { return m_compressed; }
+        bool numeric() const { return class_id >= 6 && class_id <= 15; }
+        std::size_t count() const;
+    };
+
+    // Counterpart of the writer: maps a level 5 MAT file and walks its tags. Uncompressed numeric
+    // variables can be accessed in place, compressed ones are inflated chunk by chunk straight into
+    // the destination.
+    class reader
+    {
+        const uint8_t *m_data = nullptr;
+        std::size_t m_size = 0;
+        bool m_mapped = false;
+        std::vector<uint8_t> m_buffer;
+        std::vector<variable> m_variables;
+
+        void parse(std::size_t offset);
+        void unmap();
+
+      public:
+        explicit reader(const std::string &path);
+        // Bare sequence of data elements without the file header, `data` has to outlive the reader
+        reader(const uint8_t *data, std::size_t size);
+        reader(const reader &) = delete;
+        reader &operator=(const reader &) = delete;
+        ~reader();
+
+        const std::vector<variable> &variables() const { return m_variables; }
+        const variable &find(std::string_view name) const;
+
+        // Real part of an uncompressed variable stored as T, pointing into the mapping
+        template <typename T> array_view<T> view(const variable &var) const;
+        // Real part of any numeric variable, converted to T if stored differently
+        template <typename T> void read(const variable &var, std::vector<T> &out) const;
+    };
+
+    extern template array_view<double> reader::view(const variable &) const;
+    extern template array_view<float> reader::view(const variable &) const;
+    extern template array_view<uint8_t> reader::view(const variable &) const;
+    extern template array_view<uint16_t> reader::view(const variable &) const;
+    extern template array_view<uint32_t> reader::view(const variable &) const;
+    extern template void reader::read(const variable &, std::vector<double> &) const;
+    extern template void reader::read(const variable &, std::vector<float> &) const;
+    extern template void reader::read(const variable &, std::vector<uint8_t> &) const;
+    extern template void reader::read(const variable &, std::vector<uint16_t> &) const;
+    extern template void reader::read(const variable &, std::vector<uint32_t> &) const;
+} // namespace mat
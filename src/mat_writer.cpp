@@ -1,10 +1,43 @@
 #include "mat_writer.h"
 #include "mat_writer_p.h"
+#include <algorithm>
+#include <limits>
 #include <spdlog/fmt/ostr.h>
 #include <spdlog/spdlog.h>
+#include <stdexcept>
 
 namespace mat
 {
+    namespace
+    {
+        // Elements produced by one generator call
+        constexpr std::size_t GENERATED_BLOCK = 8192;
+
+        template <typename T> struct generated_element : public element<T>
+        {
+            const typename numeric_array<T>::generator &fill;
+
+            generated_element(const typename numeric_array<T>::generator &fill, size_t count)
+                : element<T>(nullptr, count), fill(fill)
+            {
+            }
+
+            void write(std::ostream &os) const override
+            {
+                std::vector<T> block(std::min(this->count, GENERATED_BLOCK));
+                for (std::size_t first = 0; first < this->count; first += block.size())
+                {
+                    const std::size_t n = std::min(block.size(), this->count - first);
+                    fill(first, n, block.data());
+                    os.write((const char *)block.data(), n * sizeof(T));
+                }
+
+                char zeros[8] = {0};
+                os.write(zeros, (8 - this->byte_size()) % 8);
+            }
+        };
+    } // namespace
+
     std::ostream &operator<<(std::ostream &os, data_type t)
     {
         switch (t)
@@ -35,13 +68,18 @@ namespace mat
     }
     std::ostream &operator<<(std::ostream &str, const data_element &d)
     {
-        spdlog::debug("Writing {} data element of size {}", d.type(), d.byte_size());
+        const uint64_t size = d.byte_size();
+        spdlog::debug("Writing {} data element of size {}", d.type(), size);
+        // Element sizes are 32 bit, larger variables would silently wrap around
+        if (size > std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error(fmt::format(
+                "A {} byte variable does not fit the 4 GB limit of MAT v5 files, save it with --format mat73", size));
 
         uint32_t tmp = (uint32_t)d.type();
         char *p_cTmp = (char *)&tmp;
 
         str.write(p_cTmp, 4);
-        tmp = d.byte_size();
+        tmp = (uint32_t)size;
         str.write(p_cTmp, 4);
         d.write(str);
         return str;
@@ -63,7 +101,7 @@ namespace mat
         return str;
     }
 
-    uint32_t matrix::byte_size() const
+    uint64_t matrix::byte_size() const
     {
         return (
             // Flags array
@@ -94,6 +132,108 @@ namespace mat
         os << make_element(m_data);
     }
 
+    template <typename T> std::size_t numeric_array<T>::count() const
+    {
+        std::size_t count = 1;
+        for (int32_t dim : m_dimensions)
+            count *= dim;
+        return count;
+    }
+
+    template <typename T> uint64_t numeric_array<T>::byte_size() const
+    {
+        return (
+            // Flags array
+            header_size() + 8 +
+            // Dimensions array
+            header_size() + element<int32_t>{nullptr, m_dimensions.size()}.aligned_size() +
+            // name array
+            header_size() + element<char>{nullptr, m_name.size()}.aligned_size() +
+            // real data array
+            header_size() + element<T>{nullptr, count()}.aligned_size());
+    }
+
+    template <typename T> void numeric_array<T>::write(std::ostream &os) const
+    {
+        constexpr uint32_t F_LOGICAL = (1 << 9);
+
+        std::array<uint32_t, 2> flags;
+        flags[0] = type_tag<T>::Class | (m_logical ? F_LOGICAL : 0);
+        flags[1] = 0;
+        os << make_element(flags);
+        os << element<int32_t>{m_dimensions.data(), m_dimensions.size()};
+        os << make_element<char>(m_name);
+        if (m_fill)
+            os << generated_element<T>{m_fill, count()};
+        else
+            os << element<T>{m_data, count()};
+    }
+
+    template class numeric_array<double>;
+    template class numeric_array<float>;
+    template class numeric_array<uint8_t>;
+    template class numeric_array<uint16_t>;
+    template class numeric_array<uint32_t>;
+
+    namespace
+    {
+        constexpr uint32_t FIELD_NAME_LENGTH = 32;
+    }
+
+    structure &structure::field(std::string name, std::vector<double> values)
+    {
+        if (name.empty() || name.size() >= FIELD_NAME_LENGTH)
+            throw std::invalid_argument(fmt::format("Invalid struct field name '{}'", name));
+
+        m_fields.emplace_back(std::move(name), std::move(values));
+        return *this;
+    }
+
+    uint64_t structure::byte_size() const
+    {
+        uint64_t size =
+            // Flags array
+            header_size() + 8 +
+            // Dimensions array
+            header_size() + 8 +
+            // name array
+            header_size() + element<char>{nullptr, m_name.size()}.aligned_size() +
+            // field name length, small data element
+            8 +
+            // field names
+            header_size() + element<char>{nullptr, m_fields.size() * FIELD_NAME_LENGTH}.aligned_size();
+
+        for (const auto &[name, values] : m_fields)
+        {
+            const numeric_array<double> value{"", values.data(), {1, (int32_t)values.size()}};
+            size += header_size() + value.aligned_size();
+        }
+
+        return size;
+    }
+
+    void structure::write(std::ostream &os) const
+    {
+        constexpr uint32_t CLASS_STRUCT = 2;
+
+        std::array<uint32_t, 2> flags{CLASS_STRUCT, 0};
+        std::array<int32_t, 2> dimensions{1, 1};
+        os << make_element(flags);
+        os << make_element(dimensions);
+        os << make_element<char>(m_name);
+
+        const std::array<uint32_t, 2> name_length{(4 << 16) | (uint32_t)data_type::int32, FIELD_NAME_LENGTH};
+        os.write((const char *)name_length.data(), sizeof(name_length));
+
+        std::string names(m_fields.size() * FIELD_NAME_LENGTH, '\0');
+        for (std::size_t i = 0; i < m_fields.size(); i++)
+            m_fields[i].first.copy(&names[i * FIELD_NAME_LENGTH], FIELD_NAME_LENGTH - 1);
+        os << make_element<char>(names);
+
+        for (const auto &[name, values] : m_fields)
+            os << numeric_array<double>{"", values.data(), {1, (int32_t)values.size()}};
+    }
+
     // std::ostream &operator<<(std::ostream &str, const matrix &matrix)
     // {
     //     uint32_t type = 0x0e; // matrix
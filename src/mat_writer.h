@@ -2,6 +2,7 @@
 
 #include <array>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <ostream>
 #include <streambuf>
@@ -39,12 +40,12 @@ namespace mat
 
         virtual ~data_element() {}
 
-        uint32_t aligned_size() const { return ((byte_size() + 7) / 8) * 8; }
+        uint64_t aligned_size() const { return ((byte_size() + 7) / 8) * 8; }
 
       protected:
         virtual data_type type() const = 0;
         constexpr uint32_t header_size() const { return 8; }
-        virtual uint32_t byte_size() const = 0;
+        virtual uint64_t byte_size() const = 0;
         virtual void write(std::ostream &os) const = 0;
     };
 
@@ -56,7 +57,7 @@ namespace mat
 
       protected:
         data_type type() const override { return data_type::matrix; }
-        uint32_t byte_size() const override;
+        uint64_t byte_size() const override;
         void write(std::ostream &os) const override;
 
       public:
@@ -66,6 +67,70 @@ namespace mat
         }
     };
 
+    // N-dimensional numeric array stored column-major (as MATLAB does), `data` must outlive it
+    template <typename T> class numeric_array : public data_element
+    {
+      public:
+        // Writes elements [first, first + count) in column-major order to `out`
+        using generator = std::function<void(std::size_t first, std::size_t count, T *out)>;
+
+      private:
+        std::string m_name;
+        const T *m_data;
+        generator m_fill;
+        std::vector<int32_t> m_dimensions;
+        bool m_logical = false;
+
+      protected:
+        data_type type() const override { return data_type::matrix; }
+        uint64_t byte_size() const override;
+        void write(std::ostream &os) const override;
+
+      public:
+        numeric_array(std::string name, const T *data, std::vector<int32_t> dimensions)
+            : m_name(std::move(name)), m_data(data), m_dimensions(std::move(dimensions))
+        {
+        }
+        // The data is produced piece by piece while it is written, so it never exists as a whole
+        numeric_array(std::string name, generator fill, std::vector<int32_t> dimensions)
+            : m_name(std::move(name)), m_data(nullptr), m_fill(std::move(fill)), m_dimensions(std::move(dimensions))
+        {
+        }
+
+        // Marks uint8 data as MATLAB logical
+        numeric_array &logical()
+        {
+            m_logical = true;
+            return *this;
+        }
+
+        std::size_t count() const;
+    };
+
+    extern template class numeric_array<double>;
+    extern template class numeric_array<float>;
+    extern template class numeric_array<uint8_t>;
+    extern template class numeric_array<uint16_t>;
+    extern template class numeric_array<uint32_t>;
+
+    // 1x1 struct with double row vectors as fields, field names are limited to 31 characters
+    class structure : public data_element
+    {
+        std::string m_name;
+        std::vector<std::pair<std::string, std::vector<double>>> m_fields;
+
+      protected:
+        data_type type() const override { return data_type::matrix; }
+        uint64_t byte_size() const override;
+        void write(std::ostream &os) const override;
+
+      public:
+        explicit structure(std::string name) : m_name(std::move(name)) {}
+
+        structure &field(std::string name, std::vector<double> values);
+        structure &field(std::string name, double value) { return field(std::move(name), std::vector<double>{value}); }
+    };
+
     class compressed_section_priv;
     class compressed_section : public std::streambuf, public std::ostream, public data_element
     {
@@ -74,13 +139,16 @@ namespace mat
 
       protected:
         int overflow(int c) override;
+        std::streamsize xsputn(const char *s, std::streamsize n) override;
 
         data_type type() const override { return data_type::compressed; };
-        uint32_t byte_size() const override;
+        uint64_t byte_size() const override;
         void write(std::ostream &os) const override;
 
       public:
         void finish();
+        // Starts a new section, keeping the zlib state and buffers
+        void reset(int level);
 
         compressed_section(int level);
         ~compressed_section();
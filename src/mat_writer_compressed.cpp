@@ -1,6 +1,8 @@
 #include "mat_writer.h"
 #include "mat_writer_p.h"
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <spdlog/spdlog.h>
 #include <zlib.h>
 
@@ -9,8 +11,9 @@ namespace mat
     struct ZlibDeflate
     {
         z_stream strm;
+        int level;
 
-        ZlibDeflate(int level)
+        ZlibDeflate(int level) : level(level)
         {
             strm.zalloc = Z_NULL;
             strm.zfree = Z_NULL;
@@ -23,6 +26,16 @@ namespace mat
 
         ~ZlibDeflate() { deflateEnd(*this); }
 
+        void reset(int new_level)
+        {
+            int ret = deflateReset(*this);
+            if (ret == Z_OK && new_level != level)
+                ret = deflateParams(*this, new_level, Z_DEFAULT_STRATEGY);
+            if (ret != Z_OK)
+                throw std::runtime_error("Cannot reset zlib deflate");
+            level = new_level;
+        }
+
         void setInBuffer(const std::uint8_t *buffer, std::size_t size)
         {
             strm.avail_in = size;
@@ -49,7 +62,7 @@ namespace mat
         std::array<uint8_t, 16384> buffer_in;
         std::array<uint8_t, 16384> buffer_out;
         ZlibDeflate zlib;
-        int ret;
+        int ret = Z_OK;
 
         compressed_section_priv(int level) : zlib{level}
         {
@@ -57,6 +70,15 @@ namespace mat
             zlib.setOutBuffer(buffer_out.begin(), buffer_out.size());
         }
 
+        void reset(int level)
+        {
+            zlib.reset(level);
+            written = 0;
+            ret = Z_OK;
+            zlib.setInBuffer(buffer_in.cbegin(), 0);
+            zlib.setOutBuffer(buffer_out.begin(), buffer_out.size());
+        }
+
         bool has_data_to_read() { return zlib.outBufferSpace() != buffer_out.size(); }
         bool is_out_buffer_full() { return zlib.outBufferSpace() == 0; }
         bool finished() { return ret == Z_STREAM_END; }
@@ -104,6 +126,33 @@ namespace mat
             buffer_in[written++] = ch;
             return (written == buffer_in.size());
         }
+
+        // Copies as much as fits into the input buffer, returns true once it is full
+        bool process_bytes(const uint8_t *&data, std::size_t &size)
+        {
+            const std::size_t count = std::min(size, buffer_in.size() - written);
+            std::memcpy(buffer_in.data() + written, data, count);
+            written += count;
+            data += count;
+            size -= count;
+            return (written == buffer_in.size());
+        }
+
+        void compress_input(std::vector<uint8_t> &buffer)
+        {
+            while (process_buffer(false))
+                readout_data(buffer);
+
+            assert(zlib.inBufferSpace() == 0);
+        }
+
+        // Deflates straight from the caller's memory, the input buffer has to be empty
+        void compress_direct(const uint8_t *data, std::size_t size, std::vector<uint8_t> &buffer)
+        {
+            assert(written == 0 && zlib.inBufferSpace() == 0);
+            zlib.setInBuffer(data, size);
+            compress_input(buffer);
+        }
     };
 
     compressed_section::compressed_section(int level)
@@ -113,6 +162,13 @@ namespace mat
 
     compressed_section::~compressed_section() {}
 
+    void compressed_section::reset(int level)
+    {
+        m_data->reset(level);
+        m_buffer.clear();
+        clear();
+    }
+
     void compressed_section::finish()
     {
         while (!m_data->finished())
@@ -130,17 +186,31 @@ namespace mat
             throw std::logic_error("Tried to insert more data into finished buffer");
 
         if (m_data->process_byte(c))
-        {
-            while (m_data->process_buffer(false))
-                m_data->readout_data(m_buffer);
-
-            assert(m_data->zlib.inBufferSpace() == 0);
-        }
+            m_data->compress_input(m_buffer);
 
         return c;
     }
 
-    uint32_t compressed_section::byte_size() const
+    std::streamsize compressed_section::xsputn(const char *s, std::streamsize n)
+    {
+        if (m_data->finished())
+            throw std::logic_error("Tried to insert more data into finished buffer");
+
+        const uint8_t *data = (const uint8_t *)s;
+        std::size_t size = n;
+        if (m_data->written > 0 && m_data->process_bytes(data, size))
+            m_data->compress_input(m_buffer);
+
+        // Large writes skip the copy into the input buffer
+        if (size >= m_data->buffer_in.size())
+            m_data->compress_direct(data, size, m_buffer);
+        else if (size > 0 && m_data->process_bytes(data, size))
+            m_data->compress_input(m_buffer);
+
+        return n;
+    }
+
+    uint64_t compressed_section::byte_size() const
     {
         if (!m_data->finished())
             throw std::logic_error("Tried to get size of not finished buffer");
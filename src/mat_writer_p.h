@@ -11,22 +11,23 @@ namespace mat
 {
     template <typename T> struct type_tag;
 
-#define T(type, tag)                                                                                                   \
+#define T(type, tag, class_id)                                                                                         \
     template <> struct type_tag<type>                                                                                  \
     {                                                                                                                  \
         using Type = type;                                                                                             \
         static constexpr data_type Tag = data_type::tag;                                                               \
+        static constexpr uint32_t Class = class_id;                                                                    \
     }
 
-    T(char, int8);
-    T(int8_t, int8);
-    T(uint8_t, uint8);
-    T(int16_t, int16);
-    T(uint16_t, uint16);
-    T(int32_t, int32);
-    T(uint32_t, uint32);
-    T(float, float_single);
-    T(double, float_double);
+    T(char, int8, 4);
+    T(int8_t, int8, 8);
+    T(uint8_t, uint8, 9);
+    T(int16_t, int16, 10);
+    T(uint16_t, uint16, 11);
+    T(int32_t, int32, 12);
+    T(uint32_t, uint32, 13);
+    T(float, float_single, 7);
+    T(double, float_double, 6);
 
 #undef T
 
@@ -39,15 +40,11 @@ namespace mat
 
         data_type type() const override { return type_tag<T>::Tag; }
 
-        constexpr uint32_t byte_size() const override { return count * sizeof(T); }
+        constexpr uint64_t byte_size() const override { return count * sizeof(T); }
 
         void write(std::ostream &os) const override
         {
-            for (size_t i = 0; i < count; i++)
-            {
-                const char *p = (char *)(&start[i]);
-                os.write(p, sizeof(T));
-            }
+            os.write((const char *)start, count * sizeof(T));
 
             char zeros[8] = {0};
             os.write(zeros, (8 - byte_size()) % 8);
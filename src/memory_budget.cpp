@@ -0,0 +1,249 @@
+#include "memory_budget.h"
+#include "realtime.h"
+
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <fstream>
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+    // A MAT 7.3 compression thread holds its scratch chunk, a generated chunk and two compressed ones
+    constexpr std::size_t CHUNK_BUFFERS = 4;
+
+    // A waveform matrix (separate or combined) is written, what chunk streaming applies to
+    bool waveform_matrix(const capture_request &request)
+    {
+        return (request.format == output_format::MAT || request.format == output_format::MAT73) && !request.events &&
+               !request.spectrum;
+    }
+
+    unsigned compressors(const capture_request &request, const capture_strategy &strategy)
+    {
+        if (strategy.compressors)
+            return strategy.compressors;
+        return request.mat73.threads ? request.mat73.threads : realtime::hardware_threads();
+    }
+
+    std::string mib(std::size_t bytes) { return fmt::format("{:.1f} MiB", bytes / 1048576.0); }
+} // namespace
+
+capture_strategy default_strategy(const capture_request &request)
+{
+    capture_strategy strategy;
+    strategy.buffered = request.frames > 1 || request.changes || request.decimation;
+    return strategy;
+}
+
+memory_estimate estimate_memory(const capture_request &request, std::size_t memory_depth,
+                                const capture_strategy &strategy)
+{
+    const std::size_t channels = request.channels.size();
+    const std::size_t samples = memory_depth * request.frames;
+    const std::size_t kept =
+        request.decimation ? decimated_points(memory_depth, request.decimation->factor) * request.frames : samples;
+    const std::size_t held = strategy.buffered ? channels : 1;
+
+    memory_estimate estimate;
+    estimate.downloads = held * samples;
+    if (request.decimation)
+        estimate.downloads += held * kept * sizeof(float);
+
+    // The largest variable, a MAT v5 file or container compresses one at a time in memory
+    std::size_t variable = 0;
+    if (waveform_matrix(request))
+    {
+        const std::size_t columns = request.layout == matrix_layout::COMBINED ? channels + 1 : 2;
+        variable = kept * columns * sizeof(double);
+        if (!strategy.chunked)
+            estimate.conversion += variable;
+    }
+    else if (request.format == output_format::CONTAINER)
+    {
+        variable = samples;
+    }
+
+    // Packed lines, the first pod of a frame and one unpacked line
+    if (request.logic)
+    {
+        estimate.downloads += samples * sizeof(uint16_t) + memory_depth;
+        if (request.logic->lines)
+            estimate.conversion += samples;
+    }
+
+    for (std::size_t factor : request.preview_factors)
+        estimate.conversion += 3 * sizeof(double) * decimated_points(memory_depth, factor) * request.frames;
+    if (!request.preview_factors.empty())
+        estimate.conversion += 2 * decimated_points(memory_depth, 16);
+
+    if (request.changes)
+    {
+        const bool deltas = request.changes->keyframe_interval != 0;
+        estimate.conversion += channels * samples * (deltas ? 2 : 1) + (deltas ? samples : 0);
+    }
+
+    if (request.format == output_format::MAT73)
+        estimate.compression = compressors(request, strategy) * CHUNK_BUFFERS * request.mat73.chunk_bytes;
+    else if (request.format == output_format::PACKED)
+        estimate.compression = samples;
+    else if (request.compression)
+        estimate.compression = variable;
+
+    if (request.format != output_format::MAT73 && request.format != output_format::CONTAINER)
+        estimate.output = file_sink::QUEUE_DEPTH * file_sink::BUFFER_SIZE;
+    return estimate;
+}
+
+capture_strategy plan_memory(const capture_request &request, std::size_t memory_depth, const capture_strategy &fastest,
+                             bool per_channel, memory_estimate &estimate)
+{
+    std::vector<capture_strategy> candidates{fastest};
+    if (per_channel && fastest.buffered && !default_strategy(request).buffered)
+    {
+        capture_strategy streamed = fastest;
+        streamed.buffered = false;
+        candidates.push_back(streamed);
+    }
+    if (waveform_matrix(request))
+    {
+        capture_strategy chunked = candidates.back();
+        chunked.chunked = true;
+        // The combined matrix is scaled from all channels at once
+        if (request.layout == matrix_layout::COMBINED)
+            chunked.buffered = true;
+        candidates.push_back(chunked);
+
+        if (request.format == output_format::MAT73)
+        {
+            for (unsigned threads = compressors(request, chunked) / 2; threads >= 1; threads /= 2)
+            {
+                chunked.compressors = threads;
+                candidates.push_back(chunked);
+            }
+        }
+    }
+
+    for (const capture_strategy &candidate : candidates)
+    {
+        estimate = estimate_memory(request, memory_depth, candidate);
+        if (estimate.total() <= request.memory_budget)
+        {
+            spdlog::debug("Capture needs {} (downloads {}, conversion {}, compression {}, output {}) with {}, "
+                          "budget {}",
+                          mib(estimate.total()), mib(estimate.downloads), mib(estimate.conversion),
+                          mib(estimate.compression), mib(estimate.output), describe(candidate),
+                          mib(request.memory_budget));
+            return candidate;
+        }
+    }
+
+    throw std::runtime_error(fmt::format("Capture needs at least {} with {}, more than the memory budget of {}",
+                                         mib(estimate.total()), describe(candidates.back()),
+                                         mib(request.memory_budget)));
+}
+
+std::string describe(const capture_strategy &strategy)
+{
+    std::string text = strategy.buffered ? "full buffering" : "per-channel streaming";
+    if (strategy.chunked)
+        text += ", chunk streaming to file";
+    if (strategy.compressors)
+        text += fmt::format(", {} compressor(s)", strategy.compressors);
+    return text;
+}
+
+std::size_t parse_memory_size(std::string_view value)
+{
+    const auto invalid = [&] {
+        return std::invalid_argument(
+            fmt::format("'{}' is not a valid memory size, expected bytes with an optional K, M or G suffix", value));
+    };
+
+    const std::size_t digits = value.find_first_not_of("0123456789");
+    if (digits == 0 || value.empty())
+        throw invalid();
+
+    std::size_t size = 0;
+    const std::string_view number = value.substr(0, digits);
+    if (std::from_chars(number.data(), number.data() + number.size(), size).ec != std::errc())
+        throw invalid();
+    if (digits == std::string_view::npos)
+        return size;
+
+    std::string_view suffix = value.substr(digits);
+    if (suffix.size() == 2 && std::toupper(suffix[1]) == 'B')
+        suffix = suffix.substr(0, 1);
+    if (suffix.size() != 1)
+        throw invalid();
+
+    const auto kilo = [&] {
+        if (size > SIZE_MAX / 1024)
+            throw invalid();
+        size *= 1024;
+    };
+    switch (std::toupper(suffix[0]))
+    {
+    case 'G':
+        kilo();
+        [[fallthrough]];
+    case 'M':
+        kilo();
+        [[fallthrough]];
+    case 'K':
+        kilo();
+        return size;
+    default:
+        throw invalid();
+    }
+}
+
+namespace memory_usage
+{
+    namespace
+    {
+        std::atomic<unsigned> overlapping{0};
+    } // namespace
+
+    overlapping_stages::overlapping_stages()
+    {
+        reset_peak();
+        overlapping++;
+    }
+
+    overlapping_stages::~overlapping_stages() { overlapping--; }
+
+    bool reset_peak()
+    {
+        if (overlapping)
+            return false;
+
+#ifdef __linux__
+        // "5" resets the peak RSS (VmHWM) to the current RSS, since Linux 4.0
+        std::ofstream file("/proc/self/clear_refs");
+        file << "5";
+        file.flush();
+        return bool(file);
+#else
+        return false;
+#endif
+    }
+
+    std::size_t peak()
+    {
+#ifdef __linux__
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, 6, "VmHWM:") == 0)
+                return std::stoull(line.substr(6)) * 1024;
+        }
+#endif
+        return 0;
+    }
+} // namespace memory_usage
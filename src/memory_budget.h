@@ -0,0 +1,56 @@
+#pragma once
+
+#include "capture.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Footprint of the capture buffers by purpose, in bytes. Event windows, spectra and digital line
+// transitions are not counted, they stay small next to the waveforms.
+struct memory_estimate
+{
+    // Raw codes, decimated samples and digital lines
+    std::size_t downloads = 0;
+    // Scaled and combined matrices, previews and the references unchanged channels are detected against
+    std::size_t conversion = 0;
+    // Compressed variables held until they are written, at their uncompressed size as the worst
+    // case, and MAT 7.3 chunk buffers
+    std::size_t compression = 0;
+    // Buffers of the output file
+    std::size_t output = 0;
+
+    std::size_t total() const { return downloads + conversion + compression + output; }
+};
+
+capture_strategy default_strategy(const capture_request &request);
+memory_estimate estimate_memory(const capture_request &request, std::size_t memory_depth,
+                                const capture_strategy &strategy);
+// The first strategy whose estimate fits request.memory_budget, trying `fastest`, then downloading one
+// channel at a time when `per_channel` allows it and the request does not need full buffering, then
+// chunk streaming and then fewer MAT 7.3 compressors. Throws std::runtime_error when none fits.
+capture_strategy plan_memory(const capture_request &request, std::size_t memory_depth, const capture_strategy &fastest,
+                             bool per_channel, memory_estimate &estimate);
+std::string describe(const capture_strategy &strategy);
+
+// Bytes with an optional K, M or G suffix (powers of 1024)
+std::size_t parse_memory_size(std::string_view value);
+
+namespace memory_usage
+{
+    // Starts a new peak measurement, false where the kernel cannot and peak() covers the whole process
+    bool reset_peak();
+
+    // While one is alive stages run concurrently and their peaks cannot be told apart, reset_peak()
+    // then keeps the peak so it covers the whole run
+    class overlapping_stages
+    {
+      public:
+        overlapping_stages();
+        overlapping_stages(const overlapping_stages &) = delete;
+        overlapping_stages &operator=(const overlapping_stages &) = delete;
+        ~overlapping_stages();
+    };
+    // Peak resident set size since reset_peak(), 0 where unknown
+    std::size_t peak();
+} // namespace memory_usage
@@ -0,0 +1,81 @@
+#include "page_buffer.h"
+
+#include <cstdint>
+#include <new>
+#include <spdlog/spdlog.h>
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace page_memory
+{
+    namespace
+    {
+        constexpr std::size_t PAGE_SIZE = 4096;
+        constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+    } // namespace
+
+    std::size_t round_up(std::size_t bytes, bool huge_pages)
+    {
+        const std::size_t unit = huge_pages && bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : PAGE_SIZE;
+        return (bytes + unit - 1) / unit * unit;
+    }
+
+    void *allocate(std::size_t bytes, bool huge_pages)
+    {
+        if (bytes == 0)
+            return nullptr;
+
+#ifdef __unix__
+        // The kernel only backs 2 MiB aligned ranges with huge pages, so huge page buffers are
+        // mapped with room to spare and trimmed to an aligned start
+        huge_pages = huge_pages && bytes >= HUGE_PAGE_SIZE;
+        const std::size_t slack = huge_pages ? HUGE_PAGE_SIZE - PAGE_SIZE : 0;
+        char *mapping =
+            (char *)mmap(nullptr, bytes + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+            throw std::bad_alloc();
+
+        char *data = mapping;
+        if (slack)
+        {
+            data = (char *)(((std::uintptr_t)mapping + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+            if (data != mapping)
+                munmap(mapping, data - mapping);
+            if (data + bytes != mapping + bytes + slack)
+                munmap(data + bytes, mapping + bytes + slack - (data + bytes));
+        }
+
+#ifdef MADV_HUGEPAGE
+        // Best effort, the kernel may still use small pages when it cannot find free huge pages
+        if (huge_pages && madvise(data, bytes, MADV_HUGEPAGE) != 0)
+            spdlog::debug("Transparent huge pages are not available");
+#endif
+#else
+        (void)huge_pages;
+        void *data = ::operator new(bytes, std::align_val_t(PAGE_SIZE));
+#endif
+
+        // Fault every page in now rather than in the middle of a transfer
+        volatile char *p = (volatile char *)data;
+        for (std::size_t offset = 0; offset < bytes; offset += PAGE_SIZE)
+            p[offset] = 0;
+
+        return data;
+    }
+
+    void release(void *data, std::size_t bytes)
+    {
+        if (!data)
+            return;
+
+#ifdef __unix__
+        munmap(data, bytes);
+#else
+        (void)bytes;
+        ::operator delete(data, std::align_val_t(PAGE_SIZE));
+#endif
+    }
+} // namespace page_memory
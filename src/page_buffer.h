@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+// Page aligned, pre-faulted memory that is only ever grown, so a buffer reused for every capture
+// stops touching the allocator once it has seen the largest one
+namespace page_memory
+{
+    void *allocate(std::size_t bytes, bool huge_pages);
+    void release(void *data, std::size_t bytes);
+    // Whole pages, or whole huge pages for huge page buffers of at least one huge page
+    std::size_t round_up(std::size_t bytes, bool huge_pages = false);
+} // namespace page_memory
+
+template <typename T> class page_buffer
+{
+    static_assert(std::is_trivially_copyable_v<T>, "page_buffer only holds plain data");
+
+    T *m_data = nullptr;
+    std::size_t m_size = 0;
+    std::size_t m_capacity_bytes = 0;
+    bool m_huge_pages = false;
+
+  public:
+    page_buffer() = default;
+    explicit page_buffer(bool huge_pages) : m_huge_pages(huge_pages) {}
+    page_buffer(const page_buffer &) = delete;
+    page_buffer &operator=(const page_buffer &) = delete;
+    page_buffer(page_buffer &&other) noexcept { *this = std::move(other); }
+    page_buffer &operator=(page_buffer &&other) noexcept
+    {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_capacity_bytes, other.m_capacity_bytes);
+        std::swap(m_huge_pages, other.m_huge_pages);
+        return *this;
+    }
+    ~page_buffer() { page_memory::release(m_data, m_capacity_bytes); }
+
+    void set_huge_pages(bool huge_pages) { m_huge_pages = huge_pages; }
+
+    // Grows geometrically, existing elements are kept
+    void reserve(std::size_t count)
+    {
+        if (count * sizeof(T) <= m_capacity_bytes)
+            return;
+
+        const std::size_t bytes = page_memory::round_up(std::max(count * sizeof(T), m_capacity_bytes * 2), m_huge_pages);
+        T *data = (T *)page_memory::allocate(bytes, m_huge_pages);
+        if (m_size)
+            std::memcpy(data, m_data, m_size * sizeof(T));
+        page_memory::release(m_data, m_capacity_bytes);
+        m_data = data;
+        m_capacity_bytes = bytes;
+    }
+
+    // New elements are not initialised (but pages are zero when first allocated)
+    void resize(std::size_t count)
+    {
+        reserve(count);
+        m_size = count;
+    }
+
+    void clear() { m_size = 0; }
+
+    T *data() { return m_data; }
+    const T *data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+    std::size_t capacity() const { return m_capacity_bytes / sizeof(T); }
+    bool empty() const { return m_size == 0; }
+
+    T *begin() { return m_data; }
+    T *end() { return m_data + m_size; }
+    const T *begin() const { return m_data; }
+    const T *end() const { return m_data + m_size; }
+    T &operator[](std::size_t i) { return m_data[i]; }
+    const T &operator[](std::size_t i) const { return m_data[i]; }
+};
@@ -0,0 +1,529 @@
+#include "plan.h"
+#include "memory_budget.h"
+#include "realtime.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <spdlog/spdlog.h>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+namespace
+{
+    // Just enough JSON for plan files: objects, arrays and scalars, the latter kept as text
+    class json_reader
+    {
+        std::string_view m_text;
+        std::size_t m_position = 0;
+
+        void skip_space()
+        {
+            while (m_position < m_text.size() && std::isspace((unsigned char)m_text[m_position]))
+                m_position++;
+        }
+
+        bool consume(char ch)
+        {
+            skip_space();
+            if (m_position == m_text.size() || m_text[m_position] != ch)
+                return false;
+            m_position++;
+            return true;
+        }
+
+        void expect(char ch)
+        {
+            if (!consume(ch))
+                fail(fmt::format("expected '{}'", ch));
+        }
+
+        std::string string()
+        {
+            expect('"');
+            std::string value;
+            while (true)
+            {
+                if (m_position == m_text.size())
+                    fail("unterminated string");
+
+                const char ch = m_text[m_position++];
+                if (ch == '"')
+                    return value;
+                if (ch != '\\')
+                {
+                    value.push_back(ch);
+                    continue;
+                }
+
+                if (m_position == m_text.size())
+                    fail("unterminated string");
+                switch (const char escaped = m_text[m_position++])
+                {
+                case 'n':
+                    value.push_back('\n');
+                    break;
+                case 't':
+                    value.push_back('\t');
+                    break;
+                case '"':
+                case '\\':
+                case '/':
+                    value.push_back(escaped);
+                    break;
+                default:
+                    fail(fmt::format("unsupported escape '\\{}'", escaped));
+                }
+            }
+        }
+
+      public:
+        explicit json_reader(std::string_view text) : m_text(text) {}
+
+        [[noreturn]] void fail(std::string_view what) const
+        {
+            const std::size_t line = 1 + std::count(m_text.begin(), m_text.begin() + m_position, '\n');
+            throw std::runtime_error(fmt::format("Plan line {}: {}", line, what));
+        }
+
+        // Calls `member(name)` for every member, which has to read its value
+        template <typename F> void object(F &&member)
+        {
+            expect('{');
+            if (consume('}'))
+                return;
+            do
+            {
+                skip_space();
+                const std::string name = string();
+                expect(':');
+                member(name);
+            } while (consume(','));
+            expect('}');
+        }
+
+        template <typename F> void array(F &&element)
+        {
+            expect('[');
+            if (consume(']'))
+                return;
+            do
+                element();
+            while (consume(','));
+            expect(']');
+        }
+
+        // A string or number as written, true and false as 1 and 0, arrays of them joined by commas
+        std::string scalar()
+        {
+            skip_space();
+            if (m_position == m_text.size())
+                fail("expected a value");
+
+            const char ch = m_text[m_position];
+            if (ch == '"')
+                return string();
+            if (ch == '[')
+            {
+                std::string joined;
+                array([&] { joined += (joined.empty() ? "" : ",") + scalar(); });
+                return joined;
+            }
+
+            const std::size_t end = m_text.find_first_of(",}] \t\r\n", m_position);
+            const std::string_view token = m_text.substr(m_position, end - m_position);
+            if (token.empty() || token == "null" || ch == '{')
+                fail("expected a string, number, boolean or array");
+            m_position += token.size();
+            if (token == "true")
+                return "1";
+            if (token == "false")
+                return "0";
+            return std::string(token);
+        }
+
+        void finish()
+        {
+            skip_space();
+            if (m_position != m_text.size())
+                fail("unexpected text after the plan");
+        }
+    };
+
+    using parameters = std::vector<std::pair<std::string, std::string>>;
+
+    // Step values replace the defaults, the keys switching a mode on go first so that keys adjusting
+    // the mode work whichever object and order they are listed in
+    void apply_parameters(plan_step &step, const parameters &common, const parameters &values)
+    {
+        parameters merged = common;
+        for (const auto &[key, value] : values)
+        {
+            const auto it = std::find_if(merged.begin(), merged.end(), [&](const auto &p) { return p.first == key; });
+            if (it != merged.end())
+                it->second = value;
+            else
+                merged.emplace_back(key, value);
+        }
+        std::stable_partition(merged.begin(), merged.end(), [](const auto &p) { return is_mode_parameter(p.first); });
+
+        for (const auto &[key, value] : merged)
+        {
+            if (key == "memory_depth")
+                step.memory_depth = std::stoul(value);
+            else
+                set_request_parameter(step.request, key, value);
+        }
+    }
+
+    // What a step needs the scope to be set to
+    struct scope_configuration
+    {
+        std::optional<std::size_t> memory_depth;
+        // Enabled channels, sorted
+        std::vector<rigol::channel> channels;
+        bool recording = false;
+    };
+
+    std::vector<rigol::channel> enabled_channels(const plan_step &step)
+    {
+        std::vector<rigol::channel> channels = step.request.channels;
+        std::sort(channels.begin(), channels.end());
+        channels.erase(std::unique(channels.begin(), channels.end()), channels.end());
+        return channels;
+    }
+
+    struct reconfiguration
+    {
+        bool memory_depth = false;
+        std::size_t channels = 0;
+        bool mode = false;
+
+        // A memory depth change restarts acquisition and invalidates every preamble, a channel
+        // change alters the sample rate and a recording mode switch is a couple of commands
+        unsigned cost() const { return (memory_depth ? 100 : 0) + 10 * (unsigned)channels + (mode ? 1 : 0); }
+    };
+
+    reconfiguration changes(const scope_configuration &from, const plan_step &to)
+    {
+        reconfiguration result;
+        result.memory_depth = to.memory_depth && to.memory_depth != from.memory_depth;
+
+        const std::vector<rigol::channel> channels = enabled_channels(to);
+        std::vector<rigol::channel> toggled;
+        std::set_symmetric_difference(from.channels.begin(), from.channels.end(), channels.begin(), channels.end(),
+                                      std::back_inserter(toggled));
+        result.channels = toggled.size();
+
+        result.mode = (to.request.frames > 1) != from.recording;
+        return result;
+    }
+
+    void advance(scope_configuration &configuration, const plan_step &step)
+    {
+        if (step.memory_depth)
+            configuration.memory_depth = step.memory_depth;
+        configuration.channels = enabled_channels(step);
+        configuration.recording = step.request.frames > 1;
+    }
+
+    struct reconfiguration_count
+    {
+        std::size_t memory_depth = 0;
+        std::size_t channels = 0;
+        std::size_t mode = 0;
+    };
+
+    // Steps that change the memory depth, the channels or the mode when run in this order
+    reconfiguration_count count(scope_configuration configuration, const std::vector<const plan_step *> &order)
+    {
+        reconfiguration_count total;
+        for (const plan_step *step : order)
+        {
+            const reconfiguration change = changes(configuration, *step);
+            total.memory_depth += change.memory_depth;
+            total.channels += change.channels != 0;
+            total.mode += change.mode;
+            advance(configuration, *step);
+        }
+        return total;
+    }
+
+    // Greedy, always runs the cheapest step next, in plan order among equally cheap ones
+    std::vector<const plan_step *> order_steps(const capture_plan &plan, scope_configuration configuration)
+    {
+        std::vector<const plan_step *> remaining;
+        for (const plan_step &step : plan.steps)
+            remaining.push_back(&step);
+        if (!plan.reorder)
+            return remaining;
+
+        std::vector<const plan_step *> order;
+        while (!remaining.empty())
+        {
+            auto best = remaining.begin();
+            unsigned best_cost = changes(configuration, **best).cost();
+            for (auto it = remaining.begin() + 1; it != remaining.end() && best_cost != 0; ++it)
+            {
+                const unsigned cost = changes(configuration, **it).cost();
+                if (cost < best_cost)
+                {
+                    best = it;
+                    best_cost = cost;
+                }
+            }
+
+            order.push_back(*best);
+            advance(configuration, **best);
+            remaining.erase(best);
+        }
+        return order;
+    }
+
+    scope_configuration read_configuration(rigol::scope &scope)
+    {
+        scope_configuration configuration;
+        try
+        {
+            configuration.memory_depth = scope.memory_depth();
+        }
+        catch (const std::logic_error &)
+        {
+            // AUTO, the first step that sets a depth changes it
+        }
+
+        for (auto ch : {rigol::channel::CHANNEL_1, rigol::channel::CHANNEL_2, rigol::channel::CHANNEL_3,
+                        rigol::channel::CHANNEL_4})
+        {
+            if (scope.channel_enabled(ch))
+                configuration.channels.push_back(ch);
+        }
+        return configuration;
+    }
+
+    // Returns whether the scope's setup has to be learned again
+    bool configure(rigol::scope &scope, scope_configuration &configuration, const plan_step &step)
+    {
+        const reconfiguration change = changes(configuration, step);
+        if (change.channels)
+        {
+            const std::vector<rigol::channel> channels = enabled_channels(step);
+            for (auto ch : {rigol::channel::CHANNEL_1, rigol::channel::CHANNEL_2, rigol::channel::CHANNEL_3,
+                            rigol::channel::CHANNEL_4})
+            {
+                const bool enabled = std::binary_search(channels.begin(), channels.end(), ch);
+                if (enabled != std::binary_search(configuration.channels.begin(), configuration.channels.end(), ch))
+                    scope.enable_channel(ch, enabled);
+            }
+        }
+
+        // After the channels, the depths the scope offers depend on how many are enabled
+        if (change.memory_depth)
+        {
+            spdlog::info("Setting memory depth to {}", *step.memory_depth);
+            scope.set_memory_depth(*step.memory_depth);
+        }
+
+        advance(configuration, step);
+        return change.memory_depth || change.channels;
+    }
+
+    void add(capture_timings &total, const capture_timings &step)
+    {
+        total.trigger_ms += step.trigger_ms;
+        total.detect_ms += step.detect_ms;
+        total.transfer_ms += step.transfer_ms;
+        total.write_ms += step.write_ms;
+        total.total_ms += step.total_ms;
+        total.output.writes += step.output.writes;
+        total.output.bytes += step.output.bytes;
+        total.output.max_queue_depth = std::max(total.output.max_queue_depth, step.output.max_queue_depth);
+        total.output.total_latency_ms += step.output.total_latency_ms;
+        total.output.max_latency_ms = std::max(total.output.max_latency_ms, step.output.max_latency_ms);
+        total.estimated_bytes = std::max(total.estimated_bytes, step.estimated_bytes);
+    }
+
+    // How a step fits its memory budget, ideally fully buffered so it can be stored while the next
+    // step is acquired. `bytes` is the planned footprint, 0 without a memory budget.
+    capture_strategy plan_step_memory(const plan_step &step, std::size_t memory_depth, std::size_t &bytes)
+    {
+        capture_strategy fastest = default_strategy(step.request);
+        fastest.buffered = true;
+        bytes = 0;
+        if (!step.request.memory_budget)
+            return fastest;
+
+        memory_estimate estimate;
+        const capture_strategy strategy = plan_memory(step.request, memory_depth, fastest, true, estimate);
+        bytes = estimate.total();
+        return strategy;
+    }
+
+    // The smaller of two memory budgets, 0 (unlimited) only when neither has one
+    std::size_t tighter_budget(std::size_t a, std::size_t b)
+    {
+        if (!a || !b)
+            return a ? a : b;
+        return std::min(a, b);
+    }
+} // namespace
+
+capture_plan read_plan(const std::string &path, const capture_request &defaults)
+{
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error(fmt::format("Cannot open plan {}", path));
+    std::stringstream text;
+    text << file.rdbuf();
+    const std::string content = text.str();
+
+    capture_plan plan;
+    parameters common;
+    std::vector<parameters> steps;
+    json_reader reader{content};
+    reader.object([&](const std::string &name) {
+        if (name == "reorder")
+            plan.reorder = reader.scalar() != "0";
+        else if (name == "defaults")
+            reader.object([&](const std::string &key) { common.emplace_back(key, reader.scalar()); });
+        else if (name == "steps")
+            reader.array([&] {
+                steps.emplace_back();
+                reader.object([&](const std::string &key) { steps.back().emplace_back(key, reader.scalar()); });
+            });
+        else
+            reader.fail(fmt::format("unknown plan member '{}'", name));
+    });
+    reader.finish();
+
+    if (steps.empty())
+        throw std::invalid_argument(fmt::format("Plan {} has no steps", path));
+
+    for (std::size_t i = 0; i < steps.size(); i++)
+    {
+        plan_step step;
+        step.number = i + 1;
+        step.request = defaults;
+        try
+        {
+            apply_parameters(step, common, steps[i]);
+            if (step.request.outfile.empty())
+                throw std::invalid_argument("no out file");
+            // Every other step is stored from a different arena, each with its own references
+            if (step.request.changes)
+                throw std::invalid_argument("plans cannot skip unchanged channels");
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw std::invalid_argument(fmt::format("Plan step {}: {}", step.number, ex.what()));
+        }
+        plan.steps.push_back(std::move(step));
+    }
+    return plan;
+}
+
+capture_timings run_plan(rigol::scope &scope, const capture_plan &plan, bool huge_pages)
+{
+    scope_configuration configuration = read_configuration(scope);
+    const std::vector<const plan_step *> order = order_steps(plan, configuration);
+
+    std::vector<const plan_step *> plan_order;
+    for (const plan_step &step : plan.steps)
+        plan_order.push_back(&step);
+    const reconfiguration_count needed = count(configuration, order);
+    const reconfiguration_count unordered = count(configuration, plan_order);
+    spdlog::info("Running {} step(s) with {} memory depth, {} channel and {} mode change(s) "
+                 "(in plan order {}, {} and {})",
+                 order.size(), needed.memory_depth, needed.channels, needed.mode, unordered.memory_depth,
+                 unordered.channels, unordered.mode);
+
+    // One arena is being stored while the next step is acquired into the other
+    capture_arena arenas[2]{capture_arena{huge_pages}, capture_arena{huge_pages}};
+    scope_setup setup;
+    bool learned = false;
+
+    capture_timings total;
+    std::future<capture_timings> pending;
+    const plan_step *pending_step = nullptr;
+    std::size_t pending_bytes = 0;
+    std::size_t current = 1;
+    // Steps are stored while the next one downloads, only the peak of the whole plan can be measured
+    memory_usage::overlapping_stages overlapping;
+    auto finish_pending = [&] {
+        const capture_timings timings = pending.get();
+        spdlog::info("Step {} stored in {} ({:.1f} ms from trigger)", pending_step->number,
+                     pending_step->request.outfile, timings.total_ms);
+        add(total, timings);
+    };
+
+    for (std::size_t i = 0; i < order.size(); i++)
+    {
+        const plan_step &step = *order[i];
+        spdlog::info("Step {} ({} of {}): {}", step.number, i + 1, order.size(), step.request.outfile);
+
+        // Steps capturing the digital lines need a setup learned with the pods on
+        if (configure(scope, configuration, step) || !learned || (step.request.logic && !setup.logic_preamble))
+        {
+            setup.learn(scope, enabled_channels(step), step.request.logic.has_value());
+            configuration.memory_depth = setup.memory_depth;
+            learned = true;
+        }
+        if (step.memory_depth && setup.memory_depth != *step.memory_depth)
+            throw std::runtime_error(fmt::format("Step {}: scope uses memory depth {} instead of {}", step.number,
+                                                 setup.memory_depth, *step.memory_depth));
+
+        // Steps whose captures do not fit the memory budget together run one after the other in one arena
+        std::size_t bytes = 0;
+        const capture_strategy strategy = plan_step_memory(step, setup.memory_depth, bytes);
+        const std::size_t budget =
+            tighter_budget(step.request.memory_budget, pending_step ? pending_step->request.memory_budget : 0);
+        if (pending.valid() && budget && pending_bytes + bytes > budget)
+        {
+            spdlog::info("Step {} waits for step {} to be stored, both need more than the memory budget", step.number,
+                         pending_step->number);
+            finish_pending();
+        }
+        else if (pending.valid() && !strategy.buffered)
+        {
+            spdlog::info("Step {} waits for step {} to be stored, it only fits the memory budget one channel at a "
+                         "time",
+                         step.number, pending_step->number);
+            finish_pending();
+        }
+        else
+        {
+            current ^= 1;
+        }
+
+        capture_arena &arena = arenas[current];
+        if (!strategy.buffered)
+        {
+            // Written while it downloads, nothing is left pending
+            const capture_timings timings = capture(scope, step.request, &setup, &arena);
+            spdlog::info("Step {} stored in {} ({:.1f} ms)", step.number, step.request.outfile, timings.total_ms);
+            add(total, timings);
+            continue;
+        }
+
+        acquisition acquired = acquire(scope, step.request, &setup, arena);
+
+        if (pending.valid())
+            finish_pending();
+        pending_step = &step;
+        pending_bytes = bytes;
+        pending = std::async(std::launch::async, [&step, &arena, acquired = std::move(acquired)]() mutable {
+            realtime::worker_thread();
+            return store(step.request, std::move(acquired), arena);
+        });
+    }
+    if (pending.valid())
+        finish_pending();
+
+    total.transfer_peak_rss = 0;
+    total.write_peak_rss = 0;
+    total.peak_rss = memory_usage::peak();
+    return total;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "capture.h"
+#include "scope.h"
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+// A sweep of captures run in one process over one connection. Plan files are JSON:
+//
+//   {
+//     "reorder": true,
+//     "defaults": {"format": "mat", "zlib": 1, "trigger": "single"},
+//     "steps": [
+//       {"out": "sweep/a.mat", "channels": "12", "memory_depth": 1200000},
+//       {"out": "sweep/b.mat", "channels": 1, "frames": 10, "preview": [16, 256]}
+//     ]
+//   }
+//
+// Steps take the daemon's request parameters plus "memory_depth", the command line options are
+// the defaults of the defaults. A step enables exactly the channels it reads.
+struct plan_step
+{
+    // Position in the plan file, steps are reported by it
+    std::size_t number = 0;
+    capture_request request;
+    // Left as it is when not given
+    std::optional<std::size_t> memory_depth;
+};
+
+struct capture_plan
+{
+    std::vector<plan_step> steps;
+    // Run the steps in the order that needs the fewest scope reconfigurations
+    bool reorder = true;
+};
+
+capture_plan read_plan(const std::string &path, const capture_request &defaults);
+
+// Runs every step, storing one step's output while the next one is armed and triggered. Returns
+// the timings of all steps added up.
+capture_timings run_plan(rigol::scope &scope, const capture_plan &plan, bool huge_pages = false);
@@ -0,0 +1,109 @@
+#include "preview.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <spdlog/fmt/fmt.h>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    constexpr std::size_t BASE_FACTOR = 16;
+
+    void base_level(const uint8_t *data, std::size_t count, uint8_t *min, uint8_t *max)
+    {
+        const std::size_t blocks = count / BASE_FACTOR;
+        std::size_t i = 0;
+
+#ifdef __SSE2__
+        for (; i < blocks; i++)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(data + i * BASE_FACTOR));
+            __m128i lo = _mm_min_epu8(v, _mm_srli_si128(v, 8));
+            __m128i hi = _mm_max_epu8(v, _mm_srli_si128(v, 8));
+            lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 4));
+            hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 4));
+            lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 2));
+            hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 2));
+            lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 1));
+            hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 1));
+            min[i] = (uint8_t)_mm_cvtsi128_si32(lo);
+            max[i] = (uint8_t)_mm_cvtsi128_si32(hi);
+        }
+#endif
+
+        for (; i * BASE_FACTOR < count; i++)
+        {
+            const uint8_t *begin = data + i * BASE_FACTOR;
+            const uint8_t *end = data + std::min(count, (i + 1) * BASE_FACTOR);
+            const auto [lo, hi] = std::minmax_element(begin, end);
+            min[i] = *lo;
+            max[i] = *hi;
+        }
+    }
+} // namespace
+
+std::vector<preview_level> build_preview(const uint8_t *data, std::size_t count,
+                                         const std::vector<std::size_t> &factors)
+{
+    preview_level base{BASE_FACTOR, {}, {}};
+    const std::size_t base_count = (count + BASE_FACTOR - 1) / BASE_FACTOR;
+    base.min.resize(base_count);
+    base.max.resize(base_count);
+    base_level(data, count, base.min.data(), base.max.data());
+
+    std::vector<preview_level> levels;
+    for (std::size_t factor : factors)
+    {
+        if (factor == 0 || factor % BASE_FACTOR != 0)
+            throw std::invalid_argument(fmt::format("Preview factor {} is not a multiple of {}", factor, BASE_FACTOR));
+
+        if (factor == BASE_FACTOR)
+        {
+            levels.push_back(base);
+            continue;
+        }
+
+        // Coarser levels only ever look at the 16x level, which is tiny compared to the input
+        const std::size_t group = factor / BASE_FACTOR;
+        preview_level level{factor, {}, {}};
+        level.min.resize((base_count + group - 1) / group);
+        level.max.resize(level.min.size());
+        for (std::size_t i = 0; i < level.min.size(); i++)
+        {
+            const std::size_t begin = i * group;
+            const std::size_t end = std::min(base_count, begin + group);
+            level.min[i] = *std::min_element(base.min.begin() + begin, base.min.begin() + end);
+            level.max[i] = *std::max_element(base.max.begin() + begin, base.max.begin() + end);
+        }
+        levels.push_back(std::move(level));
+    }
+
+    return levels;
+}
+
+std::vector<std::size_t> parse_preview_factors(const std::string &value)
+{
+    std::vector<std::size_t> factors;
+    std::size_t pos = 0;
+    while (pos < value.size())
+    {
+        std::size_t comma = value.find(',', pos);
+        if (comma == std::string::npos)
+            comma = value.size();
+
+        const std::string item = value.substr(pos, comma - pos);
+        char *end = nullptr;
+        const unsigned long factor = std::strtoul(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0' || factor == 0 || factor % BASE_FACTOR != 0)
+            throw std::invalid_argument(
+                fmt::format("'{}' is not a valid preview factor, expected a multiple of {}", item, BASE_FACTOR));
+
+        factors.push_back(factor);
+        pos = comma + 1;
+    }
+    return factors;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One level of a min/max decimation pyramid over raw ADC codes, entry i covers samples
+// [i * factor, (i + 1) * factor)
+struct preview_level
+{
+    std::size_t factor;
+    std::vector<uint8_t> min;
+    std::vector<uint8_t> max;
+};
+
+// Builds all requested levels in a single pass over `data`, every factor has to be a multiple of 16
+std::vector<preview_level> build_preview(const uint8_t *data, std::size_t count,
+                                         const std::vector<std::size_t> &factors);
+
+std::vector<std::size_t> parse_preview_factors(const std::string &value);
@@ -0,0 +1,166 @@
+#include "realtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    realtime_settings active_settings;
+    std::atomic<bool> active{false};
+
+    unsigned parse_cpu(std::string_view value)
+    {
+        if (value.empty() || value.find_first_not_of("0123456789") != std::string_view::npos)
+            throw std::invalid_argument(fmt::format("'{}' is not a valid CPU number", value));
+        return (unsigned)std::stoul(std::string(value));
+    }
+
+#ifdef __linux__
+    void pin(const std::vector<unsigned> &cpus, const char *thread)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned cpu : cpus)
+            CPU_SET(cpu, &set);
+
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+            spdlog::warn("Cannot pin {} thread: {}", thread, std::strerror(errno));
+    }
+#endif
+
+    void write_row(std::ostream &os, std::string_view name, const rigol::latency_histogram &hist)
+    {
+        os << fmt::format("{:<16} {:>8} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}\n", name,
+                          hist.count(), hist.min_ns() / 1e3, hist.percentile_ns(50) / 1e3,
+                          hist.percentile_ns(90) / 1e3, hist.percentile_ns(99) / 1e3, hist.percentile_ns(99.9) / 1e3,
+                          hist.max_ns() / 1e3);
+    }
+} // namespace
+
+void cycle_statistics::add(double detect_ms, double total_ms)
+{
+    trigger_detect.record((std::uint64_t)(detect_ms * 1e6));
+    cycle.record((std::uint64_t)(total_ms * 1e6));
+}
+
+void cycle_statistics::write(std::ostream &os, const rigol::connection_statistics &connection) const
+{
+    os << fmt::format("{:<16} {:>8} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "latency", "count", "min [us]",
+                      "p50 [us]", "p90 [us]", "p99 [us]", "p99.9 [us]", "max [us]");
+    write_row(os, "trigger detect", trigger_detect);
+
+    const auto chunks = connection.commands.find(":WAV:DATA?");
+    write_row(os, "waveform chunk", chunks != connection.commands.end() ? chunks->second : rigol::latency_histogram{});
+    write_row(os, "capture cycle", cycle);
+}
+
+namespace realtime
+{
+    realtime_settings parse_cpus(std::string_view value)
+    {
+        realtime_settings settings;
+        while (!value.empty())
+        {
+            const auto comma = value.find(',');
+            const std::string_view item = value.substr(0, comma);
+            value = comma == std::string_view::npos ? std::string_view{} : value.substr(comma + 1);
+
+            if (!settings.capture_cpu)
+            {
+                settings.capture_cpu = parse_cpu(item);
+                continue;
+            }
+
+            const auto dash = item.find('-');
+            const unsigned first = parse_cpu(item.substr(0, dash));
+            const unsigned last = dash == std::string_view::npos ? first : parse_cpu(item.substr(dash + 1));
+            if (last < first)
+                throw std::invalid_argument(fmt::format("'{}' is not a valid CPU range", item));
+            for (unsigned cpu = first; cpu <= last; cpu++)
+                settings.worker_cpus.push_back(cpu);
+        }
+
+        if (settings.capture_cpu &&
+            std::find(settings.worker_cpus.begin(), settings.worker_cpus.end(), *settings.capture_cpu) !=
+                settings.worker_cpus.end())
+            throw std::invalid_argument("The capture CPU cannot also be a worker CPU");
+        return settings;
+    }
+
+    void enable(const realtime_settings &settings)
+    {
+        if (settings.fifo_priority < 0 || settings.fifo_priority > 99)
+            throw std::invalid_argument("SCHED_FIFO priority has to be between 1 and 99");
+
+        active_settings = settings;
+        active = true;
+
+#ifdef __linux__
+        if (settings.capture_cpu)
+            pin({*settings.capture_cpu}, "capture");
+
+        if (settings.fifo_priority)
+        {
+            sched_param param{};
+            param.sched_priority = settings.fifo_priority;
+            const int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (error)
+                spdlog::warn("SCHED_FIFO is not permitted ({}), keeping the default scheduler", std::strerror(error));
+            else
+                spdlog::info("Capture thread runs with SCHED_FIFO priority {}", settings.fifo_priority);
+        }
+#else
+        if (settings.capture_cpu || settings.fifo_priority)
+            spdlog::warn("CPU pinning and SCHED_FIFO are only supported on Linux");
+#endif
+    }
+
+    bool enabled() { return active; }
+
+    void lock_memory()
+    {
+#ifdef __linux__
+        // Locking future mappings beyond the limit would make every later allocation fail
+        rlimit limit{};
+        const bool unlimited = geteuid() == 0 ||
+                               (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY);
+        if (mlockall(unlimited ? MCL_CURRENT | MCL_FUTURE : MCL_CURRENT) != 0)
+            spdlog::warn("Cannot lock memory: {}", std::strerror(errno));
+        else if (!unlimited)
+            spdlog::info("Locked current memory, RLIMIT_MEMLOCK leaves later allocations unlocked");
+#else
+        spdlog::warn("Locking memory is only supported on Linux");
+#endif
+    }
+
+    void worker_thread()
+    {
+#ifdef __linux__
+        if (active && !active_settings.worker_cpus.empty())
+            pin(active_settings.worker_cpus, "worker");
+#endif
+    }
+
+    unsigned hardware_threads()
+    {
+        // The calling thread does its share of the work as well
+        if (active && !active_settings.worker_cpus.empty())
+            return (unsigned)active_settings.worker_cpus.size() + 1;
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+} // namespace realtime
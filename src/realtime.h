@@ -0,0 +1,51 @@
+#pragma once
+
+#include "statistics.h"
+
+#include <optional>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+// Low-jitter mode. The thread talking to the scope can get a CPU (and SCHED_FIFO) of its own while
+// the threads compressing and writing output share the remaining ones, and memory is locked once
+// the capture buffers are allocated so no page fault lands in the middle of a download.
+struct realtime_settings
+{
+    // CPU of the thread that talks to the scope
+    std::optional<unsigned> capture_cpu;
+    // CPUs of compression, spectrum and writer threads, empty leaves them unpinned
+    std::vector<unsigned> worker_cpus;
+    // SCHED_FIFO priority (1-99) of the capture thread, 0 keeps the default scheduler
+    int fifo_priority = 0;
+};
+
+// Latencies a realtime run is judged by, printed when it ends
+struct cycle_statistics
+{
+    // From the last trigger poll that still saw the scope running to noticing that it stopped
+    rigol::latency_histogram trigger_detect;
+    // Whole captures, trigger to output closed
+    rigol::latency_histogram cycle;
+
+    void add(double detect_ms, double total_ms);
+    // Also prints the per chunk :WAV:DATA? latencies of `connection`
+    void write(std::ostream &os, const rigol::connection_statistics &connection) const;
+};
+
+namespace realtime
+{
+    // "CAPTURE[,WORKER...]" with ranges allowed among the workers, e.g. "2,3-5", empty pins nothing
+    realtime_settings parse_cpus(std::string_view value);
+
+    // Pins and schedules the calling thread, helper threads started later follow worker_thread()
+    void enable(const realtime_settings &settings);
+    bool enabled();
+    // Locks all current (and where the limit allows, future) memory, call once buffers are reserved
+    void lock_memory();
+
+    // Called first by every helper thread, moves it onto the worker CPUs when enabled
+    void worker_thread();
+    // Default number of helper threads, the worker CPUs if pinned
+    unsigned hardware_threads();
+} // namespace realtime
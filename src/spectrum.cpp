@@ -0,0 +1,145 @@
+#include "spectrum.h"
+#include "fft.h"
+#include "realtime.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <spdlog/fmt/fmt.h>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+    constexpr double PI = 3.14159265358979323846;
+
+    std::vector<double> make_window(spectrum_window type, std::size_t size)
+    {
+        std::vector<double> window(size);
+        for (std::size_t n = 0; n < size; n++)
+        {
+            const double x = 2 * PI * n / size;
+            switch (type)
+            {
+            case spectrum_window::RECTANGULAR:
+                window[n] = 1;
+                break;
+            case spectrum_window::HANN:
+                window[n] = 0.5 - 0.5 * std::cos(x);
+                break;
+            case spectrum_window::HAMMING:
+                window[n] = 0.54 - 0.46 * std::cos(x);
+                break;
+            case spectrum_window::BLACKMAN:
+                window[n] = 0.42 - 0.5 * std::cos(x) + 0.08 * std::cos(2 * x);
+                break;
+            }
+        }
+        return window;
+    }
+} // namespace
+
+void check_spectrum_settings(const spectrum_settings &settings)
+{
+    if (settings.segment < 4 || (settings.segment & (settings.segment - 1)))
+        throw std::invalid_argument(
+            fmt::format("Spectrum segment of {} samples is not a power of two of at least 4", settings.segment));
+    if (!(settings.overlap >= 0 && settings.overlap < 1))
+        throw std::invalid_argument(fmt::format("Spectrum overlap {} is not in [0, 1)", settings.overlap));
+}
+
+power_spectrum welch_spectrum(const uint8_t *data, std::size_t points, std::size_t frames,
+                              const rigol::preamble &pre, const spectrum_settings &settings)
+{
+    check_spectrum_settings(settings);
+    rigol::trace::span span{"spectrum", "convert"};
+
+    const std::size_t size = settings.segment;
+    const std::size_t step = std::max<std::size_t>(1, (std::size_t)std::lround(size * (1 - settings.overlap)));
+
+    std::vector<const uint8_t *> segments;
+    for (std::size_t frame = 0; frame < frames; frame++)
+    {
+        for (std::size_t start = 0; start + size <= points; start += step)
+            segments.push_back(data + frame * points + start);
+    }
+    if (segments.empty())
+        throw std::invalid_argument(
+            fmt::format("Spectrum segment of {} samples is longer than the waveform of {} points", size, points));
+
+    const fft transform{size};
+    const std::vector<double> window = make_window(settings.window, size);
+    std::array<double, 256> volts;
+    for (std::size_t code = 0; code < volts.size(); code++)
+        volts[code] = (code - pre.y_reference - pre.y_origin) * pre.y_increment;
+
+    unsigned threads = settings.threads ? settings.threads : realtime::hardware_threads();
+    threads = (unsigned)std::min<std::size_t>(threads, segments.size());
+
+    // Every thread sums its own contiguous share of the segments
+    std::vector<std::vector<double>> sums(threads, std::vector<double>(transform.bins()));
+    auto worker = [&](unsigned t) {
+        fft::workspace work;
+        std::vector<double> input(size);
+        const std::size_t from = segments.size() * t / threads;
+        const std::size_t to = segments.size() * (t + 1) / threads;
+        for (std::size_t s = from; s < to; s++)
+        {
+            const uint8_t *raw = segments[s];
+            for (std::size_t n = 0; n < size; n++)
+                input[n] = volts[raw[n]] * window[n];
+            transform.add_power(input.data(), sums[t].data(), work);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++)
+        pool.emplace_back([&worker, t] {
+            realtime::worker_thread();
+            worker(t);
+        });
+    worker(0);
+    for (std::thread &thread : pool)
+        thread.join();
+
+    double window_power = 0;
+    for (double w : window)
+        window_power += w * w;
+
+    const double rate = 1 / pre.x_increment;
+    const double scale = 1 / (rate * window_power * segments.size());
+
+    power_spectrum result;
+    result.segments = segments.size();
+    result.frequency.resize(transform.bins());
+    result.density.resize(transform.bins());
+    for (std::size_t k = 0; k < transform.bins(); k++)
+    {
+        double sum = 0;
+        for (const auto &partial : sums)
+            sum += partial[k];
+
+        // Energy of the negative frequencies folded onto the positive ones, DC and Nyquist are unique
+        const bool unique = k == 0 || k == transform.bins() - 1;
+        result.frequency[k] = k * rate / size;
+        result.density[k] = sum * scale * (unique ? 1 : 2);
+    }
+
+    return result;
+}
+
+spectrum_window parse_spectrum_window(const std::string &value)
+{
+    if (value == "rect")
+        return spectrum_window::RECTANGULAR;
+    if (value == "hann")
+        return spectrum_window::HANN;
+    if (value == "hamming")
+        return spectrum_window::HAMMING;
+    if (value == "blackman")
+        return spectrum_window::BLACKMAN;
+
+    throw std::invalid_argument(
+        fmt::format("'{}' is not a valid window, expected rect, hann, hamming or blackman", value));
+}
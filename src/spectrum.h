@@ -0,0 +1,44 @@
+#pragma once
+
+#include "scope.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class spectrum_window
+{
+    RECTANGULAR,
+    HANN,
+    HAMMING,
+    BLACKMAN,
+};
+
+struct spectrum_settings
+{
+    // Samples per segment, a power of two
+    std::size_t segment = 4096;
+    spectrum_window window = spectrum_window::HANN;
+    // Fraction of a segment shared with the next one
+    double overlap = 0.5;
+    // 0 uses every hardware thread
+    unsigned threads = 0;
+};
+
+// One-sided power spectral density in V^2/Hz
+struct power_spectrum
+{
+    std::vector<double> frequency;
+    std::vector<double> density;
+    std::size_t segments = 0;
+};
+
+// Welch estimate of `frames` frames of `points` raw codes each, averaged over the (periodic) windowed
+// segments of all frames, no segment spans two frames. The segments are split between threads.
+power_spectrum welch_spectrum(const uint8_t *data, std::size_t points, std::size_t frames,
+                              const rigol::preamble &preamble, const spectrum_settings &settings);
+
+spectrum_window parse_spectrum_window(const std::string &value);
+// Throws std::invalid_argument for settings welch_spectrum() cannot use
+void check_spectrum_settings(const spectrum_settings &settings);
@@ -0,0 +1,68 @@
+#include "waveform_statistics.h"
+
+#include <algorithm>
+#include <cmath>
+
+void waveform_statistics::add(const uint8_t *data, std::size_t count)
+{
+    // Four interleaved tables so consecutive equal codes (the common case on a quiet signal) do not
+    // serialise on the same counter
+    std::array<std::array<uint32_t, 256>, 4> tables{};
+    constexpr std::size_t FLUSH_INTERVAL = std::size_t(1) << 30;
+
+    std::size_t i = 0;
+    while (i < count)
+    {
+        const std::size_t end = std::min(count, i + FLUSH_INTERVAL);
+        for (; i + 4 <= end; i += 4)
+        {
+            tables[0][data[i]]++;
+            tables[1][data[i + 1]]++;
+            tables[2][data[i + 2]]++;
+            tables[3][data[i + 3]]++;
+        }
+        for (; i < end; i++)
+            tables[0][data[i]]++;
+
+        for (std::size_t code = 0; code < 256; code++)
+        {
+            histogram[code] += tables[0][code] + tables[1][code] + tables[2][code] + tables[3][code];
+            tables[0][code] = tables[1][code] = tables[2][code] = tables[3][code] = 0;
+        }
+    }
+
+    this->count += count;
+}
+
+void waveform_statistics::finish(const rigol::preamble &pre)
+{
+    if (count == 0)
+        return;
+
+    auto volts = [&](std::size_t code) { return (code - pre.y_reference - pre.y_origin) * pre.y_increment; };
+
+    double sum = 0;
+    double sum_squares = 0;
+    bool first = true;
+    for (std::size_t code = 0; code < 256; code++)
+    {
+        if (histogram[code] == 0)
+            continue;
+
+        if (first)
+            min_code = (uint8_t)code;
+        max_code = (uint8_t)code;
+        first = false;
+
+        const double v = volts(code);
+        sum += v * histogram[code];
+        sum_squares += v * v * histogram[code];
+    }
+
+    min = volts(min_code);
+    max = volts(max_code);
+    mean = sum / count;
+    rms = std::sqrt(sum_squares / count);
+    std_dev = std::sqrt(std::max(0.0, sum_squares / count - mean * mean));
+    peak_to_peak = max - min;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "scope.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Everything is derived from the histogram of raw codes, which is all a single pass has to build
+struct waveform_statistics
+{
+    std::array<uint64_t, 256> histogram{};
+    uint64_t count = 0;
+
+    uint8_t min_code = 0;
+    uint8_t max_code = 0;
+    double min = 0;
+    double max = 0;
+    double mean = 0;
+    double rms = 0;
+    double std_dev = 0;
+    double peak_to_peak = 0;
+
+    void add(const uint8_t *data, std::size_t count);
+    void finish(const rigol::preamble &preamble);
+};
@@ -0,0 +1,98 @@
+#include "capture.h"
+#include "fake_connection.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <spdlog/spdlog.h>
+
+// Counts the heap allocations of a capture against the fake scope once its buffers have grown.
+// The trigger poll and the download chunk loop must not allocate, every call would otherwise
+// show up for each poll and for each chunk of a deep memory download.
+namespace
+{
+    std::atomic<bool> counting{false};
+    std::atomic<std::size_t> allocations{0};
+
+    void *allocate(std::size_t size, std::size_t alignment)
+    {
+        if (counting)
+            allocations++;
+
+        void *memory = alignment > alignof(std::max_align_t)
+                           ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+                           : std::malloc(size ? size : 1);
+        if (!memory)
+            throw std::bad_alloc();
+        return memory;
+    }
+
+    template <typename Function> std::size_t count_allocations(Function &&function)
+    {
+        allocations = 0;
+        counting = true;
+        function();
+        counting = false;
+        return allocations;
+    }
+
+    int failures = 0;
+
+    void expect_no_allocations(const char *name, std::size_t count)
+    {
+        std::printf("%-24s %zu allocations\n", name, count);
+        if (count)
+            failures++;
+    }
+} // namespace
+
+void *operator new(std::size_t size) { return allocate(size, alignof(std::max_align_t)); }
+void *operator new(std::size_t size, std::align_val_t alignment) { return allocate(size, (std::size_t)alignment); }
+void operator delete(void *memory) noexcept { std::free(memory); }
+void operator delete(void *memory, std::size_t) noexcept { std::free(memory); }
+void operator delete(void *memory, std::align_val_t) noexcept { std::free(memory); }
+void operator delete(void *memory, std::size_t, std::align_val_t) noexcept { std::free(memory); }
+
+int main()
+{
+    spdlog::set_level(spdlog::level::off);
+
+    // Several chunks per download
+    constexpr std::size_t points = 1'000'000;
+    constexpr rigol::channel ch = rigol::channel::CHANNEL_1;
+    rigol::scope scope{std::make_unique<fake_connection>(points)};
+
+    scope_setup setup;
+    setup.learn(scope, {ch});
+    channel_data data;
+
+    const auto capture_frames = [&] {
+        data.raw.clear();
+        data.frames = 0;
+        for (int frame = 0; frame < 2; frame++)
+        {
+            wait_for_trigger(scope, trigger_mode::STOP);
+            read_channel_data(scope, ch, data, &setup);
+        }
+    };
+    const auto stream_frame = [&] {
+        std::size_t received = 0;
+        scope.stream_buffer(
+            points, [&](const rigol::waveform_chunk &chunk) { received += chunk.size; }, &data.preamble);
+        if (received != points)
+            std::abort();
+    };
+    // Both run once up front to grow the buffers of the connection, the scope and the frame storage
+    capture_frames();
+    stream_frame();
+
+    expect_no_allocations("trigger poll", count_allocations([&] {
+                              for (int poll = 0; poll < 1000; poll++)
+                                  scope.get_trigger_state();
+                          }));
+    expect_no_allocations("capture", count_allocations(capture_frames));
+    expect_no_allocations("chunk loop", count_allocations(stream_frame));
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+#include "capture.h"
+#include "plan.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+// Daemon requests and plan steps are applied key by key with set_request_parameter, keys that
+// only adjust a mode must not switch that mode on
+namespace
+{
+    int failures = 0;
+
+    void expect(bool condition, const char *what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+            failures++;
+        }
+    }
+
+    bool rejected(capture_request &request, std::string_view key, std::string_view value)
+    {
+        try
+        {
+            set_request_parameter(request, key, value);
+        }
+        catch (const std::invalid_argument &)
+        {
+            return true;
+        }
+        return false;
+    }
+
+    void test_events()
+    {
+        capture_request request;
+        expect(rejected(request, "threshold", "0.5"), "threshold without events is rejected");
+        expect(rejected(request, "hysteresis", "0.1"), "hysteresis without events is rejected");
+        expect(rejected(request, "window", "10,10"), "window without events is rejected");
+        expect(!request.events, "event mode stays off");
+
+        set_request_parameter(request, "events", "falling");
+        set_request_parameter(request, "threshold", "0.5");
+        set_request_parameter(request, "window", "10,20");
+        expect(request.events && request.events->edge == event_edge::FALLING, "events= enables event mode");
+        expect(request.events->threshold == 0.5, "threshold adjusts event mode");
+        expect(request.events->pre == 10 && request.events->post == 20, "window adjusts event mode");
+    }
+
+    void test_spectrum()
+    {
+        capture_request request;
+        request.format = output_format::MAT73;
+        set_request_parameter(request, "threads", "3");
+        expect(!request.spectrum, "threads does not enable spectra");
+        expect(request.mat73.threads == 3, "threads sets the MAT 7.3 compression threads");
+        expect(rejected(request, "spectrum_window", "hamming"), "spectrum_window without spectrum is rejected");
+        expect(rejected(request, "overlap", "0.25"), "overlap without spectrum is rejected");
+        expect(!request.spectrum, "spectra stay off");
+
+        set_request_parameter(request, "spectrum", "1024");
+        expect(request.spectrum && request.spectrum->segment == 1024, "spectrum= enables spectra");
+        expect(request.spectrum->threads == 3, "spectra use the threads given before");
+        set_request_parameter(request, "overlap", "0.25");
+        set_request_parameter(request, "threads", "2");
+        expect(request.spectrum->overlap == 0.25, "overlap adjusts spectra");
+        expect(request.spectrum->threads == 2 && request.mat73.threads == 2, "threads sets both thread counts");
+    }
+
+    void test_decimation()
+    {
+        capture_request request;
+        set_request_parameter(request, "decimate_taps", "16");
+        set_request_parameter(request, "cutoff", "0.5");
+        expect(!request.decimation, "filter settings do not enable decimation");
+        expect(rejected(request, "cutoff", "x"), "invalid cutoff is rejected");
+
+        set_request_parameter(request, "decimate", "4");
+        expect(request.decimation && request.decimation->factor == 4, "decimate= enables decimation");
+        expect(request.decimation->taps == 16 && request.decimation->cutoff == 0.5,
+               "decimation uses the filter settings given before");
+        set_request_parameter(request, "cutoff", "0.6");
+        expect(request.decimation->cutoff == 0.6, "cutoff adjusts decimation");
+
+        set_request_parameter(request, "decimate", "1");
+        set_request_parameter(request, "decimate_taps", "24");
+        expect(!request.decimation, "decimate=1 turns decimation off");
+        set_request_parameter(request, "decimate", "2");
+        expect(request.decimation->taps == 24 && request.decimation->cutoff == 0.6,
+               "filter settings are kept while decimation is off");
+    }
+
+    void test_logic()
+    {
+        capture_request request;
+        expect(rejected(request, "logic_lines", "0"), "logic_lines without logic is rejected");
+        expect(rejected(request, "logic_edges", "1"), "logic_edges without logic is rejected");
+        expect(!request.logic, "logic capture stays off");
+
+        set_request_parameter(request, "logic", "1");
+        set_request_parameter(request, "logic_lines", "1");
+        set_request_parameter(request, "logic_edges", "1");
+        expect(request.logic && request.logic->lines && request.logic->edges, "logic keys adjust logic capture");
+
+        set_request_parameter(request, "logic", "0");
+        expect(!request.logic, "logic=0 turns logic capture off");
+        expect(rejected(request, "logic_lines", "0"), "logic_lines after logic=0 is rejected");
+    }
+
+    void test_memory_budget()
+    {
+        capture_request request;
+        set_request_parameter(request, "memory_budget", "64M");
+        expect(request.memory_budget == 64u << 20, "memory_budget takes a suffix");
+        expect(rejected(request, "memory_budget", "17179869184G"), "a size overflowing with its suffix is rejected");
+        expect(rejected(request, "memory_budget", "18446744073709551615K"), "a size overflowing by K is rejected");
+        expect(request.memory_budget == 64u << 20, "a rejected memory size leaves the budget alone");
+    }
+
+    // Plan defaults and steps list keys in any order, the mode keys are applied first
+    void test_plan_order()
+    {
+        const std::filesystem::path path = std::filesystem::temp_directory_path() / "request_parameter_test.json";
+        {
+            std::ofstream plan{path};
+            plan << R"({"defaults": {"threshold": 0.5},
+                        "steps": [{"out": "a.mat", "window": "10,20", "events": "rising"},
+                                  {"out": "b.mat", "threshold": 0.7, "events": "falling"}]})";
+        }
+        const capture_plan plan = read_plan(path.string(), capture_request{});
+        std::filesystem::remove(path);
+
+        const capture_request &first = plan.steps[0].request;
+        expect(first.events && first.events->threshold == 0.5, "defaults adjust the mode a step enables");
+        expect(first.events && first.events->pre == 10 && first.events->post == 20,
+               "keys before the mode key adjust the mode");
+        const capture_request &second = plan.steps[1].request;
+        expect(second.events && second.events->edge == event_edge::FALLING && second.events->threshold == 0.7,
+               "step values replace the defaults");
+    }
+} // namespace
+
+int main()
+{
+    test_events();
+    test_spectrum();
+    test_decimation();
+    test_logic();
+    test_memory_budget();
+    test_plan_order();
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
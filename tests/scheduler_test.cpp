@@ -0,0 +1,206 @@
+#include "fake_connection.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs the command scheduler against the fake scope and checks the command lines it wrote: jobs
+// run by priority, queries only slip in between two :WAV:DATA? blocks, identical queries share
+// one round trip and jobs left queued on destruction report a broken promise.
+namespace
+{
+    int failures = 0;
+
+    void expect(bool condition, const char *what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+            failures++;
+        }
+    }
+
+    // Records every command line, `on_block` runs on the worker thread before a :WAV:DATA? is answered
+    class recording_connection : public fake_connection
+    {
+        std::string m_line;
+
+      public:
+        std::vector<std::string> lines;
+        std::function<void()> on_block;
+
+        using fake_connection::fake_connection;
+
+      protected:
+        std::size_t write(const std::uint8_t *buffer, std::size_t max_len) override
+        {
+            for (std::size_t i = 0; i < max_len; i++)
+            {
+                if (buffer[i] != '\n')
+                {
+                    m_line.push_back((char)buffer[i]);
+                    continue;
+                }
+
+                lines.push_back(m_line);
+                if (m_line == ":WAV:DATA?" && on_block)
+                    on_block();
+                m_line.clear();
+            }
+            return fake_connection::write(buffer, max_len);
+        }
+    };
+
+    // Keeps the worker busy until released, so the jobs queued meanwhile are ordered by the scheduler
+    struct gate
+    {
+        std::promise<void> started;
+        std::promise<void> release;
+
+        explicit gate(rigol::command_scheduler &scheduler)
+        {
+            scheduler.submit(rigol::command_priority::INTERACTIVE,
+                             [this, released = release.get_future()](rigol::connection &) {
+                                 started.set_value();
+                                 released.wait();
+                             });
+            started.get_future().wait();
+        }
+    };
+
+    struct fixture
+    {
+        recording_connection *connection;
+        rigol::command_scheduler scheduler;
+
+        explicit fixture(std::size_t memory_depth)
+            : connection(new recording_connection(memory_depth)),
+              scheduler(std::unique_ptr<rigol::connection>(connection))
+        {
+        }
+    };
+
+    void test_priority()
+    {
+        fixture f{1};
+        gate g{f.scheduler};
+        auto bulk = f.scheduler.send(":BULK", rigol::command_priority::BULK);
+        auto normal = f.scheduler.send(":NORMAL", rigol::command_priority::NORMAL);
+        auto second = f.scheduler.send(":SECOND", rigol::command_priority::NORMAL);
+        auto interactive = f.scheduler.send(":INTERACTIVE", rigol::command_priority::INTERACTIVE);
+        g.release.set_value();
+        bulk.get();
+
+        expect(f.connection->lines == std::vector<std::string>{":INTERACTIVE", ":NORMAL", ":SECOND", ":BULK"},
+               "jobs run by priority, in submission order within a priority");
+    }
+
+    void test_coalescing()
+    {
+        fixture f{1};
+        gate g{f.scheduler};
+        auto first = f.scheduler.query(":TRIG:STAT?");
+        auto second = f.scheduler.query(":TRIG:STAT?");
+        auto other = f.scheduler.query(":ACQ:MDEP?");
+        g.release.set_value();
+
+        expect(first.get() == "STOP" && second.get() == "STOP", "coalesced queries share the answer");
+        expect(other.get() == "1", "different queries are not coalesced");
+        expect(std::count(f.connection->lines.begin(), f.connection->lines.end(), ":TRIG:STAT?") == 1,
+               "identical queued queries are sent once");
+        expect(f.scheduler.statistics().coalesced == 1, "coalesced queries are counted");
+
+        // Once sent, the next caller gets a fresh answer
+        f.scheduler.query(":TRIG:STAT?").get();
+        expect(std::count(f.connection->lines.begin(), f.connection->lines.end(), ":TRIG:STAT?") == 2,
+               "a query asked after the answer is sent again");
+    }
+
+    void test_download()
+    {
+        constexpr std::size_t points = 2'000'000;
+        constexpr std::size_t block_size = 100'000;
+        fixture f{points};
+        std::vector<std::uint8_t> buffer(points);
+
+        // Every block queues a query and a command, both have to run before the next block
+        std::vector<std::shared_future<std::string>> answers;
+        std::vector<std::future<void>> sent;
+        f.connection->on_block = [&] {
+            answers.push_back(f.scheduler.query(":TRIG:STAT?"));
+            sent.push_back(f.scheduler.send(":WAV:FORM BYTE"));
+        };
+        f.scheduler.read_waveform(buffer.data(), points, block_size).get();
+        for (auto &a : sent)
+            a.get();
+
+        expect(buffer == f.connection->waveform(), "the waveform arrives intact");
+        expect(std::all_of(answers.begin(), answers.end(), [](auto &a) { return a.get() == "STOP"; }),
+               "queries during the download are answered");
+
+        // Each block is :WAV:START, :WAV:STOP and :WAV:DATA? in a row, other jobs only run in between
+        const auto &lines = f.connection->lines;
+        std::size_t blocks = 0;
+        bool contiguous = true;
+        for (std::size_t i = 0; i < lines.size(); i++)
+        {
+            if (lines[i].rfind(":WAV:START ", 0) != 0)
+                continue;
+            contiguous &= i + 2 < lines.size() && lines[i + 1].rfind(":WAV:STOP ", 0) == 0 &&
+                          lines[i + 2] == ":WAV:DATA?";
+            blocks++;
+        }
+        expect(blocks == points / block_size, "the download is read in blocks");
+        expect(contiguous, "nothing runs inside a :WAV:DATA? block");
+
+        const auto statistics = f.scheduler.statistics();
+        expect(statistics.interleaved == 2 * (blocks - 1), "jobs queued during the download run between blocks");
+    }
+
+    void test_destruction()
+    {
+        auto f = std::make_unique<fixture>(1);
+        gate g{f->scheduler};
+        std::shared_future<std::string> dropped = f->scheduler.query(":TRIG:STAT?");
+
+        // The destructor stops the worker before the gate opens, the query is never sent
+        std::thread opener([&g] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            g.release.set_value();
+        });
+        f.reset();
+        opener.join();
+
+        bool broken = false;
+        try
+        {
+            dropped.get();
+        }
+        catch (const std::future_error &ex)
+        {
+            broken = ex.code() == std::future_errc::broken_promise;
+        }
+        expect(broken, "queued jobs report a broken promise on destruction");
+    }
+} // namespace
+
+int main()
+{
+    spdlog::set_level(spdlog::level::off);
+
+    test_priority();
+    test_coalescing();
+    test_download();
+    test_destruction();
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}